@@ -1,6 +1,7 @@
 #include "acpi.h"
 #include "klog.h"
 #include "io.h"
+#include "paging.h"
 
 typedef struct {
     char signature[8];
@@ -82,7 +83,7 @@ void* acpi_find_table(const char signature[4])
         uint64_t* ptrs = (uint64_t*)((uint8_t*)xsdt + sizeof(AcpiSdtHeader));
 
         for (uint32_t i = 0; i < entries; i++) {
-            AcpiSdtHeader* table = (AcpiSdtHeader*)ptrs[i];
+            AcpiSdtHeader* table = (AcpiSdtHeader*)phys_to_virt(ptrs[i]);
             if (table_valid(table) && memeq(table->signature, signature, 4))
                 return table;
         }
@@ -93,7 +94,7 @@ void* acpi_find_table(const char signature[4])
         uint32_t* ptrs = (uint32_t*)((uint8_t*)rsdt + sizeof(AcpiSdtHeader));
 
         for (uint32_t i = 0; i < entries; i++) {
-            AcpiSdtHeader* table = (AcpiSdtHeader*)(uint64_t)ptrs[i];
+            AcpiSdtHeader* table = (AcpiSdtHeader*)phys_to_virt(ptrs[i]);
             if (table_valid(table) && memeq(table->signature, signature, 4))
                 return table;
         }
@@ -115,7 +116,7 @@ static void list_tables(void)
         uint64_t* ptrs = (uint64_t*)((uint8_t*)xsdt + sizeof(AcpiSdtHeader));
         klog_info("ACPI XSDT tables:");
         for (uint32_t i = 0; i < entries; i++) {
-            AcpiSdtHeader* table = (AcpiSdtHeader*)ptrs[i];
+            AcpiSdtHeader* table = (AcpiSdtHeader*)phys_to_virt(ptrs[i]);
             if (table_valid(table))
                 print_signature(table->signature);
         }
@@ -127,7 +128,7 @@ static void list_tables(void)
         uint32_t* ptrs = (uint32_t*)((uint8_t*)rsdt + sizeof(AcpiSdtHeader));
         klog_info("ACPI RSDT tables:");
         for (uint32_t i = 0; i < entries; i++) {
-            AcpiSdtHeader* table = (AcpiSdtHeader*)(uint64_t)ptrs[i];
+            AcpiSdtHeader* table = (AcpiSdtHeader*)phys_to_virt(ptrs[i]);
             if (table_valid(table))
                 print_signature(table->signature);
         }
@@ -159,8 +160,13 @@ static void parse_madt(void)
             break;
 
         if (hdr->type == 0 && hdr->length >= 8) {
+            uint8_t apic_id = *(uint8_t*)(entry + 3);
+            uint32_t cpu_flags = *(uint32_t*)(entry + 4);
             klog_info("MADT CPU local APIC entry");
-            g_madt.cpu_lapic_count++;
+            // bit0 enabled, bit1 online capable; anything else is a
+            // placeholder slot that must not be started
+            if ((cpu_flags & 0x3) && g_madt.cpu_lapic_count < ACPI_MAX_CPUS)
+                g_madt.cpu_lapic_ids[g_madt.cpu_lapic_count++] = apic_id;
         } else if (hdr->type == 1 && hdr->length >= 12) {
             uint32_t ioapic_addr = *(uint32_t*)(entry + 4);
             uint32_t gsi_base = *(uint32_t*)(entry + 8);
@@ -302,7 +308,7 @@ static void parse_fadt_poweroff(void)
     g_pm1a_cnt_port = (uint16_t)read_u32(f + 64);
     g_pm1b_cnt_port = (uint16_t)read_u32(f + 68);
 
-    AcpiSdtHeader* dsdt = (AcpiSdtHeader*)(uint64_t)dsdt_addr;
+    AcpiSdtHeader* dsdt = dsdt_addr ? (AcpiSdtHeader*)phys_to_virt(dsdt_addr) : 0;
     if (!dsdt || !table_valid(dsdt)) {
         klog_warn("ACPI DSDT invalid");
         return;
@@ -333,7 +339,7 @@ void acpi_init(BootInfo* bootInfo)
         return;
     }
 
-    RsdpV2* rsdp2 = (RsdpV2*)bootInfo->rsdp;
+    RsdpV2* rsdp2 = (RsdpV2*)phys_to_virt((uint64_t)bootInfo->rsdp);
     if (!memeq(rsdp2->first.signature, "RSD PTR ", 8)) {
         klog_error("ACPI RSDP signature invalid");
         return;
@@ -344,12 +350,13 @@ void acpi_init(BootInfo* bootInfo)
         return;
     }
 
-    rsdt = (AcpiSdtHeader*)(uint64_t)rsdp2->first.rsdt_address;
+    rsdt = rsdp2->first.rsdt_address
+         ? (AcpiSdtHeader*)phys_to_virt(rsdp2->first.rsdt_address) : 0;
 
     if (rsdp2->first.revision >= 2 &&
         rsdp2->length >= sizeof(RsdpV2) &&
         checksum(rsdp2, rsdp2->length) == 0) {
-        xsdt = (AcpiSdtHeader*)rsdp2->xsdt_address;
+        xsdt = (AcpiSdtHeader*)phys_to_virt(rsdp2->xsdt_address);
         klog_info("ACPI 2.0+ XSDT available");
     } else {
         klog_info("ACPI 1.0 RSDT available");
@@ -11,12 +11,15 @@ typedef struct {
     uint8_t valid;
 } AcpiIsoOverride;
 
+#define ACPI_MAX_CPUS 64
+
 typedef struct {
     uint8_t present;
     uint32_t lapic_addr;
     uint32_t ioapic_addr;
     uint32_t ioapic_gsi_base;
     uint32_t cpu_lapic_count;
+    uint8_t cpu_lapic_ids[ACPI_MAX_CPUS];
     uint32_t iso_count;
     AcpiIsoOverride iso[16];
 } AcpiMadtInfo;
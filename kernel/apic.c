@@ -2,6 +2,9 @@
 #include "mmio.h"
 #include "pic.h"
 #include "klog.h"
+#include "paging.h"
+#include "timer.h"
+#include "cpu.h"
 
 #define IA32_APIC_BASE_MSR 0x1B
 #define IA32_APIC_BASE_ENABLE (1ULL << 11)
@@ -9,50 +12,53 @@
 #define LAPIC_REG_ID       0x020
 #define LAPIC_REG_EOI      0x0B0
 #define LAPIC_REG_SVR      0x0F0
+#define LAPIC_REG_ICR_LOW  0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_TIMER_INIT 0x380
+#define LAPIC_REG_TIMER_CUR  0x390
+#define LAPIC_REG_TIMER_DIV  0x3E0
+
+#define LAPIC_LVT_MASKED       (1U << 16)
+#define LAPIC_TIMER_ONESHOT    (0U << 17)
+#define LAPIC_TIMER_DEADLINE   (2U << 17)
+#define LAPIC_TIMER_DIV_16     0x3
+#define IA32_TSC_DEADLINE_MSR  0x6E0
+
+// ICR delivery modes, level assert and the pending-delivery bit
+#define LAPIC_ICR_INIT     0x500
+#define LAPIC_ICR_STARTUP  0x600
+#define LAPIC_ICR_ASSERT   (1U << 14)
+#define LAPIC_ICR_PENDING  (1U << 12)
 
 #define IOAPIC_REGSEL      0x00
 #define IOAPIC_WINDOW      0x10
 #define IOAPIC_REG_VER     0x01
 
 static ApicAddresses g_addrs;
+static int g_timer_deadline = 0;
 
-static inline uint64_t rdmsr(uint32_t msr)
-{
-    uint32_t lo;
-    uint32_t hi;
-    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
-    return ((uint64_t)hi << 32) | lo;
-}
-
-static inline void wrmsr(uint32_t msr, uint64_t value)
-{
-    __asm__ volatile (
-        "wrmsr"
-        :
-        : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32))
-    );
-}
-
+// MMIO windows are reached through the direct map
 static uint32_t lapic_read(uint32_t reg)
 {
-    return mmio_read32((uint64_t)g_addrs.lapic_addr + reg);
+    return mmio_read32((uint64_t)phys_to_virt(g_addrs.lapic_addr) + reg);
 }
 
 static void lapic_write(uint32_t reg, uint32_t value)
 {
-    mmio_write32((uint64_t)g_addrs.lapic_addr + reg, value);
+    mmio_write32((uint64_t)phys_to_virt(g_addrs.lapic_addr) + reg, value);
 }
 
 static uint32_t ioapic_read(uint8_t reg)
 {
-    uint64_t base = (uint64_t)g_addrs.ioapic_addr;
+    uint64_t base = (uint64_t)phys_to_virt(g_addrs.ioapic_addr);
     mmio_write32(base + IOAPIC_REGSEL, reg);
     return mmio_read32(base + IOAPIC_WINDOW);
 }
 
 static void ioapic_write(uint8_t reg, uint32_t value)
 {
-    uint64_t base = (uint64_t)g_addrs.ioapic_addr;
+    uint64_t base = (uint64_t)phys_to_virt(g_addrs.ioapic_addr);
     mmio_write32(base + IOAPIC_REGSEL, reg);
     mmio_write32(base + IOAPIC_WINDOW, value);
 }
@@ -67,22 +73,56 @@ int apic_can_enable(void)
     return g_addrs.lapic_addr != 0 && g_addrs.ioapic_addr != 0;
 }
 
-int apic_enable(void)
+// Enables the local APIC of the calling CPU; every CPU has its own
+void apic_enable_local(void)
 {
-    if (!apic_can_enable())
-        return 0;
-
     uint64_t apic_base = rdmsr(IA32_APIC_BASE_MSR);
     apic_base |= IA32_APIC_BASE_ENABLE;
     wrmsr(IA32_APIC_BASE_MSR, apic_base);
 
     // Spurious Interrupt Vector Register: bit 8 enables LAPIC software.
     lapic_write(LAPIC_REG_SVR, 0x100 | 0xFF);
+}
+
+int apic_enable(void)
+{
+    if (!apic_can_enable())
+        return 0;
+
+    apic_enable_local();
 
     klog_info("APIC: local APIC enabled");
     return 1;
 }
 
+static void send_ipi(uint8_t apic_id, uint32_t low)
+{
+    lapic_write(LAPIC_REG_ICR_HIGH, (uint32_t)apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, low);
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING)
+        __asm__ volatile ("pause");
+}
+
+void apic_send_init(uint8_t apic_id)
+{
+    send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+}
+
+// Fixed delivery of vector to one CPU. The ICR is two writes, so an
+// interrupt in between must not send an IPI of its own.
+void apic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+    uint64_t flags = irq_save();
+    send_ipi(apic_id, LAPIC_ICR_ASSERT | vector);
+    irq_restore(flags);
+}
+
+// The target starts in real mode at page << 12
+void apic_send_startup(uint8_t apic_id, uint8_t page)
+{
+    send_ipi(apic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | page);
+}
+
 void apic_send_eoi(void)
 {
     if (!g_addrs.lapic_addr)
@@ -90,6 +130,66 @@ void apic_send_eoi(void)
     lapic_write(LAPIC_REG_EOI, 0);
 }
 
+// Counts the LAPIC timer (divide by 16) down from its maximum over a
+// PIT-timed wait; returns its rate in Hz
+uint64_t apic_timer_calibrate(uint32_t us)
+{
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_ONESHOT);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFFU);
+    timer_busy_wait_us(us);
+    uint32_t left = lapic_read(LAPIC_REG_TIMER_CUR);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+
+    return (uint64_t)(0xFFFFFFFFU - left) * 1000000ULL / us;
+}
+
+// TSC-deadline mode needs the CPU feature and a TSC that keeps one rate
+// through power states, or the calibrated rate would drift
+int apic_timer_has_tsc_deadline(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    if (!(c & (1U << 24)))
+        return 0;
+
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a < 0x80000007)
+        return 0;
+    cpuid(0x80000007, 0, &a, &b, &c, &d);
+    return (d & (1U << 8)) != 0;
+}
+
+// One-shot delivery on vector; deadline selects TSC-deadline mode
+void apic_timer_setup(uint8_t vector, int deadline)
+{
+    g_timer_deadline = deadline;
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, vector |
+                (deadline ? LAPIC_TIMER_DEADLINE : LAPIC_TIMER_ONESHOT));
+    // the SDM asks for a fence between the LVT write and the first
+    // deadline write
+    __asm__ volatile ("mfence" ::: "memory");
+}
+
+void apic_timer_arm_count(uint32_t count)
+{
+    lapic_write(LAPIC_REG_TIMER_INIT, count);
+}
+
+void apic_timer_arm_deadline(uint64_t tsc)
+{
+    wrmsr(IA32_TSC_DEADLINE_MSR, tsc);
+}
+
+void apic_timer_stop(void)
+{
+    if (g_timer_deadline)
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    else
+        lapic_write(LAPIC_REG_TIMER_INIT, 0);
+}
+
 void apic_mask_legacy_pic(void)
 {
     for (uint8_t i = 0; i < 16; i++)
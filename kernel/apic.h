@@ -12,10 +12,20 @@ typedef struct {
 void apic_set_addresses(ApicAddresses addrs);
 int  apic_can_enable(void);
 int  apic_enable(void);
+void apic_enable_local(void);
+void apic_send_init(uint8_t apic_id);
+void apic_send_startup(uint8_t apic_id, uint8_t page);
+void apic_send_ipi(uint8_t apic_id, uint8_t vector);
 void apic_send_eoi(void);
 void apic_mask_legacy_pic(void);
 int  apic_route_irq(uint32_t gsi, uint8_t vector, uint16_t flags);
 void apic_set_irq_mask(uint32_t gsi, int masked);
 uint8_t apic_lapic_id(void);
+uint64_t apic_timer_calibrate(uint32_t us);
+int  apic_timer_has_tsc_deadline(void);
+void apic_timer_setup(uint8_t vector, int deadline);
+void apic_timer_arm_count(uint32_t count);
+void apic_timer_arm_deadline(uint64_t tsc);
+void apic_timer_stop(void);
 
 #endif
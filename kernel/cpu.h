@@ -0,0 +1,80 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// tzcnt decodes as bsf on CPUs without BMI1; both agree for non-zero input.
+static inline uint64_t tzcnt64(uint64_t value)
+{
+    uint64_t r;
+    __asm__ ("tzcnt %1, %0" : "=r"(r) : "rm"(value) : "cc");
+    return r;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* a,
+                         uint32_t* b, uint32_t* c, uint32_t* d)
+{
+    __asm__ volatile ("cpuid"
+                      : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                      : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t read_cr3(void)
+{
+    uint64_t v;
+    __asm__ volatile ("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr3(uint64_t v)
+{
+    __asm__ volatile ("mov %0, %%cr3" :: "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+    uint64_t v;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v)
+{
+    __asm__ volatile ("mov %0, %%cr4" :: "r"(v) : "memory");
+}
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v)
+{
+    __asm__ volatile ("wrmsr"
+                      :: "c"(msr), "a"((uint32_t)v), "d"((uint32_t)(v >> 32)));
+}
+
+// disable interrupts, returning the previous RFLAGS for irq_restore
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & (1ULL << 9))
+        __asm__ volatile ("sti" ::: "memory");
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include "display.h"
 #include "font8x8_basic.h"
+#include "spinlock.h"
 
 // shadow buffer — declare as a large static array
 // 1920 * 1080 * 4 = ~8MB — needs to be allocated properly
@@ -22,6 +23,9 @@ static uint32_t  bg_color = 0x00303030;
 static uint8_t dirty_rows[2160] = {0};  // one bit per row, supports up to 2160 rows
 static uint8_t dirty = 0;              // any dirty rows at all?
 
+// cursor, shadow buffer and dirty rows; every CPU prints
+static Spinlock console_lock = SPINLOCK_INIT;
+
 static void mark_dirty(uint32_t y) {
     dirty_rows[y] = 1;
     dirty = 1;
@@ -31,10 +35,16 @@ void display_set_shadow(uint32_t* buffer) {
     sb = buffer;
 }
 
+// rebase the framebuffer once the boot identity mapping goes away
+void display_set_framebuffer(uint32_t* framebuffer) {
+    fb = framebuffer;
+}
+
 void display_flush(void)
 {
     if (!sb || !fb || !dirty) return;
 
+    uint64_t flags = spin_lock_irqsave(&console_lock);
     for (uint32_t y = 0; y < screen_h; y++) {
         if (!dirty_rows[y]) continue;
 
@@ -50,6 +60,7 @@ void display_flush(void)
     }
 
     dirty = 0;
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 static void scroll(void)
@@ -143,7 +154,7 @@ void draw_char(char c, uint32_t x, uint32_t y) {
 //         cursor_y += 10;
 //     }
 // }
-void print_char(char c)
+static void print_char_locked(char c)
 {
     if (c == '\n') {
         cursor_x = 0;
@@ -180,11 +191,24 @@ void print_char(char c)
     }
 }
 
+void print_char(char c)
+{
+    uint64_t flags = spin_lock_irqsave(&console_lock);
+    print_char_locked(c);
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
 void print(const char* str) {
     while (*str)
         print_char(*str++);
 }
 
+// length-counted, so a user buffer needs no terminator or copy
+void print_n(const char* s, uint64_t len) {
+    for (uint64_t i = 0; i < len; i++)
+        print_char(s[i]);
+}
+
 void print_hex(uint64_t val) {
     char hex[] = "0123456789ABCDEF";
     print("0x");
@@ -214,6 +238,7 @@ void display_clear(void)
 {
     if (!sb) return;
 
+    uint64_t flags = spin_lock_irqsave(&console_lock);
     for (uint32_t y = 0; y < screen_h; y++) {
         for (uint32_t x = 0; x < pitch; x++) {
             sb[y * pitch + x] = bg_color;
@@ -225,4 +250,5 @@ void display_clear(void)
 
     cursor_x = 0;
     cursor_y = 0;
+    spin_unlock_irqrestore(&console_lock, flags);
 }
@@ -2,6 +2,7 @@
 #include "types.h"
 
 void display_set_shadow(uint32_t* buffer);
+void display_set_framebuffer(uint32_t* framebuffer);
 void display_flush(void);
 void display_init(uint32_t* framebuffer, uint32_t width, 
                   uint32_t height, uint32_t pixels_per_scanline);
@@ -11,6 +12,7 @@ void clear_screen();
 
 void print_char(char c);
 void print(const char* str);
+void print_n(const char* s, uint64_t len);
 void print_hex(uint64_t val);
 void print_dec(uint64_t val);
 
@@ -1,8 +1,10 @@
 #include "gdt.h"
 #include "display.h"
+#include "smp.h"
 
-static GDTEntry gdt[7];
-static GDTDescriptor gdtr;
+// one GDT per CPU: each holds that CPU's own TSS descriptor
+static GDTEntry gdt_tables[SMP_MAX_CPUS][7];
+static GDTDescriptor gdtr[SMP_MAX_CPUS];
 
 // access byte breakdown:
 //   bit 7   : Present (must be 1 for valid segment)
@@ -30,9 +32,9 @@ typedef struct {
     uint32_t reserved;
 } __attribute__((packed)) TSSDescriptor;
 
-void gdt_set_tss(uint64_t tss_addr, uint32_t tss_size)
+void gdt_set_tss(uint32_t cpu, uint64_t tss_addr, uint32_t tss_size)
 {
-    TSSDescriptor* desc = (TSSDescriptor*)&gdt[5];
+    TSSDescriptor* desc = (TSSDescriptor*)&gdt_tables[cpu][5];
 
     desc->limit_low  = tss_size & 0xFFFF;
     desc->base_low   = tss_addr & 0xFFFF;
@@ -44,7 +46,7 @@ void gdt_set_tss(uint64_t tss_addr, uint32_t tss_size)
     desc->reserved   = 0;
 }
 
-static void set_entry(int i, uint8_t access, uint8_t granularity)
+static void set_entry(GDTEntry* gdt, int i, uint8_t access, uint8_t granularity)
 {
     gdt[i].limit_low  = 0xFFFF;
     gdt[i].base_low   = 0;
@@ -56,43 +58,53 @@ static void set_entry(int i, uint8_t access, uint8_t granularity)
 
 void gdt_init(void)
 {
+    gdt_init_cpu(0);
+}
+
+void gdt_init_cpu(uint32_t cpu)
+{
+    GDTEntry* gdt = gdt_tables[cpu];
+
     // Null descriptor
     gdt[0] = (GDTEntry){0};
 
     // Kernel code: present, ring 0, code, readable, 64-bit
-    set_entry(1, 0x9A, 0x20);
-    //           ^^^^  ^^^^
-    //           |     bit 5 set = 64-bit long mode
-    //           present(1) + DPL=00 + type=1 + exec=1 + rw=1
+    set_entry(gdt, 1, 0x9A, 0x20);
+    //                ^^^^  ^^^^
+    //                |     bit 5 set = 64-bit long mode
+    //                present(1) + DPL=00 + type=1 + exec=1 + rw=1
 
     // Kernel data: present, ring 0, data, writable
-    set_entry(2, 0x92, 0x00);
-    //           ^^^^
-    //           present(1) + DPL=00 + type=1 + exec=0 + rw=1
+    set_entry(gdt, 2, 0x92, 0x00);
+    //                ^^^^
+    //                present(1) + DPL=00 + type=1 + exec=0 + rw=1
 
-    // User code: present, ring 3, code, readable, 64-bit
-    set_entry(3, 0xFA, 0x20);
-    //           ^^^^
-    //           present(1) + DPL=11 + type=1 + exec=1 + rw=1
+    // User data comes before user code: SYSRET loads SS from STAR's
+    // base + 8 and CS from base + 16, so the pair must sit in that order
 
     // User data: present, ring 3, data, writable
-    set_entry(4, 0xF2, 0x00);
-    //           ^^^^
-    //           present(1) + DPL=11 + type=1 + exec=0 + rw=1
+    set_entry(gdt, 3, 0xF2, 0x00);
+    //                ^^^^
+    //                present(1) + DPL=11 + type=1 + exec=0 + rw=1
+
+    // User code: present, ring 3, code, readable, 64-bit
+    set_entry(gdt, 4, 0xFA, 0x20);
+    //                ^^^^
+    //                present(1) + DPL=11 + type=1 + exec=1 + rw=1
 
-    gdtr.limit = sizeof(gdt) - 1;
-    gdtr.base  = (uint64_t)&gdt;
+    gdtr[cpu].limit = sizeof(gdt_tables[cpu]) - 1;
+    gdtr[cpu].base  = (uint64_t)gdt;
 
     // Load GDTR and reload segment registers
     __asm__ volatile (
         "lgdt %0\n"
 
-        // Reload data segments with kernel data selector
+        // Reload data segments with kernel data selector. GS is left
+        // alone: loading it would reset the per-CPU base.
         "mov $0x10, %%ax\n"
         "mov %%ax, %%ds\n"
         "mov %%ax, %%es\n"
         "mov %%ax, %%fs\n"
-        "mov %%ax, %%gs\n"
         "mov %%ax, %%ss\n"
 
         // Reload CS via far return — can't mov directly into CS
@@ -103,9 +115,10 @@ void gdt_init(void)
         "lretq\n"
         "1:\n"
         :
-        : "m"(gdtr)
+        : "m"(gdtr[cpu])
         : "rax", "memory"
     );
 
-    print("GDT loaded\n");
+    if (cpu == 0)
+        print("GDT loaded\n");
 }
@@ -6,8 +6,8 @@
 // Segment selectors — index * 8, | 3 for user segments (sets RPL=3)
 #define GDT_KERNEL_CODE  0x08
 #define GDT_KERNEL_DATA  0x10
-#define GDT_USER_CODE    0x18
-#define GDT_USER_DATA    0x20
+#define GDT_USER_DATA    0x18
+#define GDT_USER_CODE    0x20
 #define GDT_TSS  0x28   // index 5, takes slots 5+6
 
 typedef struct {
@@ -24,7 +24,8 @@ typedef struct {
     uint64_t base;    // address of GDT
 } __attribute__((packed)) GDTDescriptor;
 
-void gdt_set_tss(uint64_t tss_addr, uint32_t tss_size);
+void gdt_set_tss(uint32_t cpu, uint64_t tss_addr, uint32_t tss_size);
 void gdt_init(void);
+void gdt_init_cpu(uint32_t cpu);
 
 #endif
\ No newline at end of file
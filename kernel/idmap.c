@@ -0,0 +1,100 @@
+#include "idmap.h"
+#include "kmalloc.h"
+#include "string.h"
+
+void idmap_init(IdMap* m, uint32_t first)
+{
+    memset(m, 0, sizeof(*m));
+    m->first = first;
+    m->next = first;
+}
+
+// lowest clear bit at or above from, or -1
+static int find_clear(const IdMap* m, uint32_t from)
+{
+    uint32_t w = from / 64;
+    if (w >= IDMAP_WORDS) return -1;
+
+    uint64_t bits = ~m->used[w] & (~0ULL << (from % 64));
+    if (bits)
+        return (int)(w * 64 + (uint32_t)__builtin_ctzll(bits));
+
+    // past the first word, skip full ones through the summary
+    uint32_t start = w + 1;
+    for (uint32_t s = start / 64; s < IDMAP_WORDS / 64; s++) {
+        uint64_t open = ~m->full[s];
+        if (s == start / 64)
+            open &= ~0ULL << (start % 64);
+        if (!open) continue;
+
+        uint32_t fw = s * 64 + (uint32_t)__builtin_ctzll(open);
+        return (int)(fw * 64 + (uint32_t)__builtin_ctzll(~m->used[fw]));
+    }
+    return -1;
+}
+
+// Hands out the next free id after the last one given, wrapping once
+int idmap_alloc(IdMap* m, void* obj)
+{
+    int id = find_clear(m, m->next);
+    if (id < 0)
+        id = find_clear(m, m->first);
+    if (id < 0)
+        return -1;
+
+    void** leaf = m->leaves[id / IDMAP_LEAF_SLOTS];
+    if (!leaf) {
+        leaf = (void**)kzalloc(IDMAP_LEAF_SLOTS * sizeof(void*));
+        if (!leaf) return -1;
+        m->leaves[id / IDMAP_LEAF_SLOTS] = leaf;
+    }
+    leaf[id % IDMAP_LEAF_SLOTS] = obj;
+
+    uint32_t w = (uint32_t)id / 64;
+    m->used[w] |= 1ULL << (id % 64);
+    if (m->used[w] == ~0ULL)
+        m->full[w / 64] |= 1ULL << (w % 64);
+
+    m->next = (uint32_t)id + 1;
+    if (m->next >= IDMAP_MAX_IDS)
+        m->next = m->first;
+    m->count++;
+    return id;
+}
+
+void* idmap_get(const IdMap* m, int id)
+{
+    if (id < (int)m->first || id >= IDMAP_MAX_IDS) return 0;
+    void** leaf = m->leaves[id / IDMAP_LEAF_SLOTS];
+    return leaf ? leaf[id % IDMAP_LEAF_SLOTS] : 0;
+}
+
+// Leaves stay allocated once created; a busy id range tends to be busy again
+void idmap_free(IdMap* m, int id)
+{
+    if (id < (int)m->first || id >= IDMAP_MAX_IDS) return;
+
+    uint32_t w = (uint32_t)id / 64;
+    uint64_t bit = 1ULL << (id % 64);
+    if (!(m->used[w] & bit)) return;
+
+    m->used[w] &= ~bit;
+    m->full[w / 64] &= ~(1ULL << (w % 64));
+    m->leaves[id / IDMAP_LEAF_SLOTS][id % IDMAP_LEAF_SLOTS] = 0;
+    m->count--;
+}
+
+// lowest allocated id at or above from, or -1; for walking every object
+int idmap_next(const IdMap* m, int from)
+{
+    if (from < (int)m->first) from = (int)m->first;
+
+    for (uint32_t w = (uint32_t)from / 64; w < IDMAP_WORDS; w++) {
+        uint64_t bits = m->used[w];
+        if (w == (uint32_t)from / 64)
+            bits &= ~0ULL << (from % 64);
+        if (bits)
+            return (int)(w * 64 + (uint32_t)__builtin_ctzll(bits));
+    }
+    return -1;
+}
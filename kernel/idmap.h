@@ -0,0 +1,30 @@
+#ifndef IDMAP_H
+#define IDMAP_H
+
+#include "types.h"
+
+#define IDMAP_MAX_IDS     32768
+#define IDMAP_WORDS       (IDMAP_MAX_IDS / 64)
+#define IDMAP_LEAF_SLOTS  512
+#define IDMAP_LEAVES      (IDMAP_MAX_IDS / IDMAP_LEAF_SLOTS)
+
+// Integer id allocator with an object lookup behind it. Ids come from a
+// bitmap (plus a summary of which words are full, so a scan skips 4096
+// taken ids per word it reads); the object for an id is found through a
+// two-level radix table whose 4 KiB leaves appear as the id space fills.
+typedef struct {
+    uint64_t used[IDMAP_WORDS];
+    uint64_t full[IDMAP_WORDS / 64];
+    void**   leaves[IDMAP_LEAVES];
+    uint32_t first;     // lowest id ever handed out
+    uint32_t next;      // scan starts here so a freed id is not reused at once
+    uint32_t count;
+} IdMap;
+
+void  idmap_init(IdMap* m, uint32_t first);
+int   idmap_alloc(IdMap* m, void* obj);
+void* idmap_get(const IdMap* m, int id);
+void  idmap_free(IdMap* m, int id);
+int   idmap_next(const IdMap* m, int from);
+
+#endif
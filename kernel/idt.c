@@ -1,10 +1,13 @@
 #include "idt.h"
 #include "gdt.h"
 #include "irq.h"
+#include "apic.h"
 #include "keyboard.h"
 #include "display.h"
 #include "panic.h"
 #include "scheduler/task.h"
+#include "process.h"
+#include "timer.h"
 
 static IDTEntry idt[256];
 static IDTDescriptor idtr;
@@ -28,7 +31,9 @@ extern void isr40(void); extern void isr41(void);
 extern void isr42(void); extern void isr43(void);
 extern void isr44(void); extern void isr45(void);
 extern void isr46(void); extern void isr47(void);
+extern void isr48(void); extern void isr49(void);
 extern void isr128(void);
+extern void isr129(void);
 
 static void set_entry(uint8_t vector, void* handler,
                       uint8_t ist, uint8_t type_attr)
@@ -90,17 +95,27 @@ void idt_init(void)
     set_entry(45, isr45, 0, 0x8E);
     set_entry(46, isr46, 0, 0x8E);
     set_entry(47, isr47, 0, 0x8E);
+    set_entry(TIMER_LAPIC_VECTOR, isr48, 0, 0x8E);
+    set_entry(TASK_RESCHED_VECTOR, isr49, 0, 0x8E);
     // User syscall gate: int 0x80
     set_entry(128, isr128, 0, 0xEE);
+    // task_yield/task_sleep/task_exit: kernel only
+    set_entry(TASK_YIELD_VECTOR, isr129, 0, 0x8E);
 
     idtr.limit = sizeof(idt) - 1;
     idtr.base  = (uint64_t)&idt;
 
-    __asm__ volatile ("lidt %0" :: "m"(idtr));
+    idt_load();
 
     print("IDT loaded\n");
 }
 
+// The table is shared; each CPU only needs to point IDTR at it
+void idt_load(void)
+{
+    __asm__ volatile ("lidt %0" :: "m"(idtr));
+}
+
 static const char* exception_names[] = {
     "Divide By Zero",       "Debug",
     "NMI",                  "Breakpoint",
@@ -120,6 +135,30 @@ uint64_t interrupt_handler(InterruptFrame* frame)
     kassert(frame != 0, "interrupt_handler: null frame");
     kassert(frame->vector < 256, "interrupt_handler: invalid vector");
 
+    if (frame->vector == 14) {
+        uint64_t cr2;
+        __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+
+        // demand paging: map on first touch and retry the instruction
+        if (process_handle_page_fault(cr2, frame->error_code) == 0)
+            return 0;
+
+        // a bad user access kills the process, not the kernel
+        Task* t = task_current();
+        if ((frame->cs & 3) && t && t->is_user) {
+            print("[proc fault pid=");
+            print_dec((uint64_t)t->pid);
+            print(" addr=");
+            print_hex(cr2);
+            print(" rip=");
+            print_hex(frame->rip);
+            print("]\n");
+            process_task_exited(t->pid, PROCESS_EXIT_FAULT);
+            task_mark_exit(PROCESS_EXIT_FAULT);
+            return task_schedule_from_interrupt(frame);
+        }
+    }
+
     if (frame->vector < 32) {
         print("\n--- EXCEPTION ---\n");
         if (frame->vector <= 20)
@@ -150,6 +189,18 @@ uint64_t interrupt_handler(InterruptFrame* frame)
         return syscall_dispatch(frame);
     }
 
+    if (frame->vector == TASK_YIELD_VECTOR)
+        return task_schedule_from_interrupt(frame);
+
+    if (frame->vector == TIMER_LAPIC_VECTOR)
+        return timer_lapic_interrupt((uint64_t)frame);
+
+    // another CPU queued work here or took a tick for us
+    if (frame->vector == TASK_RESCHED_VECTOR) {
+        apic_send_eoi();
+        return schedule_on_tick((uint64_t)frame);
+    }
+
     uint8_t irq = frame->vector - 32;
 
     if (irq_is_spurious(irq)) return 0;
@@ -164,5 +215,6 @@ uint64_t interrupt_handler(InterruptFrame* frame)
     if (irq != 0)
         irq_send_eoi(irq);
 
-    return 0;
+    // a wakeup from the handler may outrank whatever it interrupted
+    return task_resched_point(frame);
 }
@@ -34,5 +34,6 @@ typedef struct {
 } InterruptFrame;
 
 void idt_init(void);
+void idt_load(void);
 
 #endif
\ No newline at end of file
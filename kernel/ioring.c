@@ -0,0 +1,289 @@
+#include "ioring.h"
+#include "process.h"
+#include "syscall.h"
+#include "scheduler/task.h"
+#include "timer.h"
+#include "cpu.h"
+#include "paging.h"
+
+static uint64_t ret_err(uint64_t errno_val)
+{
+    return 0ULL - errno_val;
+}
+
+// Posts one completion. The ring page is reached through the direct map,
+// so timers and other processes can complete ops from any address space.
+// The indices are user memory: they only pick a slot inside the page.
+static void io_complete(Process* p, uint64_t user_data, uint64_t result, uint64_t aux)
+{
+    IoRing* r = p->ioring;
+    if (!r) return;
+
+    uint32_t tail = r->cq_tail;
+    if (tail - r->cq_head >= IORING_ENTRIES) {
+        r->cq_overflow++;
+        return;
+    }
+
+    IoCqe* c = &r->cq[tail % IORING_ENTRIES];
+    c->user_data = user_data;
+    c->result = result;
+    c->aux = aux;
+    __asm__ volatile ("" ::: "memory");     // entry before tail
+    r->cq_tail = tail + 1;
+
+    if (p->io_wait_min && tail + 1 - r->cq_head >= p->io_wait_min) {
+        p->io_wait_min = 0;
+        task_wake(p->main_tid);
+    }
+}
+
+static IoPending* pending_alloc(Process* p, uint32_t op, uint64_t user_data)
+{
+    for (int i = 0; i < IORING_MAX_PENDING; i++) {
+        IoPending* pd = &p->io_pending[i];
+        if (pd->active) continue;
+        pd->active = 1;
+        pd->op = op;
+        pd->user_data = user_data;
+        pd->owner = p;
+        pd->target_pid = 0;
+        pd->next_waiter = 0;
+        return pd;
+    }
+    return 0;
+}
+
+static uint32_t pending_count(const Process* p)
+{
+    uint32_t n = 0;
+    for (int i = 0; i < IORING_MAX_PENDING; i++)
+        n += p->io_pending[i].active ? 1 : 0;
+    return n;
+}
+
+static void pending_finish(IoPending* pd, uint64_t result, uint64_t aux)
+{
+    pd->active = 0;
+    io_complete(pd->owner, pd->user_data, result, aux);
+}
+
+// timer callback: may run on any CPU, against an exit dropping the op
+static void io_sleep_done(void* arg)
+{
+    IoPending* pd = (IoPending*)arg;
+    uint64_t flags = process_lock();
+    if (pd->active)
+        pending_finish(pd, 0, 0);
+    process_unlock(flags);
+}
+
+static void waiter_unlink(IoPending* pd)
+{
+    Process* target = process_get(pd->target_pid);
+    if (!target) return;
+    for (IoPending** link = &target->io_waiters; *link; link = &(*link)->next_waiter) {
+        if (*link == pd) {
+            *link = pd->next_waiter;
+            return;
+        }
+    }
+}
+
+static uint64_t op_sleep(Process* p, const IoSqe* sqe, int* queued)
+{
+    if (sqe->arg0 == 0) return 0;
+
+    IoPending* pd = pending_alloc(p, IORING_OP_SLEEP, sqe->user_data);
+    if (!pd) return ret_err(11);
+
+    uint64_t now = timer_now_ns();
+    uint64_t ns = sqe->arg0;
+    uint64_t deadline = (ns > KTIMER_NONE - 1 - now) ? KTIMER_NONE - 1 : now + ns;
+    ktimer_init(&pd->timer, io_sleep_done, pd);
+    if (ktimer_arm(&pd->timer, deadline) < 0) {
+        pd->active = 0;
+        return ret_err(12);
+    }
+    *queued = 1;
+    return 0;
+}
+
+// Collects a zombie the same way the shell's wait does; a live target
+// completes the op from its exit and is freed once it has been reaped
+static uint64_t op_wait(Process* p, const IoSqe* sqe, int* queued, uint64_t* aux)
+{
+    int pid = (int)(sqe->arg0 & 0xFFFFFFFFULL);
+    if (pid == p->pid) return ret_err(22);
+
+    int code = 0;
+    int rc = process_wait_poll(pid, &code);
+    if (rc < 0) return ret_err(3);
+    if (rc > 0) {
+        *aux = (uint64_t)code;
+        return (uint64_t)pid;
+    }
+
+    IoPending* pd = pending_alloc(p, IORING_OP_WAIT, sqe->user_data);
+    if (!pd) return ret_err(11);
+
+    Process* target = process_get(pid);
+    pd->target_pid = pid;
+    pd->next_waiter = target->io_waiters;
+    target->io_waiters = pd;
+    *queued = 1;
+    return 0;
+}
+
+// A receive already waiting takes the value directly; otherwise it is
+// queued in the target's mailbox
+static uint64_t op_send(Process* p, const IoSqe* sqe)
+{
+    Process* target = process_get((int)(sqe->arg0 & 0xFFFFFFFFULL));
+    if (!target || target->exited) return ret_err(3);
+
+    if (target->io_recv) {
+        IoPending* pd = target->io_recv;
+        target->io_recv = 0;
+        pending_finish(pd, (uint64_t)p->pid, sqe->arg1);
+        return 0;
+    }
+
+    if (target->mbox_tail - target->mbox_head >= PROCESS_MBOX_SLOTS)
+        return ret_err(11);
+    IoMessage* m = &target->mbox[target->mbox_tail % PROCESS_MBOX_SLOTS];
+    m->value = sqe->arg1;
+    m->from = p->pid;
+    target->mbox_tail++;
+    return 0;
+}
+
+static uint64_t op_recv(Process* p, const IoSqe* sqe, int* queued, uint64_t* aux)
+{
+    if (p->mbox_head != p->mbox_tail) {
+        IoMessage* m = &p->mbox[p->mbox_head % PROCESS_MBOX_SLOTS];
+        p->mbox_head++;
+        *aux = m->value;
+        return (uint64_t)m->from;
+    }
+
+    // one receive at a time keeps delivery order obvious
+    if (p->io_recv) return ret_err(16);
+    IoPending* pd = pending_alloc(p, IORING_OP_RECV, sqe->user_data);
+    if (!pd) return ret_err(11);
+    p->io_recv = pd;
+    *queued = 1;
+    return 0;
+}
+
+static void io_submit(Process* p, const IoSqe* sqe)
+{
+    int queued = 0;
+    uint64_t aux = 0;
+    uint64_t ret;
+
+    switch (sqe->op) {
+        case IORING_OP_NOP:   ret = 0; break;
+        case IORING_OP_WRITE: ret = syscall_write(sqe->arg0, sqe->arg1); break;
+        case IORING_OP_SPAWN: {
+            int pid = process_spawn_builtin((int)(sqe->arg0 & 0xFFFFFFFFULL));
+            ret = (pid < 0) ? ret_err(12) : (uint64_t)pid;
+            break;
+        }
+        case IORING_OP_SLEEP: ret = op_sleep(p, sqe, &queued); break;
+        case IORING_OP_WAIT:  ret = op_wait(p, sqe, &queued, &aux); break;
+        case IORING_OP_SEND:  ret = op_send(p, sqe); break;
+        case IORING_OP_RECV:  ret = op_recv(p, sqe, &queued, &aux); break;
+        default:              ret = ret_err(38); break;
+    }
+
+    if (!queued)
+        io_complete(p, sqe->user_data, ret, aux);
+}
+
+// The page is faulted in for writing before the kernel keeps its
+// address, and VMM_FLAG_NOFORK keeps it from ever turning copy-on-write
+static IoRing* io_setup(Process* p)
+{
+    if (p->ioring) return p->ioring;
+    if (process_fault_in(p->pid, IORING_VIRT, 1) < 0) return 0;
+
+    uint64_t phys = vmm_virt_to_phys(p->address_space, IORING_VIRT);
+    if (!phys) return 0;
+    p->ioring = (IoRing*)phys_to_virt(phys);
+    return p->ioring;
+}
+
+// Runs up to to_submit queued entries, then blocks until min_complete
+// completions are ready. The wait is capped at what can still arrive,
+// so asking for more than is in flight cannot hang the caller.
+static uint64_t ring_enter(Process* p, uint32_t to_submit, uint32_t min_complete)
+{
+    IoRing* r = io_setup(p);
+    if (!r) return ret_err(14);
+
+    uint32_t head = r->sq_head;
+    uint32_t avail = r->sq_tail - head;
+    if (avail > IORING_ENTRIES) return ret_err(22);
+    if (to_submit > avail) to_submit = avail;
+
+    for (uint32_t i = 0; i < to_submit; i++) {
+        // copied out first: the program may rewrite the slot meanwhile
+        IoSqe sqe = r->sq[(head + i) % IORING_ENTRIES];
+        io_submit(p, &sqe);
+    }
+    r->sq_head = head + to_submit;
+
+    if (min_complete > IORING_ENTRIES) min_complete = IORING_ENTRIES;
+    uint32_t ready = r->cq_tail - r->cq_head;
+    uint32_t reachable = ready + pending_count(p);
+    if (min_complete > reachable) min_complete = reachable;
+    if (ready < min_complete) {
+        p->io_wait_min = min_complete;
+        task_block();
+    }
+
+    return to_submit;
+}
+
+// Everything runs under the process lock: completions from other CPUs
+// cannot slip in between the ready check and the block
+uint64_t ioring_enter(uint32_t to_submit, uint32_t min_complete)
+{
+    uint64_t flags = process_lock();
+    Process* p = process_get(task_current_pid());
+    uint64_t ret = (!p || p->exited) ? ret_err(1)
+                                     : ring_enter(p, to_submit, min_complete);
+    process_unlock(flags);
+    return ret;
+}
+
+// Called once when p exits, under the process lock: anyone waiting on it
+// completes, and its own ops in flight are dropped along with the ring.
+// Returns how many WAIT ops took the exit code, so the caller knows p
+// has been collected.
+int ioring_process_exited(Process* p)
+{
+    int collected = 0;
+    while (p->io_waiters) {
+        IoPending* pd = p->io_waiters;
+        p->io_waiters = pd->next_waiter;
+        pending_finish(pd, (uint64_t)p->pid, (uint64_t)p->exit_code);
+        collected++;
+    }
+
+    for (int i = 0; i < IORING_MAX_PENDING; i++) {
+        IoPending* pd = &p->io_pending[i];
+        if (!pd->active) continue;
+        if (pd->op == IORING_OP_SLEEP)
+            ktimer_cancel(&pd->timer);
+        else if (pd->op == IORING_OP_WAIT)
+            waiter_unlink(pd);
+        pd->active = 0;
+    }
+
+    p->io_recv = 0;
+    p->io_wait_min = 0;
+    p->ioring = 0;
+    return collected;
+}
@@ -0,0 +1,33 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include "types.h"
+#include "ktimer.h"
+#include "syscall_abi.h"
+
+#define IORING_MAX_PENDING 16   // ops of one process waiting at once
+#define PROCESS_MBOX_SLOTS 16   // IPC values queued for a process
+
+struct Process;
+
+// An op that completes later: a sleep on its timer, a wait on the target's
+// io_waiters list, a receive on the owner's io_recv
+typedef struct IoPending {
+    int                 active;
+    uint32_t            op;
+    uint64_t            user_data;
+    struct Process*     owner;
+    int                 target_pid;     // IORING_OP_WAIT
+    struct IoPending*   next_waiter;
+    KTimer              timer;          // IORING_OP_SLEEP
+} IoPending;
+
+typedef struct {
+    uint64_t value;
+    int      from;
+} IoMessage;
+
+uint64_t ioring_enter(uint32_t to_submit, uint32_t min_complete);
+int      ioring_process_exited(struct Process* p);
+
+#endif
@@ -9,6 +9,7 @@
 #include "paging.h"
 #include "pmm.h"
 #include "vmm.h"
+#include "vvar.h"
 #include "panic.h"
 #include "klog.h"
 #include "kmalloc.h"
@@ -16,11 +17,16 @@
 #include "rtc.h"
 #include "scheduler/task.h"
 #include "process.h"
+#include "syscall.h"
 #include "syscall_abi.h"
+#include "cpu.h"
+#include "smp.h"
+#include "percpu.h"
 #include "types.h"
 
 #define SCREEN_BG 0x00303030
 #define TIMER_HZ  100
+#define PMM_BENCH_PAGES 256
 
 static void halt_forever(void)
 {
@@ -120,6 +126,7 @@ static void init_descriptor_tables(void)
     gdt_init();
     tss_init();
     idt_init();
+    syscall_init();
 }
 
 static void init_irq_devices(void)
@@ -138,6 +145,9 @@ static void init_memory(BootInfo* bootInfo)
     gdt_init();
     tss_init();
 
+    // the framebuffer is a physical address; reach it via the direct map
+    display_set_framebuffer((uint32_t*)phys_to_virt((uint64_t)bootInfo->framebuffer));
+
     pmm_init(bootInfo);
     kmalloc_init();
 
@@ -146,8 +156,9 @@ static void init_memory(BootInfo* bootInfo)
     uint64_t fb_bytes = fb_pixels * 4;
     uint64_t fb_pages = (fb_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    uint32_t* shadow = (uint32_t*)pmm_alloc_pages(fb_pages);
-    kassert(shadow != 0, "display shadow buffer allocation failed");
+    void* shadow_phys = pmm_alloc_pages(fb_pages);
+    kassert(shadow_phys != 0, "display shadow buffer allocation failed");
+    uint32_t* shadow = (uint32_t*)phys_to_virt((uint64_t)shadow_phys);
 
     display_set_shadow(shadow);
     for (uint64_t i = 0; i < fb_pixels; i++)
@@ -155,6 +166,29 @@ static void init_memory(BootInfo* bootInfo)
 
     vmm_init();
     print("VMM initialized\n");
+    vvar_init();
+}
+
+static void run_pmm_benchmark(void)
+{
+    static void* pages[PMM_BENCH_PAGES];
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < PMM_BENCH_PAGES; i++)
+        pages[i] = pmm_alloc_page();
+    uint64_t t1 = rdtsc();
+    for (int i = 0; i < PMM_BENCH_PAGES; i++)
+        pmm_free_page(pages[i]);
+    uint64_t t2 = rdtsc();
+
+    for (int i = 0; i < PMM_BENCH_PAGES; i++)
+        kassert(pages[i] != 0, "PMM bench: allocation failed");
+
+    print("PMM bench: alloc=");
+    print_dec((t1 - t0) / PMM_BENCH_PAGES);
+    print(" free=");
+    print_dec((t2 - t1) / PMM_BENCH_PAGES);
+    print(" cycles/page\n");
 }
 
 static void run_memory_smoke_tests(void)
@@ -165,6 +199,19 @@ static void run_memory_smoke_tests(void)
             "PMM smoke test: page is not aligned");
     pmm_free_page(page);
 
+    uint64_t free_before = pmm_get_free_pages();
+    uint8_t* run = (uint8_t*)pmm_alloc_pages(3);
+    kassert(run != 0, "PMM smoke test: contiguous allocation failed");
+    kassert(pmm_get_free_pages() == free_before - 3,
+            "PMM smoke test: contiguous allocation miscounted pages");
+    pmm_free_pages(run, 3);
+    kassert(pmm_get_free_pages() == free_before,
+            "PMM smoke test: contiguous free did not restore free pages");
+
+    run_pmm_benchmark();
+    kassert(pmm_get_free_pages() == free_before,
+            "PMM bench: pages leaked");
+
     AddressSpace* test_as = vmm_create_address_space();
     kassert(test_as != 0, "VMM smoke test: address space allocation failed");
 
@@ -208,7 +255,9 @@ static void run_heap_smoke_tests(void)
 
 static void enable_interrupts(void)
 {
-    irq_unmask(0);
+    // a one-shot LAPIC timer replaces the PIT's IRQ0
+    if (timer_get_source() == TIMER_SOURCE_PIT)
+        irq_unmask(0);
     irq_unmask(1);
     __asm__ volatile ("sti");
 }
@@ -220,7 +269,9 @@ static void print_irq_boot_banner(void)
     print(irq_controller_name());
     print("\n");
     print("  vector map: IRQ0->0x20 IRQ1->0x21\n");
-    print("  timer source: PIT ");
+    print("  timer source: ");
+    print(timer_source_name());
+    print(", scheduler tick ");
     print_dec((uint64_t)timer_get_frequency());
     print(" Hz\n");
     irq_dump_routes();
@@ -233,6 +284,8 @@ void kernel_main(BootInfo* bootInfo)
 
     klog_init();
     init_display(bootInfo);
+    // before anything that can panic: panic reads the current task
+    percpu_init(0);
     kassert(bootInfo->framebuffer != 0, "bootinfo: missing framebuffer");
     kassert(bootInfo->memory_map != 0, "bootinfo: missing memory map");
     kassert(bootInfo->memory_map_descriptor_size != 0,
@@ -245,7 +298,8 @@ void kernel_main(BootInfo* bootInfo)
     run_memory_smoke_tests();
     run_heap_smoke_tests();
     acpi_init(bootInfo);
-    irq_try_enable_apic();
+    if (irq_try_enable_apic())
+        timer_enable_lapic();
     print("IRQ mode: ");
     print(irq_controller_name());
     print("\n");
@@ -253,11 +307,19 @@ void kernel_main(BootInfo* bootInfo)
     if (!irq_backend_health())
         klog_warn("IRQ backend health has faults; safe-mode fallback recommended next boot");
 
+    // BootInfo, the UEFI memory map and ACPI discovery were the last users
+    // of boot-time physical pointers; everything else uses the direct map
+    paging_remove_identity_map();
+
+    // the APs boot on their own low tables, so they do not need the
+    // identity map either
+    smp_init();
+
     task_init();
     process_init();
 
     int shell_id = task_create_kernel(shell_task);
-    int idle_id  = task_create_kernel(idle_task);
+    int idle_id  = task_create_idle(idle_task);
     (void)idle_id;
 
     // tell keyboard which task to wake on keypress
@@ -268,6 +330,7 @@ void kernel_main(BootInfo* bootInfo)
     process_spawn_builtin(SPAWN_IMAGE_BURN);
 
     enable_interrupts();
+    smp_start_aps();
 
     display_clear();
     print("SamOS\n");
@@ -1,6 +1,7 @@
 #include "klog.h"
 #include "display.h"
 #include "serial.h"
+#include "spinlock.h"
 
 #define KLOG_RING_LINES 64
 #define KLOG_LINE_MAX   96
@@ -8,9 +9,11 @@
 static char g_ring[KLOG_RING_LINES][KLOG_LINE_MAX];
 static uint32_t g_ring_head = 0;
 static uint32_t g_ring_count = 0;
+static Spinlock g_ring_lock = SPINLOCK_INIT;
 
 static void ring_write_line(const char* level, const char* message)
 {
+    uint64_t flags = spin_lock_irqsave(&g_ring_lock);
     char* out = g_ring[g_ring_head];
     uint32_t p = 0;
 
@@ -29,6 +32,7 @@ static void ring_write_line(const char* level, const char* message)
     g_ring_head = (g_ring_head + 1) % KLOG_RING_LINES;
     if (g_ring_count < KLOG_RING_LINES)
         g_ring_count++;
+    spin_unlock_irqrestore(&g_ring_lock, flags);
 }
 
 static void klog_prefix(const char* level)
@@ -1,18 +1,54 @@
 #include "kmalloc.h"
 #include "pmm.h"
+#include "paging.h"
 #include "panic.h"
+#include "display.h"
+#include "string.h"
+#include "spinlock.h"
 
-#define KMALLOC_ALIGN 16
+#define KMALLOC_ALIGN     16
+#define KMALLOC_MIN_SHIFT 4          // smallest class = 16 bytes
+#define KMALLOC_CLASSES   7          // 16, 32, ... 1024
+#define KMALLOC_MAX_SMALL (1ULL << (KMALLOC_MIN_SHIFT + KMALLOC_CLASSES - 1))
 
-typedef struct KBlock {
-    uint64_t size;
-    int free;
+#define SLAB_MAGIC  0x534C4142U      // "SLAB"
+#define LARGE_MAGIC 0x4C524745U      // "LRGE"
+
+// Every slab is one PMM page with this header at its base, so kfree finds
+// the owning slab by masking the pointer. Objects start right after it.
+// The header costs a 2048-byte class its second object, so anything past
+// 1024 bytes takes the page path instead.
+typedef struct Slab {
+    uint32_t     magic;
+    uint16_t     class_idx;
+    uint16_t     inuse;
+    uint16_t     capacity;
+    uint16_t     reserved;
+    uint32_t     reserved2;
+    void*        freelist;
+    struct Slab* next;          // partial list link
+    struct Slab* prev;
+} Slab;
+
+// Allocations above the largest class get whole pages with this header.
+typedef struct {
+    uint32_t magic;
     uint32_t reserved;
-    struct KBlock* next;
-    uint64_t reserved2;
-} KBlock;
+    uint64_t pages;
+} LargeHeader;
+
+typedef struct {
+    Slab*    partial;           // slabs with at least one free object
+    uint64_t slabs;
+    uint64_t inuse;
+    uint64_t allocs;
+    uint64_t frees;
+} SizeClass;
 
-static KBlock* heap_head = 0;
+static SizeClass classes[KMALLOC_CLASSES];
+static Spinlock  heap_lock = SPINLOCK_INIT;     // slab lists and counters
+static uint64_t  large_allocs = 0;
+static uint64_t  large_pages = 0;
 static int heap_ready = 0;
 
 static uint64_t align_up(uint64_t value, uint64_t align)
@@ -20,61 +56,105 @@ static uint64_t align_up(uint64_t value, uint64_t align)
     return (value + align - 1) & ~(align - 1);
 }
 
-static void split_block(KBlock* block, uint64_t size)
+static uint64_t class_size(uint32_t idx)
 {
-    uint64_t remaining = block->size - size;
-    if (remaining <= sizeof(KBlock) + KMALLOC_ALIGN)
-        return;
+    return 1ULL << (KMALLOC_MIN_SHIFT + idx);
+}
 
-    KBlock* next = (KBlock*)((uint8_t*)(block + 1) + size);
-    next->size = remaining - sizeof(KBlock);
-    next->free = 1;
-    next->next = block->next;
+static uint32_t class_for(uint64_t size)
+{
+    uint32_t idx = 0;
+    while (class_size(idx) < size)
+        idx++;
+    return idx;
+}
 
-    block->size = size;
-    block->next = next;
+static uint64_t slab_data_offset(void)
+{
+    return align_up(sizeof(Slab), KMALLOC_ALIGN);
 }
 
-static void coalesce(void)
+static void partial_push(SizeClass* c, Slab* s)
 {
-    for (KBlock* block = heap_head; block && block->next; block = block->next) {
-        if (block->free && block->next->free) {
-            block->size += sizeof(KBlock) + block->next->size;
-            block->next = block->next->next;
-        }
-    }
+    s->prev = 0;
+    s->next = c->partial;
+    if (c->partial) c->partial->prev = s;
+    c->partial = s;
 }
 
-static KBlock* expand_heap(uint64_t size)
+static void partial_remove(SizeClass* c, Slab* s)
 {
-    uint64_t total = align_up(size + sizeof(KBlock), PAGE_SIZE);
-    uint64_t pages = total / PAGE_SIZE;
-    KBlock* block = (KBlock*)pmm_alloc_pages(pages);
-    if (!block)
+    if (s->prev) s->prev->next = s->next;
+    else         c->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = 0;
+    s->prev = 0;
+}
+
+static Slab* slab_create(uint32_t idx)
+{
+    void* page = pmm_alloc_page();
+    if (!page)
         return 0;
+    Slab* s = (Slab*)phys_to_virt((uint64_t)page);
 
-    block->size = total - sizeof(KBlock);
-    block->free = 1;
-    block->next = 0;
+    uint64_t size = class_size(idx);
+    uint64_t off = slab_data_offset();
 
-    if (!heap_head) {
-        heap_head = block;
-        return block;
+    s->magic = SLAB_MAGIC;
+    s->class_idx = (uint16_t)idx;
+    s->inuse = 0;
+    s->capacity = (uint16_t)((PAGE_SIZE - off) / size);
+    s->reserved = 0;
+    s->reserved2 = 0;
+    s->next = 0;
+    s->prev = 0;
+
+    // thread the freelist through the objects, lowest address first
+    uint8_t* base = (uint8_t*)s + off;
+    s->freelist = 0;
+    for (int i = s->capacity - 1; i >= 0; i--) {
+        void** obj = (void**)(base + (uint64_t)i * size);
+        *obj = s->freelist;
+        s->freelist = obj;
     }
 
-    KBlock* tail = heap_head;
-    while (tail->next)
-        tail = tail->next;
-    tail->next = block;
-    return block;
+    classes[idx].slabs++;
+    return s;
+}
+
+static void* large_alloc(uint64_t size)
+{
+    uint64_t pages = align_up(size + sizeof(LargeHeader), PAGE_SIZE) / PAGE_SIZE;
+    void* run = pmm_alloc_pages(pages);
+    if (!run)
+        return 0;
+    LargeHeader* h = (LargeHeader*)phys_to_virt((uint64_t)run);
+
+    h->magic = LARGE_MAGIC;
+    h->reserved = 0;
+    h->pages = pages;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    large_allocs++;
+    large_pages += pages;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return h + 1;
 }
 
 void kmalloc_init(void)
 {
-    kassert((sizeof(KBlock) & (KMALLOC_ALIGN - 1)) == 0,
-            "kmalloc: block header is not allocation-aligned");
+    kassert((sizeof(LargeHeader) & (KMALLOC_ALIGN - 1)) == 0,
+            "kmalloc: large header is not allocation-aligned");
+    kassert(slab_data_offset() < KMALLOC_MAX_SMALL,
+            "kmalloc: slab header leaves no room for the largest class");
     if (!heap_ready) {
-        kassert(expand_heap(PAGE_SIZE) != 0, "kmalloc: initial heap allocation failed");
+        for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+            classes[i].partial = 0;
+            classes[i].slabs = 0;
+            classes[i].inuse = 0;
+            classes[i].allocs = 0;
+            classes[i].frees = 0;
+        }
         heap_ready = 1;
     }
 }
@@ -85,33 +165,42 @@ void* kmalloc(uint64_t size)
         return 0;
 
     kassert(heap_ready, "kmalloc: heap used before kmalloc_init");
-    size = align_up(size, KMALLOC_ALIGN);
+    if (size > KMALLOC_MAX_SMALL)
+        return large_alloc(size);
 
-    for (KBlock* block = heap_head; block; block = block->next) {
-        if (block->free && block->size >= size) {
-            split_block(block, size);
-            block->free = 0;
-            return block + 1;
+    uint32_t idx = class_for(size);
+    SizeClass* c = &classes[idx];
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    Slab* s = c->partial;
+    if (!s) {
+        s = slab_create(idx);
+        if (!s) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return 0;
         }
+        partial_push(c, s);
     }
 
-    KBlock* block = expand_heap(size);
-    if (!block)
-        return 0;
+    void** obj = (void**)s->freelist;
+    s->freelist = *obj;
+    s->inuse++;
+    if (!s->freelist)
+        partial_remove(c, s);
 
-    split_block(block, size);
-    block->free = 0;
-    return block + 1;
+    c->inuse++;
+    c->allocs++;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return obj;
 }
 
 void* kzalloc(uint64_t size)
 {
-    uint8_t* ptr = (uint8_t*)kmalloc(size);
+    void* ptr = kmalloc(size);
     if (!ptr)
         return 0;
 
-    for (uint64_t i = 0; i < size; i++)
-        ptr[i] = 0;
+    memset(ptr, 0, size);
     return ptr;
 }
 
@@ -120,7 +209,88 @@ void kfree(void* ptr)
     if (!ptr)
         return;
 
-    KBlock* block = ((KBlock*)ptr) - 1;
-    block->free = 1;
-    coalesce();
+    uint64_t base = (uint64_t)ptr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint32_t magic = *(uint32_t*)base;
+
+    if (magic == LARGE_MAGIC && (uint64_t)ptr == base + sizeof(LargeHeader)) {
+        LargeHeader* h = (LargeHeader*)base;
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
+        large_allocs--;
+        large_pages -= h->pages;
+        spin_unlock_irqrestore(&heap_lock, flags);
+        h->magic = 0;
+        pmm_free_pages((void*)virt_to_phys(h), h->pages);
+        return;
+    }
+
+    kassert(magic == SLAB_MAGIC, "kfree: pointer not owned by kmalloc");
+
+    Slab* s = (Slab*)base;
+    SizeClass* c = &classes[s->class_idx];
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    int was_full = (s->freelist == 0);
+    void** obj = (void**)ptr;
+    *obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    c->inuse--;
+    c->frees++;
+
+    if (was_full)
+        partial_push(c, s);
+
+    // keep one empty slab per class warm, give the rest back to the PMM
+    if (s->inuse == 0 && !(c->partial == s && s->next == 0)) {
+        partial_remove(c, s);
+        s->magic = 0;
+        c->slabs--;
+        pmm_free_page((void*)virt_to_phys(s));
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void kmalloc_stats(void)
+{
+    uint64_t slab_pages = 0;
+    uint64_t used_bytes = 0;
+
+    print("kmalloc: class slabs inuse/cap allocs frees frag%\n");
+    for (uint32_t i = 0; i < KMALLOC_CLASSES; i++) {
+        SizeClass* c = &classes[i];
+        uint64_t size = class_size(i);
+        uint64_t per_slab = (PAGE_SIZE - slab_data_offset()) / size;
+        uint64_t cap = c->slabs * per_slab;
+        uint64_t bytes = c->slabs * PAGE_SIZE;
+
+        slab_pages += c->slabs;
+        used_bytes += c->inuse * size;
+
+        print("kmalloc: ");
+        print_dec(size);
+        print(" ");
+        print_dec(c->slabs);
+        print(" ");
+        print_dec(c->inuse);
+        print("/");
+        print_dec(cap);
+        print(" ");
+        print_dec(c->allocs);
+        print(" ");
+        print_dec(c->frees);
+        print(" ");
+        print_dec(bytes ? (bytes - c->inuse * size) * 100 / bytes : 0);
+        print("\n");
+    }
+
+    print("kmalloc: slab_pages=");
+    print_dec(slab_pages);
+    print(" frag%=");
+    print_dec(slab_pages ? (slab_pages * PAGE_SIZE - used_bytes) * 100 /
+                           (slab_pages * PAGE_SIZE) : 0);
+    print(" large_allocs=");
+    print_dec(large_allocs);
+    print(" large_pages=");
+    print_dec(large_pages);
+    print("\n");
 }
@@ -7,5 +7,6 @@ void kmalloc_init(void);
 void* kmalloc(uint64_t size);
 void* kzalloc(uint64_t size);
 void kfree(void* ptr);
+void kmalloc_stats(void);
 
 #endif
@@ -0,0 +1,114 @@
+#include "kmem_cache.h"
+#include "kmalloc.h"
+#include "pmm.h"
+#include "paging.h"
+#include "panic.h"
+#include "display.h"
+
+static KmemCache caches[KMEM_MAX_CACHES];
+static uint32_t  cache_count = 0;
+
+// page-backed objects are handed out through the direct map
+static void* backing_alloc(KmemCache* c)
+{
+    if (!c->pages)
+        return kmalloc(c->size);
+
+    // single pages come from the idle-refilled pre-zeroed pool
+    void* phys = (c->pages == 1) ? pmm_alloc_zeroed_page()
+                                 : pmm_alloc_pages(c->pages);
+    return phys ? phys_to_virt((uint64_t)phys) : 0;
+}
+
+static void backing_free(KmemCache* c, void* obj)
+{
+    if (c->pages)
+        pmm_free_pages((void*)virt_to_phys(obj), c->pages);
+    else
+        kfree(obj);
+}
+
+KmemCache* kmem_cache_create(const char* name, uint64_t size, KmemCtor ctor)
+{
+    kassert(size != 0, "kmem_cache_create: zero object size");
+    kassert(cache_count < KMEM_MAX_CACHES, "kmem_cache_create: too many caches");
+
+    KmemCache* c = &caches[cache_count++];
+    c->name = name;
+    c->size = size;
+    // page-multiple objects skip the heap and come straight from the PMM
+    c->pages = (size % PAGE_SIZE == 0) ? size / PAGE_SIZE : 0;
+    c->ctor = ctor;
+    c->lock.locked = 0;
+    c->warm_count = 0;
+    c->hits = 0;
+    c->misses = 0;
+    c->frees = 0;
+    c->releases = 0;
+    return c;
+}
+
+void* kmem_cache_alloc(KmemCache* c)
+{
+    kassert(c != 0, "kmem_cache_alloc: null cache");
+
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    if (c->warm_count) {
+        c->hits++;
+        void* obj = c->warm[--c->warm_count];
+        spin_unlock_irqrestore(&c->lock, flags);
+        return obj;
+    }
+    c->misses++;
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    // backing memory has its own lock
+    void* obj = backing_alloc(c);
+    if (obj && c->ctor)
+        c->ctor(obj);
+    return obj;
+}
+
+void kmem_cache_free(KmemCache* c, void* obj)
+{
+    kassert(c != 0, "kmem_cache_free: null cache");
+    if (!obj)
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&c->lock);
+    c->frees++;
+    if (c->warm_count < KMEM_CACHE_DEPTH) {
+        c->warm[c->warm_count++] = obj;
+        spin_unlock_irqrestore(&c->lock, flags);
+        return;
+    }
+    c->releases++;
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    backing_free(c, obj);
+}
+
+void kmem_cache_stats(void)
+{
+    print("kcache: name size warm hits misses hit% releases\n");
+    for (uint32_t i = 0; i < cache_count; i++) {
+        KmemCache* c = &caches[i];
+        uint64_t lookups = c->hits + c->misses;
+
+        print("kcache: ");
+        print(c->name);
+        print(" ");
+        print_dec(c->size);
+        print(" ");
+        print_dec(c->warm_count);
+        print(" ");
+        print_dec(c->hits);
+        print(" ");
+        print_dec(c->misses);
+        print(" ");
+        print_dec(lookups ? c->hits * 100 / lookups : 0);
+        print(" ");
+        print_dec(c->releases);
+        print("\n");
+    }
+}
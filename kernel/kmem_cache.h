@@ -0,0 +1,33 @@
+#ifndef KMEM_CACHE_H
+#define KMEM_CACHE_H
+
+#include "types.h"
+#include "spinlock.h"
+
+#define KMEM_MAX_CACHES   16
+#define KMEM_CACHE_DEPTH  32   // warm objects kept per cache
+
+// Called once when an object is first carved from backing memory.
+// Objects handed back with kmem_cache_free must be in constructed state.
+typedef void (*KmemCtor)(void* obj);
+
+typedef struct {
+    const char* name;
+    uint64_t    size;
+    uint64_t    pages;          // > 0: backed by PMM pages, else by kmalloc
+    KmemCtor    ctor;
+    Spinlock    lock;           // warm list and counters
+    void*       warm[KMEM_CACHE_DEPTH];
+    uint32_t    warm_count;
+    uint64_t    hits;           // served from the warm freelist
+    uint64_t    misses;         // had to go to backing memory
+    uint64_t    frees;
+    uint64_t    releases;       // freelist full, object returned to backing
+} KmemCache;
+
+KmemCache* kmem_cache_create(const char* name, uint64_t size, KmemCtor ctor);
+void*      kmem_cache_alloc(KmemCache* cache);
+void       kmem_cache_free(KmemCache* cache, void* obj);
+void       kmem_cache_stats(void);
+
+#endif
@@ -0,0 +1,138 @@
+#include "ktimer.h"
+#include "timer.h"
+#include "spinlock.h"
+
+// Binary min-heap on deadline. Each timer remembers its slot, so arming,
+// cancelling and expiring are all O(log n). The array is fixed so the
+// timer interrupt never has to allocate.
+static KTimer*  heap[KTIMER_MAX];
+static uint32_t heap_count = 0;
+static Spinlock heap_lock = SPINLOCK_INIT;
+
+static void heap_place(uint32_t i, KTimer* t)
+{
+    heap[i] = t;
+    t->heap_index = (int)i;
+}
+
+static void sift_up(uint32_t i)
+{
+    KTimer* t = heap[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (heap[parent]->deadline_ns <= t->deadline_ns) break;
+        heap_place(i, heap[parent]);
+        i = parent;
+    }
+    heap_place(i, t);
+}
+
+static void sift_down(uint32_t i)
+{
+    KTimer* t = heap[i];
+    while (1) {
+        uint32_t child = 2 * i + 1;
+        if (child >= heap_count) break;
+        if (child + 1 < heap_count &&
+            heap[child + 1]->deadline_ns < heap[child]->deadline_ns)
+            child++;
+        if (t->deadline_ns <= heap[child]->deadline_ns) break;
+        heap_place(i, heap[child]);
+        i = child;
+    }
+    heap_place(i, t);
+}
+
+static void heap_remove_locked(KTimer* t)
+{
+    uint32_t i = (uint32_t)t->heap_index;
+    t->heap_index = -1;
+    heap_count--;
+    if (i == heap_count) return;
+
+    // the last entry fills the hole and may belong above or below it
+    KTimer* moved = heap[heap_count];
+    heap_place(i, moved);
+    sift_down(i);
+    if ((uint32_t)moved->heap_index == i)
+        sift_up(i);
+}
+
+void ktimer_init(KTimer* t, KTimerFn fn, void* arg)
+{
+    t->deadline_ns = 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->heap_index = -1;
+}
+
+// Re-arming an armed timer moves it. Returns -1 when the heap is full.
+int ktimer_arm(KTimer* t, uint64_t deadline_ns)
+{
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    if (t->heap_index >= 0)
+        heap_remove_locked(t);
+    if (heap_count == KTIMER_MAX) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return -1;
+    }
+
+    t->deadline_ns = deadline_ns;
+    heap_place(heap_count, t);
+    heap_count++;
+    sift_up(heap_count - 1);
+    int earliest = (heap[0] == t);
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    // a cancelled or later timer can leave the hardware early, which
+    // only costs one extra interrupt; an earlier one must reprogram it
+    if (earliest)
+        timer_program_next();
+    return 0;
+}
+
+void ktimer_cancel(KTimer* t)
+{
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    if (t->heap_index >= 0)
+        heap_remove_locked(t);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+int ktimer_armed(const KTimer* t)
+{
+    return t->heap_index >= 0;
+}
+
+uint64_t ktimer_next_deadline(void)
+{
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    uint64_t next = heap_count ? heap[0]->deadline_ns : KTIMER_NONE;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return next;
+}
+
+// Callbacks run without the heap lock, so they may re-arm themselves
+uint32_t ktimer_run_expired(uint64_t now_ns)
+{
+    uint32_t fired = 0;
+    while (1) {
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
+        if (!heap_count || heap[0]->deadline_ns > now_ns) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            break;
+        }
+        KTimer* t = heap[0];
+        heap_remove_locked(t);
+        spin_unlock_irqrestore(&heap_lock, flags);
+
+        t->fn(t->arg);
+        fired++;
+    }
+    return fired;
+}
+
+uint32_t ktimer_pending(void)
+{
+    return heap_count;
+}
@@ -0,0 +1,28 @@
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include "types.h"
+
+#define KTIMER_MAX   4096           // armed at once
+#define KTIMER_NONE  0xFFFFFFFFFFFFFFFFULL
+
+typedef void (*KTimerFn)(void* arg);
+
+// One-shot kernel timer on the timer_now_ns() clock. The owner embeds it
+// and keeps it alive while armed; fn runs from the timer interrupt.
+typedef struct KTimer {
+    uint64_t deadline_ns;
+    KTimerFn fn;
+    void*    arg;
+    int      heap_index;    // -1 while not armed
+} KTimer;
+
+void     ktimer_init(KTimer* t, KTimerFn fn, void* arg);
+int      ktimer_arm(KTimer* t, uint64_t deadline_ns);
+void     ktimer_cancel(KTimer* t);
+int      ktimer_armed(const KTimer* t);
+uint64_t ktimer_next_deadline(void);
+uint32_t ktimer_run_expired(uint64_t now_ns);
+uint32_t ktimer_pending(void);
+
+#endif
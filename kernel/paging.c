@@ -86,8 +86,11 @@
 #define PAGE_WRITE    (1ULL << 1)
 #define PAGE_PCD      (1ULL << 4)
 #define PAGE_HUGE     (1ULL << 7)
+#define PAGE_GLOBAL   (1ULL << 8)
 #define PAGE_NX       (1ULL << 63)
 #define IDENTITY_MIN_4G (1ULL << 32)
+#define CR0_WP        (1ULL << 16)
+#define CR4_PGE       (1ULL << 7)
 
 static uint64_t* pml4;
 static uint64_t* pdpt;
@@ -105,6 +108,18 @@ static inline void wrmsr(uint32_t msr, uint64_t val) {
         :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
 }
 
+// Kernel image permissions by section: text RX, rodata (and the
+// unwritable orphans ld places after it) R+NX, data/bss RW+NX. All of
+// it is global so CR3 loads leave it in the TLB.
+static uint64_t kernel_page_flags(uint64_t va) {
+    uint64_t flags = PAGE_PRESENT | PAGE_GLOBAL;
+    if (va >= (uint64_t)&_data_start)
+        flags |= PAGE_WRITE | PAGE_NX;
+    else if (va >= (uint64_t)&_rodata_start)
+        flags |= PAGE_NX;
+    return flags;
+}
+
 static void* alloc_table(void) {
     uint8_t* addr = (uint8_t*)next_free_table;
     next_free_table += PAGE_SIZE;
@@ -121,8 +136,9 @@ void paging_init(BootInfo* bootInfo) {
     pml4 = alloc_table();
     pdpt = alloc_table();
 
-    // identity map — pml4[0]
-    // TODO: remove after VMM is solid
+    // direct map — pml4[256]. The same PDPT doubles as the boot identity
+    // map in pml4[0] until paging_remove_identity_map drops it.
+    pml4[HHDM_PML4_INDEX] = (uint64_t)pdpt | PAGE_PRESENT | PAGE_WRITE;
     pml4[0] = (uint64_t)pdpt | 0x3;
 
     uint8_t*  mmap  = (uint8_t*)bootInfo->memory_map;
@@ -142,7 +158,7 @@ void paging_init(BootInfo* bootInfo) {
     uint64_t max_memory = ram_top;
     if (fb_end > max_memory) max_memory = fb_end;
 
-    // Keep identity map large enough for common MMIO windows (LAPIC/IOAPIC).
+    // Keep the direct map large enough for common MMIO windows (LAPIC/IOAPIC).
     // LAPIC=0xFEE00000 and IOAPIC=0xFEC00000 are below 4 GiB.
     if (max_memory < IDENTITY_MIN_4G)
         max_memory = IDENTITY_MIN_4G;
@@ -155,7 +171,7 @@ void paging_init(BootInfo* bootInfo) {
         // pdpt[pdpt_i] = (uint64_t)pd | 0x3;
         pdpt[pdpt_i] = (uint64_t)pd | PAGE_PRESENT | PAGE_WRITE;
         for (uint64_t pd_i = 0; pd_i < ENTRIES && addr < max_memory; pd_i++) {
-            uint64_t page_flags = PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE | PAGE_NX;
+            uint64_t page_flags = PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE | PAGE_NX | PAGE_GLOBAL;
             if (addr == 0xFEC00000ULL || addr == 0xFEE00000ULL)
                 page_flags |= PAGE_PCD;
             pd[pd_i] = addr | page_flags;
@@ -163,17 +179,34 @@ void paging_init(BootInfo* bootInfo) {
         }
     }
 
-    // higher-half mapping — kernel virtual → physical 0x0
+    // higher-half kernel image — only the image itself is mapped, at
+    // 4 KiB granularity where sections meet and with 2 MiB leaves where a
+    // whole aligned chunk shares one permission class
     uint64_t* pdpt_hi = alloc_table();
-    pml4[511] = (uint64_t)pdpt_hi | 0x3;
+    pml4[511] = (uint64_t)pdpt_hi | PAGE_PRESENT | PAGE_WRITE;
 
     uint64_t* pd_hi = alloc_table();
-    pdpt_hi[510] = (uint64_t)pd_hi | 0x3;
+    pdpt_hi[510] = (uint64_t)pd_hi | PAGE_PRESENT | PAGE_WRITE;
+
+    uint64_t img_start = (uint64_t)&_kernel_start & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t img_end = ((uint64_t)&_kernel_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    for (uint64_t va = img_start & ~(PSE_2MB - 1); va < img_end; va += PSE_2MB) {
+        uint64_t pd_i = (va >> 21) & 0x1FF;
+        uint64_t chunk_end = va + PSE_2MB;
+
+        // classes only grow along the image, so equal ends mean uniform
+        if (va >= img_start && chunk_end <= img_end &&
+            kernel_page_flags(va) == kernel_page_flags(chunk_end - PAGE_SIZE)) {
+            pd_hi[pd_i] = (va - KERNEL_VIRT_BASE) | kernel_page_flags(va) | PAGE_HUGE;
+            continue;
+        }
 
-    uint64_t phys = 0;
-    for (int i = 0; i < 512; i++) {
-        pd_hi[i] = phys | 0x83;
-        phys += PSE_2MB;
+        uint64_t* pt = alloc_table();
+        pd_hi[pd_i] = (uint64_t)pt | PAGE_PRESENT | PAGE_WRITE;
+        for (uint64_t p = va; p < chunk_end; p += PAGE_SIZE) {
+            if (p < img_start || p >= img_end) continue;
+            pt[(p >> 12) & 0x1FF] = (p - KERNEL_VIRT_BASE) | kernel_page_flags(p);
+        }
     }
 
     uint64_t efer = rdmsr(0xC0000080);
@@ -187,6 +220,14 @@ void paging_init(BootInfo* bootInfo) {
     __asm__ volatile ("cli");
     __asm__ volatile ("mov %0, %%cr3" :: "r"(pml4) : "memory");
 
+    // W^X for the kernel image only holds if ring 0 honours read-only
+    // pages; global entries need PGE
+    uint64_t cr0, cr4;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile ("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ volatile ("mov %0, %%cr4" :: "r"(cr4 | CR4_PGE) : "memory");
+
     // store kernel CR3 at physical 0x500 — always accessible
     // regardless of which address space is active
     // *((volatile uint64_t*)0x500) = (uint64_t)pml4;
@@ -195,13 +236,20 @@ void paging_init(BootInfo* bootInfo) {
     print("paging_arena_end = "); print_hex(paging_arena_end); print("\n");
 }
 
+// Only valid once nothing dereferences boot-time physical pointers
+// (BootInfo, the UEFI memory map) any more.
 void paging_remove_identity_map(void)
 {
-    pml4[0] = 0;
-    // flush TLB
+    uint64_t* table = (uint64_t*)phys_to_virt((uint64_t)pml4);
+    table[0] = 0;
+    // the identity entries share the direct map's global PDs, so a CR3
+    // reload is not enough; toggling PGE flushes global entries too
     __asm__ volatile (
-        "mov %%cr3, %%rax\n"
-        "mov %%rax, %%cr3\n"
+        "mov %%cr4, %%rax\n"
+        "xor $0x80, %%rax\n"
+        "mov %%rax, %%cr4\n"
+        "xor $0x80, %%rax\n"
+        "mov %%rax, %%cr4\n"
         ::: "rax", "memory"
     );
 }
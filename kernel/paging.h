@@ -6,6 +6,25 @@
 #define KERNEL_VIRT_BASE 0xFFFFFFFF80000000ULL
 #define KERNEL_PHYS_BASE 0x100000ULL
 
+// all RAM and low MMIO, mapped once at pml4[256] and shared by every
+// address space
+#define HHDM_BASE        0xFFFF800000000000ULL
+#define HHDM_PML4_INDEX  256
+
+static inline void* phys_to_virt(uint64_t phys)
+{
+    return (void*)(phys + HHDM_BASE);
+}
+
+// accepts direct-map and kernel image addresses
+static inline uint64_t virt_to_phys(const void* virt)
+{
+    uint64_t v = (uint64_t)virt;
+    if (v >= KERNEL_VIRT_BASE)
+        return v - KERNEL_VIRT_BASE;
+    return v - HHDM_BASE;
+}
+
 extern uint64_t paging_arena_end;
 extern uint64_t kernel_cr3;
 
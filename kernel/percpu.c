@@ -1,48 +1,39 @@
 #include "percpu.h"
 #include "display.h"
+#include "cpu.h"
 
+#define MSR_GS_BASE        0xC0000101
 #define MSR_KERNEL_GS_BASE 0xC0000102
 
-// 8KB kernel stack for syscall handling
-static uint8_t syscall_stack[8192] __attribute__((aligned(16)));
-PerCPU percpu_data;
+static PerCPU percpu[SMP_MAX_CPUS];
 
-static inline void wrmsr(uint32_t msr, uint64_t val) {
-    __asm__ volatile ("wrmsr"
-        :: "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
-}
-
-static inline uint64_t read_cr3(void) {
-    uint64_t cr3;
-    __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
-    return cr3;
+// gdt_init_cpu never reloads %gs, so the base set here survives GDT
+// reloads. The kernel runs with GS = this block; KERNEL_GS_BASE holds the user
+// value (0) that swapgs exchanges in on the way to ring 3.
+void percpu_init(uint32_t cpu_id)
+{
+    PerCPU* p = &percpu[cpu_id];
+    p->self = p;
+    p->kernel_rsp = 0;
+    p->user_rsp = 0;
+    p->switched_out = 0;
+    p->cpu_id = cpu_id;
+    p->current = 0;
+    p->runqueue = 0;
+    p->tlb_generation = 0;
+    p->switch_count = 0;
+    p->switch_cycles = 0;
+    p->cr3_cycles = 0;
+
+    wrmsr(MSR_GS_BASE, (uint64_t)p);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+
+    if (cpu_id == 0)
+        print("PerCPU initialized\n");
 }
 
-extern void tss_set_rsp0(uint64_t rsp);
-
-// void percpu_init(void)
-// {
-//     percpu_data.kernel_rsp = (uint64_t)syscall_stack + sizeof(syscall_stack);
-//     percpu_data.user_rsp   = 0;
-
-//     // set TSS RSP0 to kernel stack so interrupts from ring 3 work
-//     tss_set_rsp0((uint64_t)syscall_stack + sizeof(syscall_stack));
-
-//     // KERNEL_GS_BASE points to our PerCPU struct
-//     // after swapgs, GS base = &percpu_data
-//     wrmsr(MSR_KERNEL_GS_BASE, (uint64_t)&percpu_data);
-
-//     print("PerCPU initialized\n");
-// }
-void percpu_init(void)
+PerCPU* percpu_get(uint32_t cpu_id)
 {
-    percpu_data.kernel_rsp = (uint64_t)syscall_stack + sizeof(syscall_stack);
-    percpu_data.user_rsp   = 0;
-    percpu_data.kernel_cr3 = read_cr3();  // Save current (kernel) CR3
-    percpu_data.user_cr3   = 0;  // Will be set by process_run before iretq
-
-    tss_set_rsp0((uint64_t)syscall_stack + sizeof(syscall_stack));
-    wrmsr(MSR_KERNEL_GS_BASE, (uint64_t)&percpu_data);
-
-    print("PerCPU initialized\n");
-}
\ No newline at end of file
+    if (cpu_id >= SMP_MAX_CPUS) return 0;
+    return &percpu[cpu_id];
+}
@@ -2,17 +2,46 @@
 #define PERCPU_H
 
 #include "types.h"
+#include "smp.h"
 
-// must match offsets used in syscall_entry.S
-typedef struct __attribute__((packed)) {
-    uint64_t kernel_rsp;   // offset 0
-    uint64_t user_rsp;     // offset 8
-    uint64_t kernel_cr3;   // offset 16
-    uint64_t user_cr3;     // offset 24
-} PerCPU;
+struct RunQueue;
+struct Task;
 
-extern PerCPU percpu_data;
+// Offsets used from assembly (syscall_entry.S); keep them in sync
+#define PERCPU_SELF        0
+#define PERCPU_KERNEL_RSP  8
+#define PERCPU_USER_RSP    16
+#define PERCPU_SWITCHED_OUT 24
 
-void percpu_init(void);
+// One block per CPU, reached through the GS base while in the kernel.
+// Entry paths from ring 3 swapgs so user code never sees it; each block
+// sits on its own cachelines so the switch path shares nothing.
+typedef struct PerCPU {
+    struct PerCPU*   self;          // %gs:0 — the block's own address
+    uint64_t         kernel_rsp;    // top of the running task's kernel stack
+    uint64_t         user_rsp;      // scratch for the syscall entry
+    // on_cpu flag of the task just switched away from; the switch stub
+    // clears it once nothing runs on that task's stack any more
+    volatile uint32_t* switched_out;
+    uint32_t         cpu_id;
+    struct Task*     current;       // null while nothing has been scheduled
+    struct RunQueue* runqueue;      // owned by the scheduler
+    uint64_t         tlb_generation; // PCID generation this TLB was last flushed for
+    uint64_t         switch_count;
+    // cycles spent in context_switch_from for real switches, and in the
+    // address-space switch within it
+    uint64_t         switch_cycles;
+    uint64_t         cr3_cycles;
+} __attribute__((aligned(64))) PerCPU;
 
-#endif
\ No newline at end of file
+void    percpu_init(uint32_t cpu_id);
+PerCPU* percpu_get(uint32_t cpu_id);
+
+static inline PerCPU* this_cpu(void)
+{
+    PerCPU* p;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+#endif
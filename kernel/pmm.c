@@ -184,47 +184,314 @@
 #include "pmm.h"
 #include "paging.h"
 #include "display.h"
+#include "panic.h"
+#include "klog.h"
+#include "cpu.h"
+#include "spinlock.h"
+
+// Binary buddy allocator. Each order keeps a bitmap with one bit per
+// naturally aligned 2^order block (set = free), stored as uint64_t words and
+// scanned with tzcnt. A summary bitmap above it has one bit per non-empty
+// word, and a rotating cursor remembers where the last search succeeded, so
+// finding a free block is near O(1) even when most of memory is in use.
+// used_map has one bit per page and backs the double-free guard.
+#define PMM_MAX_RESERVED   128
+
+typedef struct {
+    uint64_t* bits;           // one bit per block, set = free
+    uint64_t* summary;        // one bit per bits word, set = word non-zero
+    uint64_t  blocks;
+    uint64_t  words;
+    uint64_t  summary_words;
+    uint64_t  cursor;         // summary word where the next search starts
+    uint64_t  free;           // free blocks at this order
+} OrderMap;
+
+typedef struct {
+    uint64_t start;   // first page
+    uint64_t end;     // one past last page
+} PageRange;
 
 // placed right after page tables by paging
-// we'll get this address passed in or use a fixed region
-static uint8_t* bitmap = 0;
-static uint64_t bitmap_size   = 0;   // in bytes
-static uint64_t total_pages   = 0;
-static uint64_t free_pages    = 0;
+static uint64_t* used_map = 0;
+// extra owners per page for shared (copy-on-write) frames; 0 and 1 both
+// mean a single owner so the allocation paths never have to touch it
+static uint16_t* page_refs = 0;
+static uint64_t  meta_bytes    = 0;
+static uint64_t  total_pages   = 0;
+static uint64_t  free_pages    = 0;
+static OrderMap  orders[PMM_MAX_ORDER];
+
+static PageRange reserved[PMM_MAX_RESERVED];
+static uint32_t  reserved_count = 0;
+static uint32_t  reserved_dropped = 0;
+
+// the firmware map, for as long as pmm_init runs
+static const uint8_t* init_mmap = 0;
+static uint64_t       init_mmap_size = 0;
+static uint64_t       init_dsize = 0;
+
+// every CPU allocates and frees; one lock covers the bitmaps, the
+// refcounts and the zero pool
+static Spinlock  pmm_lock = SPINLOCK_INIT;
+
+// pages zeroed ahead of time by the idle task
+static void*     zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t  zero_pool_count = 0;
+static PmmZeroPoolStats zero_stats;
+
+// ── page zeroing ────────────────────────────────────────
+// both take physical addresses and write through the direct map
+
+// synchronous path: the caller is about to touch the page, keep it cached
+static void zero_page(void* phys) {
+    void* page = phys_to_virt((uint64_t)phys);
+    uint64_t count = PAGE_SIZE / 8;
+    __asm__ volatile ("rep stosq"
+                      : "+D"(page), "+c"(count)
+                      : "a"(0ULL)
+                      : "memory");
+}
+
+// background path: non-temporal stores so refilling does not evict
+// whatever the next task is going to run with
+static void zero_page_nt(void* phys) {
+    uint64_t* p = (uint64_t*)phys_to_virt((uint64_t)phys);
+    for (uint64_t i = 0; i < PAGE_SIZE / 8; i += 4) {
+        __asm__ volatile ("movnti %1, 0(%0)\n"
+                          "movnti %1, 8(%0)\n"
+                          "movnti %1, 16(%0)\n"
+                          "movnti %1, 24(%0)\n"
+                          :: "r"(p + i), "r"(0ULL) : "memory");
+    }
+    __asm__ volatile ("sfence" ::: "memory");
+}
 
 // ── bitmap helpers ──────────────────────────────────────
-static void bitmap_set(uint64_t page_index) {
-    bitmap[page_index / 8] |= (1 << (page_index % 8));
+static int used_test(uint64_t page) {
+    return (used_map[page / 64] >> (page % 64)) & 1;
+}
+
+// set or clear [page, page + count) a word at a time
+static void used_update(uint64_t page, uint64_t count, int used) {
+    while (count) {
+        uint64_t bit = page % 64;
+        uint64_t n = 64 - bit;
+        if (n > count) n = count;
+        uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+
+        if (used) used_map[page / 64] |= mask;
+        else      used_map[page / 64] &= ~mask;
+
+        page  += n;
+        count -= n;
+    }
 }
 
-static void bitmap_clear(uint64_t page_index) {
-    bitmap[page_index / 8] &= ~(1 << (page_index % 8));
+static int block_test(uint32_t order, uint64_t idx) {
+    return (orders[order].bits[idx / 64] >> (idx % 64)) & 1;
+}
+
+static void block_set_free(uint32_t order, uint64_t idx) {
+    OrderMap* m = &orders[order];
+    uint64_t w = idx / 64;
+    m->bits[w] |= 1ULL << (idx % 64);
+    m->summary[w / 64] |= 1ULL << (w % 64);
+    m->free++;
+}
+
+static void block_clear_free(uint32_t order, uint64_t idx) {
+    OrderMap* m = &orders[order];
+    uint64_t w = idx / 64;
+    m->bits[w] &= ~(1ULL << (idx % 64));
+    if (m->bits[w] == 0)
+        m->summary[w / 64] &= ~(1ULL << (w % 64));
+    m->free--;
+}
+
+// caller guarantees m->free != 0
+static uint64_t block_find_free(uint32_t order) {
+    OrderMap* m = &orders[order];
+    uint64_t sw = m->cursor;
+
+    for (uint64_t i = 0; i < m->summary_words; i++) {
+        if (m->summary[sw]) {
+            uint64_t w = sw * 64 + tzcnt64(m->summary[sw]);
+            m->cursor = sw;
+            return w * 64 + tzcnt64(m->bits[w]);
+        }
+        if (++sw == m->summary_words) sw = 0;
+    }
+
+    panic("PMM: free block count and bitmap disagree");
+    return 0;
+}
+
+// ── buddy core ──────────────────────────────────────────
+// insert a free, naturally aligned block and merge it with its buddies
+static void free_block(uint64_t pfn, uint32_t order) {
+    while (order < PMM_MAX_ORDER - 1) {
+        uint64_t buddy = (pfn >> order) ^ 1;
+        if (buddy >= orders[order].blocks) break;
+        if (!block_test(order, buddy)) break;
+
+        block_clear_free(order, buddy);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+    block_set_free(order, pfn >> order);
+}
+
+static int alloc_block(uint32_t order, uint64_t* out_pfn) {
+    uint32_t k = order;
+    while (k < PMM_MAX_ORDER && orders[k].free == 0)
+        k++;
+    if (k == PMM_MAX_ORDER)
+        return 0;
+
+    uint64_t idx = block_find_free(k);
+    block_clear_free(k, idx);
+    uint64_t pfn = idx << k;
+
+    // split down, returning the upper halves to their free maps
+    while (k > order) {
+        k--;
+        block_set_free(k, (pfn >> k) + 1);
+    }
+
+    *out_pfn = pfn;
+    return 1;
+}
+
+// free an arbitrary page run as the largest aligned blocks that fit
+static void free_run(uint64_t pfn, uint64_t count) {
+    while (count) {
+        uint32_t order = 0;
+        while (order + 1 < PMM_MAX_ORDER &&
+               (pfn & ((1ULL << (order + 1)) - 1)) == 0 &&
+               (1ULL << (order + 1)) <= count)
+            order++;
+
+        free_block(pfn, order);
+        free_pages += 1ULL << order;
+        pfn   += 1ULL << order;
+        count -= 1ULL << order;
+    }
 }
 
-static int bitmap_test(uint64_t page_index) {
-    return bitmap[page_index / 8] & (1 << (page_index % 8));
+static uint32_t order_for(uint64_t count) {
+    uint32_t order = 0;
+    while ((1ULL << order) < count)
+        order++;
+    return order;
 }
 
-static void reserve_page(uint64_t page)
+// ── init helpers ────────────────────────────────────────
+static int overlaps_conventional(uint64_t first, uint64_t end)
 {
-    if (page >= total_pages)
-        return;
-    if (!bitmap_test(page)) {
-        bitmap_set(page);
-        free_pages--;
+    for (uint64_t off = 0; off < init_mmap_size; off += init_dsize) {
+        const EFI_MEMORY_DESCRIPTOR* desc = (const EFI_MEMORY_DESCRIPTOR*)(init_mmap + off);
+        if (desc->Type != 7) continue;
+        uint64_t d_first = desc->PhysicalStart / PAGE_SIZE;
+        if (d_first < end && first < d_first + desc->NumberOfPages)
+            return 1;
     }
+    return 0;
 }
 
+// Only ranges that could otherwise be handed out matter, so anything
+// outside conventional memory is skipped and neighbours are merged. A
+// full table drops the range with a warning rather than stopping boot.
 static void reserve_range(uint64_t start, uint64_t bytes)
 {
     if (bytes == 0)
         return;
 
-    uint64_t start_page = start / PAGE_SIZE;
-    uint64_t end_page = (start + bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t first = start / PAGE_SIZE;
+    uint64_t end = (start + bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (end > total_pages) end = total_pages;
+    if (first >= end || !overlaps_conventional(first, end))
+        return;
 
-    for (uint64_t p = start_page; p < end_page; p++)
-        reserve_page(p);
+    for (uint32_t i = 0; i < reserved_count; i++) {
+        PageRange* r = &reserved[i];
+        if (first <= r->end && r->start <= end) {
+            if (first < r->start) r->start = first;
+            if (end > r->end) r->end = end;
+            return;
+        }
+    }
+
+    if (reserved_count == PMM_MAX_RESERVED) {
+        reserved_dropped++;
+        return;
+    }
+    reserved[reserved_count].start = first;
+    reserved[reserved_count].end   = end;
+    reserved_count++;
+}
+
+// hand [start, end) to the buddy maps, skipping every reserved range
+static void release_usable(uint64_t start, uint64_t end)
+{
+    if (end > total_pages) end = total_pages;
+
+    while (start < end) {
+        uint64_t cut = end;
+        int blocked = 0;
+
+        for (uint32_t i = 0; i < reserved_count; i++) {
+            if (reserved[i].start <= start && start < reserved[i].end) {
+                start = reserved[i].end;
+                blocked = 1;
+                break;
+            }
+            if (reserved[i].start > start && reserved[i].start < cut)
+                cut = reserved[i].start;
+        }
+        if (blocked) continue;
+
+        used_update(start, cut - start, 0);
+        free_run(start, cut - start);
+        start = cut;
+    }
+}
+
+// carve the used map and per-order maps out of one physical run
+static void layout_metadata(uint64_t base_phys)
+{
+    uint64_t base = (uint64_t)phys_to_virt(base_phys);
+    uint64_t* cur = (uint64_t*)base;
+
+    used_map = cur;
+    cur += (total_pages + 63) / 64;
+
+    for (uint32_t o = 0; o < PMM_MAX_ORDER; o++) {
+        OrderMap* m = &orders[o];
+        m->blocks = total_pages >> o;
+        m->words = (m->blocks + 63) / 64;
+        if (m->words == 0) m->words = 1;
+        m->summary_words = (m->words + 63) / 64;
+        m->cursor = 0;
+        m->free = 0;
+
+        m->bits = cur;
+        cur += m->words;
+        m->summary = cur;
+        cur += m->summary_words;
+    }
+
+    page_refs = (uint16_t*)cur;
+    cur += (total_pages * sizeof(uint16_t) + 7) / 8;
+
+    meta_bytes = (uint64_t)cur - base;
+
+    uint64_t* p = (uint64_t*)base;
+    for (uint64_t i = 0; i < meta_bytes / 8; i++)
+        p[i] = 0;
+
+    // mark everything used
+    used_update(0, total_pages, 1);
 }
 
 void pmm_init(BootInfo* bootInfo) {
@@ -239,61 +506,35 @@ void pmm_init(BootInfo* bootInfo) {
     }
 
     total_pages = max_addr / PAGE_SIZE;
-    bitmap_size = (total_pages + 7) / 8;
 
-    // place bitmap after page tables — paging_arena_end is physical
+    // place metadata after page tables — paging_arena_end is physical
     extern uint64_t paging_arena_end;
-    bitmap = (uint8_t*)paging_arena_end;
-
-    // mark everything used
-    for (uint64_t i = 0; i < bitmap_size; i++)
-        bitmap[i] = 0xFF;
+    layout_metadata(paging_arena_end);
     free_pages = 0;
-
-    // free conventional memory
-    for (uint64_t off = 0; off < bootInfo->memory_map_size; off += dsize) {
-        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)(mmap + off);
-        if (desc->Type != 7) continue;
-        for (uint64_t p = 0; p < desc->NumberOfPages; p++) {
-            uint64_t page = (desc->PhysicalStart / PAGE_SIZE) + p;
-            bitmap_clear(page);
-            free_pages++;
-        }
-    }
-
-    // mark kernel used
-    uint64_t kernel_end_virt = (uint64_t)&_kernel_end;
-    uint64_t kernel_end_phys = kernel_end_virt - KERNEL_VIRT_BASE + KERNEL_PHYS_BASE;
-    uint64_t k_start = KERNEL_PHYS_BASE / PAGE_SIZE;
-    uint64_t k_end   = (kernel_end_phys + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t p = k_start; p < k_end; p++)
-        reserve_page(p);
-
-    // mark page tables used
-    uint64_t pt_start = k_end;
-    uint64_t pt_end   = paging_arena_end / PAGE_SIZE;
-    for (uint64_t p = pt_start; p < pt_end; p++)
-        reserve_page(p);
-
-    // mark bitmap itself used
-    uint64_t bm_start = paging_arena_end / PAGE_SIZE;
-    uint64_t bm_end   = (paging_arena_end + bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t p = bm_start; p < bm_end; p++)
-        reserve_page(p);
-
-    // never allocate page 0
-    reserve_page(0);
-
-    // protect low memory — first 16 pages (64KB)
-    for (uint64_t p = 1; p < 16; p++)
-        reserve_page(p);
+    reserved_count = 0;
+    reserved_dropped = 0;
+    init_mmap = mmap;
+    init_mmap_size = bootInfo->memory_map_size;
+    init_dsize = dsize;
+    zero_pool_count = 0;
+    zero_stats.available = 0;
+    zero_stats.hits = 0;
+    zero_stats.misses = 0;
+    zero_stats.refilled = 0;
+
+    // never allocate page 0; protect low memory — first 16 pages (64KB)
+    reserve_range(0, 16 * PAGE_SIZE);
+
+    // kernel image, early page tables and PMM metadata are one physical run
+    uint64_t meta_end = paging_arena_end + meta_bytes;
+    reserve_range(KERNEL_PHYS_BASE, meta_end - KERNEL_PHYS_BASE);
 
     uint64_t fb_bytes = (uint64_t)bootInfo->height *
                         (uint64_t)bootInfo->pixels_per_scanline * 4;
     reserve_range((uint64_t)bootInfo->framebuffer, fb_bytes);
     reserve_range((uint64_t)bootInfo->rsdp, PAGE_SIZE);
 
-    // ACPI, runtime, and MMIO descriptors are not freed above, but reserving
+    // ACPI, runtime, and MMIO descriptors are not freed below, but reserving
     // them explicitly documents the ownership rule and protects odd firmware maps.
     for (uint64_t off = 0; off < bootInfo->memory_map_size; off += dsize) {
         EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)(mmap + off);
@@ -302,11 +543,23 @@ void pmm_init(BootInfo* bootInfo) {
             reserve_range(desc->PhysicalStart, desc->NumberOfPages * PAGE_SIZE);
     }
 
+    if (reserved_dropped)
+        klog_warn("PMM: reserved range table full, some firmware ranges not reserved");
+
+    // free conventional memory
+    for (uint64_t off = 0; off < bootInfo->memory_map_size; off += dsize) {
+        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)(mmap + off);
+        if (desc->Type != 7) continue;
+        uint64_t first = desc->PhysicalStart / PAGE_SIZE;
+        release_usable(first, first + desc->NumberOfPages);
+    }
+
     print("PMM: free RAM: ");
     print_dec(free_pages * PAGE_SIZE / (1024 * 1024));
     print(" MB\n");
 
-    print("PMM: bitmap at: "); print_hex((uint64_t)bitmap); print("\n");
+    print("PMM: metadata at: "); print_hex((uint64_t)used_map);
+    print(" ("); print_dec(meta_bytes); print(" bytes)\n");
     print("PMM: paging_arena_end: "); print_hex(paging_arena_end); print("\n");
     print("PMM: kernel phys: ");
     print_hex(KERNEL_PHYS_BASE); print(" - ");
@@ -315,54 +568,188 @@ void pmm_init(BootInfo* bootInfo) {
 }
 
 // ── alloc ────────────────────────────────────────────────
+static void* alloc_pages_locked(uint64_t count)
+{
+    uint32_t order = order_for(count);
+    uint64_t pfn = 0;
+    if (!alloc_block(order, &pfn))
+        return 0;  // out of memory
+
+    free_pages -= 1ULL << order;
+
+    // give back the tail of a rounded-up block
+    uint64_t block = 1ULL << order;
+    if (block > count)
+        free_run(pfn + count, block - count);
+
+    used_update(pfn, count, 1);
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+static void* alloc_page_locked(void) {
+    if (orders[0].free == 0)
+        return alloc_pages_locked(1);
+
+    // fast path: no split, one bitmap probe
+    uint64_t pfn = block_find_free(0);
+    block_clear_free(0, pfn);
+    free_pages--;
+    used_map[pfn / 64] |= 1ULL << (pfn % 64);
+    return (void*)(pfn * PAGE_SIZE);
+}
+
 void* pmm_alloc_page(void) {
-    for (uint64_t i = 0; i < total_pages; i++) {
-        if (!bitmap_test(i)) {
-            bitmap_set(i);
-            free_pages--;
-            return (void*)(i * PAGE_SIZE);
-        }
-    }
-    return 0;  // out of memory
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    void* page = alloc_page_locked();
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return page;
 }
 
-// pmm.c
 void* pmm_alloc_pages(uint64_t count)
 {
-    if (count == 0 || count > total_pages)
+    if (count == 0 || count > (1ULL << (PMM_MAX_ORDER - 1)))
         return 0;
 
-    for (uint64_t i = 1; i <= total_pages - count; i++) {
-        int found = 1;
-        for (uint64_t j = i; j < i + count; j++) {
-            if (bitmap_test(j)) { 
-                i = j;  // skip ahead to after the used page
-                found = 0; 
-                break; 
-            }
-        }
-        if (found) {
-            for (uint64_t j = i; j < i + count; j++) {
-                bitmap_set(j);
-                free_pages--;
-            }
-            return (void*)(i * PAGE_SIZE);
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    void* run = alloc_pages_locked(count);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return run;
+}
+
+static void free_page_locked(void* addr);
+
+// ── zeroed pages ─────────────────────────────────────────
+void* pmm_alloc_zeroed_page(void) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (zero_pool_count) {
+        void* page = zero_pool[--zero_pool_count];
+        zero_stats.hits++;
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return page;
+    }
+    zero_stats.misses++;
+    void* page = alloc_page_locked();
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (page)
+        zero_page(page);
+    return page;
+}
+
+// run from the idle task with interrupts enabled; only the pool and
+// allocator updates are done under the lock. Idle CPUs refill it
+// together, so a page zeroed for a pool that filled meanwhile goes back.
+void pmm_refill_zero_pool(void) {
+    while (zero_pool_count < PMM_ZERO_POOL_SIZE) {
+        void* page = pmm_alloc_page();
+        if (!page)
+            return;
+
+        zero_page_nt(page);
+
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        if (zero_pool_count < PMM_ZERO_POOL_SIZE) {
+            zero_pool[zero_pool_count++] = page;
+            zero_stats.refilled++;
+            page = 0;
         }
+        if (page)
+            free_page_locked(page);
+        spin_unlock_irqrestore(&pmm_lock, flags);
     }
-    return 0;
 }
 
 // ── free ─────────────────────────────────────────────────
-void pmm_free_page(void* addr) {
+void pmm_free_pages(void* addr, uint64_t count) {
     uint64_t page = (uint64_t)addr / PAGE_SIZE;
     if (page == 0 || page >= total_pages) return;  // guard
-    if (bitmap_test(page)) {
-        bitmap_clear(page);
-        free_pages++;
+    if (count > total_pages - page) count = total_pages - page;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    // release runs of pages that are actually allocated;
+    // silently ignore double-free of the rest
+    uint64_t end = page + count;
+    while (page < end) {
+        if (!used_test(page)) {
+            page++;
+            continue;
+        }
+
+        // shared frames must go through pmm_free_page, one ref at a time
+        uint64_t run = page;
+        while (run < end && used_test(run)) {
+            kassert(page_refs[run] <= 1, "pmm_free_pages: page is still shared");
+            page_refs[run] = 0;
+            run++;
+        }
+        used_update(page, run - page, 0);
+        free_run(page, run - page);
+        page = run;
     }
-    // silently ignore double-free
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+static void free_page_locked(void* addr) {
+    uint64_t page = (uint64_t)addr / PAGE_SIZE;
+    if (page == 0 || page >= total_pages) return;  // guard
+    if (!used_test(page)) return;                  // silently ignore double-free
+
+    // shared frame: drop one reference, the last owner frees it
+    if (page_refs[page] > 1) {
+        page_refs[page]--;
+        return;
+    }
+    page_refs[page] = 0;
+
+    used_map[page / 64] &= ~(1ULL << (page % 64));
+    free_block(page, 0);
+    free_pages++;
+}
+
+void pmm_free_page(void* addr) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    free_page_locked(addr);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+void pmm_page_ref(void* addr)
+{
+    uint64_t page = (uint64_t)addr / PAGE_SIZE;
+    if (page == 0 || page >= total_pages) return;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    kassert(used_test(page), "pmm_page_ref: page is free");
+    kassert(page_refs[page] < 0xFFFF, "pmm_page_ref: refcount overflow");
+    page_refs[page] = page_refs[page] ? page_refs[page] + 1 : 2;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+// A snapshot: another owner may drop its reference right after
+uint32_t pmm_page_refcount(void* addr)
+{
+    uint64_t page = (uint64_t)addr / PAGE_SIZE;
+    if (page == 0 || page >= total_pages) return 0;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint32_t refs = !used_test(page) ? 0 : page_refs[page] ? page_refs[page] : 1;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return refs;
 }
 
 // ── stats ────────────────────────────────────────────────
 uint64_t pmm_get_free_pages(void)  { return free_pages; }
 uint64_t pmm_get_total_pages(void) { return total_pages; }
+
+uint64_t pmm_get_free_blocks(uint32_t order)
+{
+    if (order >= PMM_MAX_ORDER) return 0;
+    return orders[order].free;
+}
+
+void pmm_get_zero_pool_stats(PmmZeroPoolStats* out)
+{
+    if (!out) return;
+    *out = zero_stats;
+    out->available = zero_pool_count;
+}
@@ -5,12 +5,28 @@
 #include "bootinfo.h"
 
 #define PAGE_SIZE 4096
+#define PMM_MAX_ORDER 15   // buddy orders 0..14, largest block = 64 MiB
+#define PMM_ZERO_POOL_SIZE 64
+
+typedef struct {
+    uint64_t available;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t refilled;
+} PmmZeroPoolStats;
 
 void     pmm_init(BootInfo* bootInfo);
 void*    pmm_alloc_page(void);
 void*    pmm_alloc_pages(uint64_t count);
+void*    pmm_alloc_zeroed_page(void);
+void     pmm_refill_zero_pool(void);
 void     pmm_free_page(void* addr);
+void     pmm_free_pages(void* addr, uint64_t count);
+void     pmm_page_ref(void* addr);
+uint32_t pmm_page_refcount(void* addr);
 uint64_t pmm_get_free_pages(void);
 uint64_t pmm_get_total_pages(void);
+uint64_t pmm_get_free_blocks(uint32_t order);
+void     pmm_get_zero_pool_stats(PmmZeroPoolStats* out);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,14 @@
 #include "pmm.h"
 #include "paging.h"
 #include "syscall_abi.h"
+#include "string.h"
+#include "cpu.h"
+#include "kmalloc.h"
+#include "kmem_cache.h"
+#include "idmap.h"
+#include "vvar.h"
+#include "percpu.h"
+#include "spinlock.h"
 
 #define PT_LOAD   1
 #define PF_X      1
@@ -17,6 +25,12 @@ extern uint8_t _binary_user_hello_elf_start;
 extern uint8_t _binary_user_hello_elf_end;
 extern uint8_t _binary_user_burn_elf_start;
 extern uint8_t _binary_user_burn_elf_end;
+extern uint8_t _binary_user_sysbench_elf_start;
+extern uint8_t _binary_user_sysbench_elf_end;
+extern uint8_t _binary_user_forktest_elf_start;
+extern uint8_t _binary_user_forktest_elf_end;
+extern uint8_t _binary_user_segtest_elf_start;
+extern uint8_t _binary_user_segtest_elf_end;
 
 typedef struct {
     uint8_t  e_ident[16];
@@ -46,76 +60,233 @@ typedef struct {
     uint64_t p_align;
 } Elf64_Phdr;
 
-static Process proc_table[MAX_PROCESSES];
-static int next_pid = 1;
+// physically contiguous run of fully loaded read-only pages of a cached
+// image, mapped into each instance with one range call
+typedef struct {
+    uint64_t va;
+    uint64_t phys;
+    uint64_t pages;
+    uint64_t flags;
+} SharedRun;
+
+// Parsed ELF blob: the VMA template every instance starts from, plus the
+// read-only pages all instances map instead of loading their own copy.
+typedef struct {
+    const uint8_t* blob;
+    uint64_t       size;
+    uint64_t       entry;
+    Vma            vmas[PROCESS_MAX_IMAGE_VMAS];
+    int            vma_count;
+    SharedRun*     shared;
+    uint64_t       shared_count;
+} ElfImage;
+
+#define IMAGE_CACHE_SIZE 8
+
+static ElfImage image_cache[IMAGE_CACHE_SIZE];
+static int image_cache_count = 0;
+
+// The process table, the reap and zombie lists, the image cache and
+// every Process field. Public entries call each other (ring ops spawn
+// and wait, faults fault in), so the owning CPU may take it again.
+static Spinlock proc_lock = SPINLOCK_INIT;
+static volatile int proc_owner = -1;
+static uint32_t proc_depth = 0;
+
+static IdMap pid_map;
+static KmemCache* process_cache = 0;
+static uint64_t active_count = 0;
+static ProcessSpawnStats spawn_stats;
+
+// exited, address space still to be torn down
+static Process* reap_head = 0;
+
+// reaped and waiting for someone to collect the exit code, oldest first
+static Process* zombie_head = 0;
+static Process* zombie_tail = 0;
+static uint32_t zombie_count = 0;
+
+uint64_t process_lock(void)
+{
+    uint64_t flags = irq_save();
+    int cpu = (int)this_cpu()->cpu_id;
+    if (proc_owner != cpu) {
+        spin_lock(&proc_lock);
+        proc_owner = cpu;
+    }
+    proc_depth++;
+    return flags;
+}
 
-static int alloc_process_slot(void)
+void process_unlock(uint64_t flags)
 {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        Process* p = &proc_table[i];
-        if (!p->used)
-            return i;
-        if (p->used && p->exited && p->address_space == 0 && p->main_tid < 0)
-            return i;
+    if (--proc_depth == 0) {
+        proc_owner = -1;
+        spin_unlock(&proc_lock);
     }
-    return -1;
+    irq_restore(flags);
+}
+
+static Process* alloc_process(void)
+{
+    Process* p = (Process*)kmem_cache_alloc(process_cache);
+    if (!p) return 0;
+    memset(p, 0, sizeof(*p));
+
+    int pid = idmap_alloc(&pid_map, p);
+    if (pid < 0) {
+        kmem_cache_free(process_cache, p);
+        return 0;
+    }
+    p->pid = pid;
+    p->main_tid = -1;
+    p->waiter_tid = -1;
+    return p;
+}
+
+static void free_process(Process* p)
+{
+    idmap_free(&pid_map, p->pid);
+    kmem_cache_free(process_cache, p);
 }
 
 static Process* find_process_by_pid(int pid)
 {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        Process* p = &proc_table[i];
-        if (!p->used) continue;
-        if (p->pid == pid) return p;
+    return (Process*)idmap_get(&pid_map, pid);
+}
+
+Process* process_get(int pid)
+{
+    return find_process_by_pid(pid);
+}
+
+static void zombie_remove(Process* p)
+{
+    if (p->list_prev) p->list_prev->list_next = p->list_next;
+    else              zombie_head = p->list_next;
+    if (p->list_next) p->list_next->list_prev = p->list_prev;
+    else              zombie_tail = p->list_prev;
+    p->list_next = 0;
+    p->list_prev = 0;
+    zombie_count--;
+}
+
+// Nobody may ever wait for a zombie, so only the newest few are kept
+static void zombie_add(Process* p)
+{
+    p->list_next = 0;
+    p->list_prev = zombie_tail;
+    if (zombie_tail) zombie_tail->list_next = p;
+    else             zombie_head = p;
+    zombie_tail = p;
+    zombie_count++;
+
+    if (zombie_count > PROCESS_MAX_ZOMBIES) {
+        Process* old = zombie_head;
+        zombie_remove(old);
+        free_process(old);
+    }
+}
+
+static void mark_exited(Process* p, int code)
+{
+    p->exited = 1;
+    p->exit_code = code;
+    if (!p->reap_pending) {
+        p->reap_pending = 1;
+        p->list_next = reap_head;
+        p->list_prev = 0;
+        reap_head = p;
+    }
+    active_count--;
+    if (ioring_process_exited(p) > 0)
+        p->collected = 1;
+
+    if (p->waiter_tid >= 0) {
+        task_wake(p->waiter_tid);
+        p->waiter_tid = -1;
     }
-    return 0;
 }
 
 void process_init(void)
 {
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        proc_table[i].used = 0;
-        proc_table[i].pid = 0;
-        proc_table[i].address_space = 0;
-        proc_table[i].main_tid = -1;
-        proc_table[i].entry = 0;
-        proc_table[i].user_rsp = 0;
-        proc_table[i].exited = 0;
-        proc_table[i].exit_code = 0;
-        proc_table[i].reap_pending = 0;
-    }
-    next_pid = 1;
+    idmap_init(&pid_map, 1);
+    if (!process_cache)
+        process_cache = kmem_cache_create("process", sizeof(Process), 0);
+    active_count = 0;
+    reap_head = 0;
+    zombie_head = 0;
+    zombie_tail = 0;
+    zombie_count = 0;
+    spawn_stats.count = 0;
+    spawn_stats.last_cycles = 0;
+    spawn_stats.min_cycles = 0;
+    spawn_stats.max_cycles = 0;
+    spawn_stats.total_cycles = 0;
+    spawn_stats.image_hits = 0;
+    spawn_stats.image_misses = 0;
     klog_info("process: table initialized");
 }
 
-static int map_user_stack(AddressSpace* as, uint64_t* out_rsp)
+static Vma* add_vma(Vma* vmas, int* count, int max, uint64_t start, uint64_t end,
+                    uint64_t flags, VmaKind kind)
+{
+    if (*count >= max) return 0;
+
+    Vma* vma = &vmas[(*count)++];
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->kind = kind;
+    vma->file_start = 0;
+    vma->file_end = 0;
+    vma->file_offset = 0;
+    vma->grows_down = 0;
+    vma->limit = start;
+    return vma;
+}
+
+static int map_user_stack(Process* p, uint64_t* out_rsp)
 {
-    if (!as || !out_rsp) return -1;
+    if (!p || !out_rsp) return -1;
 
     uint64_t stack_base = PROCESS_STACK_VIRT - (uint64_t)PROCESS_STACK_PAGES * 0x1000ULL;
-    if (stack_base < USER_LOWER_LIMIT || PROCESS_STACK_VIRT >= USER_UPPER_LIMIT)
+    uint64_t stack_limit = PROCESS_STACK_VIRT - (uint64_t)PROCESS_STACK_MAX_PAGES * 0x1000ULL;
+    if (stack_limit < USER_LOWER_LIMIT || PROCESS_STACK_VIRT >= USER_UPPER_LIMIT)
         return -1;
 
-    for (int i = 0; i < PROCESS_STACK_PAGES; i++) {
-        void* page = pmm_alloc_page();
-        if (!page) return -1;
-
-        uint8_t* vpage = (uint8_t*)page;
-        for (int j = 0; j < 4096; j++) vpage[j] = 0;
-
-        uint64_t va = PROCESS_STACK_VIRT - (uint64_t)(i + 1) * 0x1000;
-        vmm_map(as, va, (uint64_t)page,
-                VMM_FLAG_PRESENT | VMM_FLAG_WRITE | VMM_FLAG_USER | VMM_FLAG_NX);
-    }
+    // reserve only; pages appear as the program pushes into them. The page
+    // below stack_limit is never mapped and acts as the guard.
+    Vma* vma = add_vma(p->vmas, &p->vma_count, PROCESS_MAX_VMAS,
+                       stack_base, PROCESS_STACK_VIRT,
+                       VMM_FLAG_PRESENT | VMM_FLAG_WRITE | VMM_FLAG_USER | VMM_FLAG_NX,
+                       VMA_ANON);
+    if (!vma) return -1;
+    vma->grows_down = 1;
+    vma->limit = stack_limit;
 
     *out_rsp = PROCESS_STACK_VIRT;
     return 0;
 }
 
-static int load_elf_into_as(AddressSpace* as, const void* elf_data, uint64_t size,
-                            uint64_t* out_entry)
+// The shared rings are ordinary anonymous memory: the first touch faults
+// them in, and a process that never uses them costs nothing. The io ring
+// page is one the kernel keeps a pointer to, so a fork does not share it.
+static int map_rings(Process* p)
+{
+    uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_WRITE | VMM_FLAG_USER | VMM_FLAG_NX;
+    if (!add_vma(p->vmas, &p->vma_count, PROCESS_MAX_VMAS,
+                 CONSOLE_RING_VIRT, CONSOLE_RING_DATA + CONSOLE_RING_SIZE, flags, VMA_ANON))
+        return -1;
+    if (!add_vma(p->vmas, &p->vma_count, PROCESS_MAX_VMAS,
+                 IORING_VIRT, IORING_VIRT + 0x1000, flags | VMM_FLAG_NOFORK, VMA_ANON))
+        return -1;
+    return 0;
+}
+
+static int parse_elf(ElfImage* img, const void* elf_data, uint64_t size)
 {
-    if (!as || !out_entry || !elf_data || size < sizeof(Elf64_Ehdr)) return -1;
+    if (!img || !elf_data || size < sizeof(Elf64_Ehdr)) return -1;
 
     Elf64_Ehdr* ehdr = (Elf64_Ehdr*)elf_data;
 
@@ -131,6 +302,12 @@ static int load_elf_into_as(AddressSpace* as, const void* elf_data, uint64_t siz
 
     Elf64_Phdr* phdrs = (Elf64_Phdr*)((uint8_t*)elf_data + ehdr->e_phoff);
 
+    img->blob = (const uint8_t*)elf_data;
+    img->size = size;
+    img->vma_count = 0;
+    img->shared = 0;
+    img->shared_count = 0;
+
     for (uint16_t i = 0; i < ehdr->e_phnum; i++) {
         Elf64_Phdr* ph = &phdrs[i];
         if (ph->p_type != PT_LOAD) continue;
@@ -146,68 +323,313 @@ static int load_elf_into_as(AddressSpace* as, const void* elf_data, uint64_t siz
         if (ph->p_flags & PF_W) flags |= VMM_FLAG_WRITE;
         if (!(ph->p_flags & PF_X)) flags |= VMM_FLAG_NX;
 
-        for (uint64_t va = seg_start; va < seg_end; va += 0x1000) {
-            if (vmm_virt_to_phys(as, va))
-                continue;
+        // record the segment; its pages are filled from the file with the
+        // BSS tail zeroed, either on first touch or once per image
+        Vma* vma = add_vma(img->vmas, &img->vma_count, PROCESS_MAX_IMAGE_VMAS,
+                           seg_start, seg_end, flags, VMA_FILE);
+        if (!vma) return -1;
+        vma->file_start = ph->p_vaddr;
+        vma->file_end = ph->p_vaddr + ph->p_filesz;
+        vma->file_offset = ph->p_offset;
+    }
 
-            void* page = pmm_alloc_page();
-            if (!page) return -1;
+    img->entry = ehdr->e_entry;
+    return 0;
+}
 
-            uint8_t* vpage = (uint8_t*)page;
-            for (int k = 0; k < 4096; k++) vpage[k] = 0;
+// Segments may share a boundary page, so every VMA overlapping va
+// contributes its permissions. Returns 0 when nothing covers va.
+static uint64_t page_flags(const Vma* vmas, int count, uint64_t va, int* full_copy)
+{
+    uint64_t flags = 0;
+    *full_copy = 0;
+    for (int i = 0; i < count; i++) {
+        const Vma* vma = &vmas[i];
+        if (va < vma->start || va >= vma->end) continue;
+        if (!flags) flags = VMM_FLAG_PRESENT | VMM_FLAG_USER | VMM_FLAG_NX;
+        flags |= vma->flags & (VMM_FLAG_WRITE | VMM_FLAG_NOFORK);
+        if (!(vma->flags & VMM_FLAG_NX)) flags &= ~VMM_FLAG_NX;
+        if (vma->kind == VMA_FILE && vma->file_start <= va && vma->file_end >= va + 0x1000)
+            *full_copy = 1;
+    }
+    return flags;
+}
 
-            vmm_map(as, va, (uint64_t)page, flags);
-        }
+// Copy every file span that lands on the page at va into page
+static void fill_page(uint8_t* page, const Vma* vmas, int count,
+                      const uint8_t* image, uint64_t va)
+{
+    for (int i = 0; i < count; i++) {
+        const Vma* vma = &vmas[i];
+        if (vma->kind != VMA_FILE || va < vma->start || va >= vma->end) continue;
+
+        uint64_t copy_from = (vma->file_start > va) ? vma->file_start : va;
+        uint64_t copy_to = (vma->file_end < va + 0x1000) ? vma->file_end : va + 0x1000;
+        if (copy_from < copy_to)
+            memcpy(page + (copy_from - va),
+                   image + vma->file_offset + (copy_from - vma->file_start),
+                   copy_to - copy_from);
+    }
+}
+
+// Allocate and fill the page at va; returns the physical page
+static uint8_t* build_page(const Vma* vmas, int count, const uint8_t* image,
+                           uint64_t va, int full_copy)
+{
+    // a page filled entirely from the file needs no clearing
+    void* phys = full_copy ? pmm_alloc_page() : pmm_alloc_zeroed_page();
+    if (!phys) return 0;
+
+    fill_page((uint8_t*)phys_to_virt((uint64_t)phys), vmas, count, image, va);
+    return (uint8_t*)phys;
+}
+
+// a page no writable segment touches, not already part of a run
+static int shareable(ElfImage* img, uint64_t va, uint64_t* flags, int* full_copy)
+{
+    *flags = page_flags(img->vmas, img->vma_count, va, full_copy);
+    if (!*flags || (*flags & VMM_FLAG_WRITE)) return 0;
 
-        uint8_t* src = (uint8_t*)elf_data + ph->p_offset;
-        for (uint64_t off = 0; off < ph->p_filesz; off++) {
-            uint64_t va = ph->p_vaddr + off;
-            uint64_t phys = vmm_virt_to_phys(as, va);
+    for (uint64_t i = 0; i < img->shared_count; i++) {
+        SharedRun* r = &img->shared[i];
+        if (va >= r->va && va < r->va + r->pages * 0x1000)
+            return 0;
+    }
+    return 1;
+}
+
+// Load every page no writable segment touches, once, as contiguous runs.
+// The cache holds one reference on each page; address spaces running the
+// image add their own.
+static int load_shared_pages(ElfImage* img)
+{
+    uint64_t max = 0;
+    for (int i = 0; i < img->vma_count; i++)
+        if (!(img->vmas[i].flags & VMM_FLAG_WRITE))
+            max += (img->vmas[i].end - img->vmas[i].start) / 0x1000;
+    if (max == 0) return 0;
+
+    img->shared = (SharedRun*)kmalloc(max * sizeof(SharedRun));
+    if (!img->shared) return -1;
+
+    for (int i = 0; i < img->vma_count; i++) {
+        Vma* vma = &img->vmas[i];
+        if (vma->flags & VMM_FLAG_WRITE) continue;
+
+        uint64_t va = vma->start;
+        while (va < vma->end) {
+            uint64_t flags;
+            int full_copy;
+            if (!shareable(img, va, &flags, &full_copy)) {
+                va += 0x1000;
+                continue;
+            }
+
+            uint64_t run_end = va + 0x1000;
+            while (run_end < vma->end) {
+                uint64_t next_flags;
+                int next_full;
+                if (!shareable(img, run_end, &next_flags, &next_full) || next_flags != flags)
+                    break;
+                run_end += 0x1000;
+            }
+
+            uint64_t pages = (run_end - va) / 0x1000;
+            void* phys = pmm_alloc_pages(pages);
             if (!phys) return -1;
-            *((uint8_t*)phys) = src[off];
+
+            for (uint64_t n = 0; n < pages; n++) {
+                uint64_t page_va = va + n * 0x1000;
+                uint8_t* page = (uint8_t*)phys_to_virt((uint64_t)phys + n * 0x1000);
+                page_flags(img->vmas, img->vma_count, page_va, &full_copy);
+                if (!full_copy)
+                    memset(page, 0, 0x1000);
+                fill_page(page, img->vmas, img->vma_count, img->blob, page_va);
+            }
+
+            SharedRun* r = &img->shared[img->shared_count++];
+            r->va = va;
+            r->phys = (uint64_t)phys;
+            r->pages = pages;
+            r->flags = flags;
+            va = run_end;
         }
     }
+    return 0;
+}
+
+static ElfImage* image_lookup(const void* elf_data, uint64_t size)
+{
+    for (int i = 0; i < image_cache_count; i++) {
+        ElfImage* img = &image_cache[i];
+        if (img->blob == elf_data && img->size == size) {
+            spawn_stats.image_hits++;
+            return img;
+        }
+    }
+
+    spawn_stats.image_misses++;
+    if (image_cache_count >= IMAGE_CACHE_SIZE) return 0;
 
-    *out_entry = ehdr->e_entry;
+    ElfImage* img = &image_cache[image_cache_count];
+    if (parse_elf(img, elf_data, size) < 0 || load_shared_pages(img) < 0) {
+        for (uint64_t i = 0; i < img->shared_count; i++)
+            pmm_free_pages((void*)img->shared[i].phys, img->shared[i].pages);
+        if (img->shared) kfree(img->shared);
+        return 0;
+    }
+
+    image_cache_count++;
+    return img;
+}
+
+static Vma* find_vma(Process* p, uint64_t va)
+{
+    for (int i = 0; i < p->vma_count; i++) {
+        Vma* vma = &p->vmas[i];
+        if (va >= vma->start && va < vma->end)
+            return vma;
+    }
     return 0;
 }
 
-int process_spawn_from_elf(const void* elf_data, uint64_t size)
+// Extend a grows-down VMA to cover va, keeping an unmapped guard page
+// between it and whatever region lies below.
+static Vma* grow_stack(Process* p, uint64_t va)
 {
-    int slot = alloc_process_slot();
-    if (slot < 0) return -1;
+    for (int i = 0; i < p->vma_count; i++) {
+        Vma* vma = &p->vmas[i];
+        if (!vma->grows_down) continue;
+        if (va >= vma->start || va < vma->limit) continue;
+
+        for (int j = 0; j < p->vma_count; j++) {
+            Vma* other = &p->vmas[j];
+            if (other == vma) continue;
+            if (other->end + 0x1000 > va && other->start < vma->start)
+                return 0;
+        }
 
-    AddressSpace* as = vmm_create_address_space();
-    if (!as) return -1;
+        vma->start = va;
+        return vma;
+    }
+    return 0;
+}
 
-    uint64_t entry = 0;
-    if (load_elf_into_as(as, elf_data, size, &entry) < 0) {
-        vmm_destroy_address_space(as);
+// Map one private page of p at va on first touch
+static int fault_in_page(Process* p, uint64_t va, int write, int exec)
+{
+    if (va < USER_LOWER_LIMIT || va >= USER_UPPER_LIMIT) return -1;
+    if (!p->address_space) return -1;
+
+    if (!find_vma(p, va) && !grow_stack(p, va))
         return -1;
+
+    int full_copy;
+    uint64_t flags = page_flags(p->vmas, p->vma_count, va, &full_copy);
+
+    if (write && !(flags & VMM_FLAG_WRITE)) return -1;
+    if (exec && (flags & VMM_FLAG_NX)) return -1;
+
+    if (vmm_virt_to_phys(p->address_space, va))
+        return 0;
+
+    uint8_t* page = build_page(p->vmas, p->vma_count, p->image, va, full_copy);
+    if (!page) return -1;
+
+    vmm_map(p->address_space, va, (uint64_t)page, flags);
+    p->resident_pages++;
+    p->page_faults++;
+    return 0;
+}
+
+// one range walk per VMA; pages shared with an image or a fork parent
+// only lose this process's reference
+static void release_user_pages(Process* p)
+{
+    for (int i = 0; i < p->vma_count; i++) {
+        Vma* vma = &p->vmas[i];
+        p->resident_pages -= vmm_unmap_range(p->address_space, vma->start,
+                                             vma->end - vma->start, 1);
     }
+    p->vma_count = 0;
+}
 
-    uint64_t user_rsp = 0;
-    if (map_user_stack(as, &user_rsp) < 0) {
-        vmm_destroy_address_space(as);
+static void note_spawn_latency(uint64_t cycles)
+{
+    spawn_stats.count++;
+    spawn_stats.last_cycles = cycles;
+    spawn_stats.total_cycles += cycles;
+    if (spawn_stats.count == 1 || cycles < spawn_stats.min_cycles)
+        spawn_stats.min_cycles = cycles;
+    if (cycles > spawn_stats.max_cycles)
+        spawn_stats.max_cycles = cycles;
+}
+
+static int spawn_from_elf(const void* elf_data, uint64_t size)
+{
+    uint64_t t_start = rdtsc();
+
+    Process* p = alloc_process();
+    if (!p) return -1;
+
+    AddressSpace* as = vmm_create_address_space();
+    if (!as) {
+        free_process(p);
         return -1;
     }
 
-    int pid = next_pid++;
-    int tid = task_create_user(pid, as, entry, user_rsp);
+    // cached images only need their shared pages mapped; a full cache
+    // falls back to a private parse with every page loaded on demand
+    ElfImage private_img;
+    ElfImage* img = image_lookup(elf_data, size);
+    if (!img) {
+        if (parse_elf(&private_img, elf_data, size) < 0) {
+            vmm_destroy_address_space(as);
+            free_process(p);
+            return -1;
+        }
+        img = &private_img;
+    }
+
+    // the blob must outlive the process: private pages are copied lazily
+    p->address_space = as;
+    vvar_set_pid(as, p->pid);
+    p->image = img->blob;
+    p->image_size = img->size;
+    p->vma_count = img->vma_count;
+    for (int i = 0; i < img->vma_count; i++)
+        p->vmas[i] = img->vmas[i];
+    p->resident_pages = 0;
+    p->page_faults = 0;
+
+    for (uint64_t i = 0; i < img->shared_count; i++) {
+        SharedRun* r = &img->shared[i];
+        for (uint64_t n = 0; n < r->pages; n++)
+            pmm_page_ref((void*)(r->phys + n * 0x1000));
+        vmm_map_range(as, r->va, r->phys, r->pages * 0x1000, r->flags);
+        p->resident_pages += r->pages;
+    }
+
+    uint64_t entry = img->entry;
+    uint64_t user_rsp = 0;
+    int pid = p->pid;
+    int tid = -1;
+    if (map_user_stack(p, &user_rsp) == 0 && map_rings(p) == 0)
+        tid = task_create_user(pid, as, entry, user_rsp);
     if (tid < 0) {
+        release_user_pages(p);
         vmm_destroy_address_space(as);
+        free_process(p);
         return -1;
     }
 
-    proc_table[slot].used = 1;
-    proc_table[slot].pid = pid;
-    proc_table[slot].address_space = as;
-    proc_table[slot].main_tid = tid;
-    proc_table[slot].entry = entry;
-    proc_table[slot].user_rsp = user_rsp;
-    proc_table[slot].exited = 0;
-    proc_table[slot].exit_code = 0;
-    proc_table[slot].reap_pending = 0;
+    // spawn latency: entry until the task is runnable
+    note_spawn_latency(rdtsc() - t_start);
+
+    p->main_tid = tid;
+    p->entry = entry;
+    p->user_rsp = user_rsp;
+    active_count++;
 
     print("[proc spawn pid=");
     print_dec((uint64_t)pid);
@@ -220,6 +642,76 @@ int process_spawn_from_elf(const void* elf_data, uint64_t size)
     return pid;
 }
 
+int process_spawn_from_elf(const void* elf_data, uint64_t size)
+{
+    uint64_t flags = process_lock();
+    int pid = spawn_from_elf(elf_data, size);
+    process_unlock(flags);
+    return pid;
+}
+
+static int fork_current(const InterruptFrame* frame)
+{
+    Process* parent = find_process_by_pid(task_current_pid());
+    if (!frame || !parent || parent->exited || !parent->address_space)
+        return -1;
+
+    Process* child = alloc_process();
+    if (!child) return -1;
+
+    AddressSpace* as = vmm_create_address_space();
+    if (!as) {
+        free_process(child);
+        return -1;
+    }
+
+    // the child shares every resident frame copy-on-write with the parent
+    int pid = child->pid;
+    child->address_space = as;
+    vvar_set_pid(as, pid);
+    child->entry = parent->entry;
+    child->image = parent->image;
+    child->image_size = parent->image_size;
+    child->vma_count = parent->vma_count;
+    for (int i = 0; i < parent->vma_count; i++)
+        child->vmas[i] = parent->vmas[i];
+    child->resident_pages = parent->resident_pages;
+    if (vmm_virt_to_phys(parent->address_space, IORING_VIRT))
+        child->resident_pages--;    // VMM_FLAG_NOFORK: not copied
+
+    int tid = -1;
+    if (vmm_fork_user(as, parent->address_space) == 0)
+        tid = task_fork_user(pid, as, frame);
+    if (tid < 0) {
+        release_user_pages(child);
+        vmm_destroy_address_space(as);
+        free_process(child);
+        return -1;
+    }
+
+    child->main_tid = tid;
+    child->user_rsp = frame->rsp;
+    active_count++;
+
+    print("[proc fork pid=");
+    print_dec((uint64_t)pid);
+    print(" parent=");
+    print_dec((uint64_t)parent->pid);
+    print(" tid=");
+    print_dec((uint64_t)tid);
+    print("]\n");
+
+    return pid;
+}
+
+int process_fork(const InterruptFrame* frame)
+{
+    uint64_t flags = process_lock();
+    int pid = fork_current(frame);
+    process_unlock(flags);
+    return pid;
+}
+
 int process_spawn_builtin(int image_id)
 {
     if (image_id == SPAWN_IMAGE_HELLO) {
@@ -232,13 +724,32 @@ int process_spawn_builtin(int image_id)
         return process_spawn_from_elf(&_binary_user_burn_elf_start, size);
     }
 
+    if (image_id == SPAWN_IMAGE_SYSBENCH) {
+        uint64_t size = (uint64_t)(&_binary_user_sysbench_elf_end - &_binary_user_sysbench_elf_start);
+        return process_spawn_from_elf(&_binary_user_sysbench_elf_start, size);
+    }
+
+    if (image_id == SPAWN_IMAGE_FORKTEST) {
+        uint64_t size = (uint64_t)(&_binary_user_forktest_elf_end - &_binary_user_forktest_elf_start);
+        return process_spawn_from_elf(&_binary_user_forktest_elf_start, size);
+    }
+
+    if (image_id == SPAWN_IMAGE_SEGTEST) {
+        uint64_t size = (uint64_t)(&_binary_user_segtest_elf_end - &_binary_user_segtest_elf_start);
+        return process_spawn_from_elf(&_binary_user_segtest_elf_start, size);
+    }
+
     return -1;
 }
 
 void process_task_exited(int pid, int code)
 {
+    uint64_t flags = process_lock();
     Process* p = find_process_by_pid(pid);
-    if (!p) return;
+    if (!p) {
+        process_unlock(flags);
+        return;
+    }
 
     print("[proc exit pid=");
     print_dec((uint64_t)pid);
@@ -246,43 +757,61 @@ void process_task_exited(int pid, int code)
     print_dec((uint64_t)code);
     print("]\n");
 
-    p->exited = 1;
-    p->exit_code = code;
-    p->reap_pending = 1;
+    if (!p->exited)
+        mark_exited(p, code);
+    process_unlock(flags);
 }
 
-void process_reap_deferred(void)
+// Only exited processes are visited, so the per-switch cost is nothing
+// while everyone is alive
+static void reap_deferred(void)
 {
-    Task* current = task_current();
-    AddressSpace* current_as = current ? current->address_space : 0;
-
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        Process* p = &proc_table[i];
-        if (!p->used || !p->reap_pending)
-            continue;
-
-        if (!p->address_space) {
-            p->reap_pending = 0;
-            p->main_tid = -1;
+    Process** link = &reap_head;
+    while (*link) {
+        Process* p = *link;
+
+        // a task is freed only once its CPU has switched away from it,
+        // and so from its address space too; until then the tid still
+        // names it
+        Task* t = task_get(p->main_tid);
+        if (p->address_space && t && t->pid == p->pid) {
+            link = &p->list_next;
             continue;
         }
 
-        if (current_as == p->address_space)
-            continue;
-
-        vmm_destroy_address_space(p->address_space);
-        p->address_space = 0;
+        *link = p->list_next;
+        if (p->address_space) {
+            release_user_pages(p);
+            vmm_destroy_address_space(p->address_space);
+            p->address_space = 0;
+        }
         p->reap_pending = 0;
         p->main_tid = -1;
+
+        // a ring WAIT already has the exit code; nobody else gets it
+        if (p->collected)
+            free_process(p);
+        else
+            zombie_add(p);
     }
 }
 
+void process_reap_deferred(void)
+{
+    // unlocked peek: the list is empty nearly always
+    if (!reap_head) return;
+
+    uint64_t flags = process_lock();
+    reap_deferred();
+    process_unlock(flags);
+}
+
 void process_dump_table(void)
 {
-    print("proc: pid tid state exit\n");
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        Process* p = &proc_table[i];
-        if (!p->used) continue;
+    uint64_t flags = process_lock();
+    print("proc: pid tid state exit rss faults\n");
+    for (int pid = idmap_next(&pid_map, 1); pid >= 0; pid = idmap_next(&pid_map, pid + 1)) {
+        Process* p = find_process_by_pid(pid);
 
         print("proc: ");
         print_dec((uint64_t)p->pid);
@@ -293,32 +822,35 @@ void process_dump_table(void)
         else print("RUNNING");
         print(" ");
         print_dec((uint64_t)p->exit_code);
+        print(" ");
+        print_dec(p->resident_pages);
+        print(" ");
+        print_dec(p->page_faults);
         print("\n");
     }
+    process_unlock(flags);
 }
 
 int process_kill(int pid, int code)
 {
+    uint64_t flags = process_lock();
     Process* p = find_process_by_pid(pid);
-    if (!p || !p->used)
-        return -1;
-
-    if (p->exited)
-        return 1;
-
-    if (task_kill_pid(pid, code) < 0)
-        return -1;
-
-    p->exited = 1;
-    p->exit_code = code;
-    p->reap_pending = 1;
-    return 0;
+    int rc = -1;
+    if (p && p->exited) {
+        rc = 1;
+    } else if (p && task_kill(p->main_tid, code) == 0) {
+        mark_exited(p, code);
+        rc = 0;
+    }
+    process_unlock(flags);
+    return rc;
 }
 
-int process_wait_poll(int pid, int* out_code)
+// A reaped process is gone once its exit code has been collected
+static int wait_poll(int pid, int* out_code)
 {
     Process* p = find_process_by_pid(pid);
-    if (!p || !p->used)
+    if (!p)
         return -1;
 
     if (!p->exited)
@@ -327,32 +859,123 @@ int process_wait_poll(int pid, int* out_code)
     if (out_code)
         *out_code = p->exit_code;
 
-    if (!p->reap_pending && p->address_space == 0) {
-        p->used = 0;
-        p->pid = 0;
-        p->main_tid = -1;
-        p->entry = 0;
-        p->user_rsp = 0;
-        p->exit_code = 0;
-        p->exited = 0;
+    // still waiting for teardown: the reaper frees it instead
+    if (p->reap_pending) {
+        p->collected = 1;
+    } else if (p->address_space == 0) {
+        zombie_remove(p);
+        free_process(p);
     }
 
     return 1;
 }
 
+int process_wait_poll(int pid, int* out_code)
+{
+    uint64_t flags = process_lock();
+    int rc = wait_poll(pid, out_code);
+    process_unlock(flags);
+    return rc;
+}
+
+// Blocking form of process_wait_poll for kernel tasks: sleeps until the
+// exit wakes it, reaping first so the process can be freed straight away.
+// The task is marked waiting before the lock is dropped, so an exit on
+// another CPU in between wakes it rather than being missed. The exit code
+// is collected once, so a second waiter gets -2 instead of sleeping on a
+// process it could never collect.
+int process_wait(int pid, int* out_code)
+{
+    while (1) {
+        uint64_t flags = process_lock();
+        reap_deferred();
+        int rc = wait_poll(pid, out_code);
+        if (rc != 0) {
+            process_unlock(flags);
+            return rc;
+        }
+
+        Process* p = find_process_by_pid(pid);
+        int self = task_current()->tid;
+        if (p->waiter_tid >= 0 && p->waiter_tid != self && task_get(p->waiter_tid)) {
+            process_unlock(flags);
+            return -2;
+        }
+
+        p->waiter_tid = self;
+        task_block();
+        process_unlock(flags);
+        task_yield();
+    }
+}
+
 int process_is_active(int pid)
 {
+    uint64_t flags = process_lock();
     Process* p = find_process_by_pid(pid);
-    if (!p || !p->used)
-        return 0;
-    return !p->exited;
+    int active = p && !p->exited;
+    process_unlock(flags);
+    return active;
+}
+
+int process_set_priority(int pid, uint32_t level)
+{
+    uint64_t flags = process_lock();
+    Process* p = find_process_by_pid(pid);
+    int rc = -1;
+    if (p && !p->exited)
+        rc = task_set_priority(p->main_tid, level);
+    process_unlock(flags);
+    return rc;
 }
 
 uint64_t process_count_active(void)
 {
-    uint64_t n = 0;
-    for (int i = 0; i < MAX_PROCESSES; i++)
-        if (proc_table[i].used && !proc_table[i].exited)
-            n++;
-    return n;
+    return active_count;
+}
+
+void process_get_spawn_stats(ProcessSpawnStats* out)
+{
+    if (!out) return;
+    *out = spawn_stats;
+}
+
+// #PF error code: bit 0 = protection violation, bit 1 = write, bit 4 = fetch
+static int handle_page_fault(uint64_t addr, uint64_t error_code)
+{
+    Process* p = find_process_by_pid(task_current_pid());
+    if (!p || p->exited) return -1;
+
+    if (error_code & 1) {
+        // present page: only a write to a COW frame in a writable VMA is legal
+        Vma* vma = find_vma(p, addr & ~0xFFFULL);
+        if (!(error_code & 2) || !vma || !(vma->flags & VMM_FLAG_WRITE))
+            return -1;
+        if (vmm_cow_fault(p->address_space, addr) < 0)
+            return -1;
+        p->page_faults++;
+        return 0;
+    }
+
+    return fault_in_page(p, addr & ~0xFFFULL,
+                         (error_code & 2) != 0, (error_code & 16) != 0);
+}
+
+int process_handle_page_fault(uint64_t addr, uint64_t error_code)
+{
+    uint64_t flags = process_lock();
+    int rc = handle_page_fault(addr, error_code);
+    process_unlock(flags);
+    return rc;
+}
+
+int process_fault_in(int pid, uint64_t addr, int write)
+{
+    uint64_t flags = process_lock();
+    Process* p = find_process_by_pid(pid);
+    int rc = -1;
+    if (p && !p->exited)
+        rc = fault_in_page(p, addr & ~0xFFFULL, write, 0);
+    process_unlock(flags);
+    return rc;
 }
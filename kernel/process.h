@@ -3,13 +3,37 @@
 
 #include "types.h"
 #include "vmm.h"
+#include "idt.h"
+#include "ioring.h"
 
 #define PROCESS_STACK_VIRT  0x00007FFFFFFFE000ULL
 #define PROCESS_STACK_PAGES 4
-#define MAX_PROCESSES       16
+#define PROCESS_STACK_MAX_PAGES 64
+#define PROCESS_MAX_IMAGE_VMAS 16                         // PT_LOAD segments per ELF
+#define PROCESS_MAX_VMAS    (PROCESS_MAX_IMAGE_VMAS + 3)  // plus stack and both rings
+#define PROCESS_EXIT_FAULT  139
+#define PROCESS_MAX_ZOMBIES 64  // reaped but never waited for; oldest dropped
 
+typedef enum {
+    VMA_ANON = 0,   // zero-filled on first touch
+    VMA_FILE,       // filled from the ELF image, BSS tail zeroed
+} VmaKind;
+
+// A page-aligned user region [start, end). Nothing is mapped until the
+// first access faults; the fault handler fills the page from the backing.
 typedef struct {
-    int           used;
+    uint64_t start;
+    uint64_t end;
+    uint64_t flags;         // VMM_FLAG_* applied to faulted-in pages
+    VmaKind  kind;
+    uint64_t file_start;    // VMA_FILE: file bytes cover [file_start, file_end)
+    uint64_t file_end;
+    uint64_t file_offset;   // ELF offset of file_start
+    int      grows_down;    // stack: start may move down towards limit
+    uint64_t limit;
+} Vma;
+
+typedef struct Process {
     int           pid;
     AddressSpace* address_space;
     int           main_tid;
@@ -18,17 +42,57 @@ typedef struct {
     int           exited;
     int           exit_code;
     int           reap_pending;
+    int           collected;    // exit code already taken; free once reaped
+    int           waiter_tid;   // task blocked in process_wait, or -1
+    const uint8_t* image;       // ELF backing for VMA_FILE regions
+    uint64_t      image_size;
+    Vma           vmas[PROCESS_MAX_VMAS];
+    int           vma_count;
+    uint64_t      resident_pages;
+    uint64_t      page_faults;
+    // submission/completion rings (kernel/ioring.c); ioring is the
+    // kernel's view of the ring page, set by the first SYS_RING_ENTER
+    IoRing*       ioring;
+    uint32_t      io_wait_min;      // completions the blocked task wants; 0 = not blocked
+    IoPending     io_pending[IORING_MAX_PENDING];
+    IoPending*    io_waiters;       // WAIT ops other processes have on this one
+    IoPending*    io_recv;          // its own RECV waiting for a message
+    IoMessage     mbox[PROCESS_MBOX_SLOTS];
+    uint32_t      mbox_head;
+    uint32_t      mbox_tail;
+    // on the reap list while reap_pending, on the zombie list once reaped
+    struct Process* list_next;
+    struct Process* list_prev;
 } Process;
 
+typedef struct {
+    uint64_t count;
+    uint64_t last_cycles;
+    uint64_t min_cycles;
+    uint64_t max_cycles;
+    uint64_t total_cycles;
+    uint64_t image_hits;     // spawns that reused a cached image
+    uint64_t image_misses;
+} ProcessSpawnStats;
+
 void process_init(void);
+uint64_t process_lock(void);
+void process_unlock(uint64_t flags);
 int  process_spawn_from_elf(const void* elf_data, uint64_t size);
 int  process_spawn_builtin(int image_id);
+int  process_fork(const InterruptFrame* frame);
 void process_task_exited(int pid, int code);
 void process_reap_deferred(void);
 void process_dump_table(void);
 int  process_kill(int pid, int code);
 int  process_wait_poll(int pid, int* out_code);
+int  process_wait(int pid, int* out_code);
 int  process_is_active(int pid);
+int  process_set_priority(int pid, uint32_t level);
 uint64_t process_count_active(void);
+void process_get_spawn_stats(ProcessSpawnStats* out);
+int  process_handle_page_fault(uint64_t addr, uint64_t error_code);
+int  process_fault_in(int pid, uint64_t addr, int write);
+Process* process_get(int pid);
 
 #endif
@@ -1,15 +1,36 @@
 #include "task.h"
-#include "../kmalloc.h"
+#include "../kmem_cache.h"
+#include "../tss.h"
+#include "../gdt.h"
 #include "../display.h"
 #include "../panic.h"
 #include "../klog.h"
 #include "../paging.h"
+#include "../pmm.h"
+#include "../cpu.h"
+#include "../percpu.h"
+#include "../smp.h"
+#include "../idmap.h"
+#include "../string.h"
+#include "../timer.h"
+#include "../apic.h"
 extern void process_reap_deferred(void);
 
-static Task tasks[MAX_TASKS];
-static int current_tid = -1;
-static uint32_t slice_ticks = 0;
-static uint64_t switch_count = 0;
+// most tasks one steal moves between queues
+#define RQ_STEAL_MAX 32
+
+static IdMap task_ids;
+// held across a lookup by tid, so the task cannot be freed under it
+static Spinlock task_ids_lock = SPINLOCK_INIT;
+static KmemCache* task_cache = 0;
+static KmemCache* stack_cache = 0;
+static RunQueue runqueues[SMP_MAX_CPUS];
+
+// bumped every SCHED_BOOST_TICKS; a task that has not seen the latest
+// boost goes back to its base level the next time it is looked at. Any
+// CPU taking a tick may run the boost, so it goes by time, not count.
+static uint32_t boost_epoch = 0;
+static uint64_t boost_last_ns = 0;
 
 static const char* state_name(TaskState s)
 {
@@ -40,43 +61,375 @@ static void log_transition(const char* tag, Task* t, TaskState from, TaskState t
     print("]\n");
 }
 
-static int find_free_slot(void)
+static void sleep_timeout(void* arg);
+
+static Task* alloc_task(void)
+{
+    Task* t = (Task*)kmem_cache_alloc(task_cache);
+    if (!t) return 0;
+    memset(t, 0, sizeof(*t));
+
+    uint8_t* stack = (uint8_t*)kmem_cache_alloc(stack_cache);
+    int tid = -1;
+    if (stack) {
+        uint64_t flags = spin_lock_irqsave(&task_ids_lock);
+        tid = idmap_alloc(&task_ids, t);
+        spin_unlock_irqrestore(&task_ids_lock, flags);
+    }
+    if (tid < 0) {
+        kmem_cache_free(stack_cache, stack);
+        kmem_cache_free(task_cache, t);
+        return 0;
+    }
+
+    t->tid = tid;
+    // by tid: a timeout that already fired when the task went away must
+    // not touch it
+    ktimer_init(&t->sleep_timer, sleep_timeout, (void*)(uint64_t)tid);
+    t->kernel_stack = stack;
+    t->kernel_stack_top = ((uint64_t)(stack + TASK_STACK_SIZE)) & ~0xFULL;
+    t->cpu = -1;
+    return t;
+}
+
+// The caller makes sure nothing runs on the stack any more
+static void free_task(Task* t)
+{
+    ktimer_cancel(&t->sleep_timer);
+    uint64_t flags = spin_lock_irqsave(&task_ids_lock);
+    idmap_free(&task_ids, t->tid);
+    spin_unlock_irqrestore(&task_ids_lock, flags);
+    kmem_cache_free(stack_cache, t->kernel_stack);
+    kmem_cache_free(task_cache, t);
+}
+
+static void free_task_chain(Task* t)
+{
+    while (t) {
+        Task* next = t->rq_next;
+        free_task(t);
+        t = next;
+    }
+}
+
+static uint32_t sched_slice(uint32_t level)
+{
+    return SCHED_BASE_SLICE << level;
+}
+
+static void refresh_prio(Task* t)
+{
+    if (t->boost_epoch != boost_epoch) {
+        t->boost_epoch = boost_epoch;
+        t->prio = t->base_prio;
+        t->slice_used = 0;
+    }
+}
+
+static void rq_push_locked(RunQueue* rq, Task* t)
 {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_ZOMBIE || tasks[i].state == TASK_NEW) {
-            if (!tasks[i].kernel_stack) return i;
+    uint32_t lvl = t->prio;
+    t->rq_next = 0;
+    t->rq_prev = rq->tail[lvl];
+    if (rq->tail[lvl]) rq->tail[lvl]->rq_next = t;
+    else               rq->head[lvl] = t;
+    rq->tail[lvl] = t;
+    rq->level_mask |= 1u << lvl;
+    rq->count++;
+    t->on_rq = 1;
+    t->cpu = (int)rq->cpu;
+}
+
+static void rq_remove_locked(RunQueue* rq, Task* t)
+{
+    uint32_t lvl = t->prio;
+    if (t->rq_prev) t->rq_prev->rq_next = t->rq_next;
+    else            rq->head[lvl] = t->rq_next;
+    if (t->rq_next) t->rq_next->rq_prev = t->rq_prev;
+    else            rq->tail[lvl] = t->rq_prev;
+    if (!rq->head[lvl])
+        rq->level_mask &= ~(1u << lvl);
+    t->rq_next = 0;
+    t->rq_prev = 0;
+    t->on_rq = 0;
+    rq->count--;
+}
+
+// the calling CPU's queue; a CPU that does not schedule yet hands work
+// to the BSP's
+static RunQueue* local_rq(void)
+{
+    RunQueue* rq = this_cpu()->runqueue;
+    return rq ? rq : &runqueues[0];
+}
+
+// Locks the queue t belongs to. t->cpu only changes under that queue's
+// lock, so it is checked again once the lock is held.
+static RunQueue* task_rq_lock(Task* t, uint64_t* flags)
+{
+    while (1) {
+        RunQueue* rq = &runqueues[t->cpu >= 0 ? t->cpu : 0];
+        *flags = spin_lock_irqsave(&rq->lock);
+        if (t->cpu < 0 || &runqueues[t->cpu] == rq)
+            return rq;
+        spin_unlock_irqrestore(&rq->lock, *flags);
+    }
+}
+
+// the running task counts as load too; idle does not
+static uint32_t rq_load(RunQueue* rq)
+{
+    Task* cur = percpu_get(rq->cpu)->current;
+    return rq->count + (cur && cur != rq->idle ? 1 : 0);
+}
+
+// New tasks start on the scheduling CPU with the least to do. The
+// counts are read unlocked; a stale one only costs balance.
+static RunQueue* placement_rq(void)
+{
+    RunQueue* best = local_rq();
+    uint32_t best_load = rq_load(best);
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        RunQueue* rq = percpu_get(i)->runqueue;
+        if (!rq) continue;
+        uint32_t load = rq_load(rq);
+        if (load < best_load) {
+            best = rq;
+            best_load = load;
         }
     }
+    return best;
+}
+
+// Gets rq's CPU into schedule_on_tick soon; the local CPU passes a
+// kernel exit anyway
+static void rq_kick(RunQueue* rq)
+{
+    if (rq->cpu != this_cpu()->cpu_id)
+        apic_send_ipi(smp_get_cpu(rq->cpu)->lapic_id, TASK_RESCHED_VECTOR);
+}
 
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].kernel_stack == 0 && tasks[i].state == TASK_NEW)
-            return i;
+static void rq_enqueue_locked(RunQueue* rq, Task* t)
+{
+    if (!t->on_rq) {
+        refresh_prio(t);
+        t->enqueued_at = timer_get_ticks();
+        rq_push_locked(rq, t);
+        rq->enqueued++;
     }
+}
+
+static void rq_enqueue(RunQueue* rq, Task* t)
+{
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    rq_enqueue_locked(rq, t);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
 
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_ZOMBIE) {
-            if (tasks[i].kernel_stack) {
-                kfree(tasks[i].kernel_stack);
-                tasks[i].kernel_stack = 0;
+// An idle CPU takes no ticks, so it only gets to steal when something
+// wakes it: hand it the chance when work queues up behind a running task
+static void kick_idle_cpu(RunQueue* busy)
+{
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        RunQueue* rq = percpu_get(i)->runqueue;
+        if (!rq || rq == busy || rq->level_mask) continue;
+        if (percpu_get(i)->current != rq->idle) continue;
+        rq->need_resched = 1;
+        rq_kick(rq);
+        return;
+    }
+}
+
+// Asks rq's CPU to switch at its next kernel exit when a queued task
+// would beat the one running there. Only a hint: the switch re-decides.
+static void rq_check_preempt(RunQueue* rq)
+{
+    uint32_t mask = rq->level_mask;
+    if (!mask) return;
+
+    // nothing current: the CPU has not started scheduling, and switching
+    // out of boot code from an interrupt would strand it
+    Task* cur = percpu_get(rq->cpu)->current;
+    if (!cur) return;
+    if (cur == rq->idle || cur->state != TASK_RUNNING ||
+        (uint32_t)__builtin_ctz(mask) < cur->prio) {
+        rq->need_resched = 1;
+        rq_kick(rq);
+    } else {
+        kick_idle_cpu(rq);
+    }
+}
+
+static void rq_wake(RunQueue* rq, Task* t)
+{
+    rq_enqueue(rq, t);
+    rq_check_preempt(rq);
+}
+
+// WAITING -> RUNNABLE on the queue the task last ran from. One woken
+// before its CPU got it switched out is queued all the same; that CPU
+// then does not queue it again and may pick it straight back up.
+static void make_runnable(Task* t)
+{
+    uint64_t flags;
+    RunQueue* rq = task_rq_lock(t, &flags);
+    int woke = (t->state == TASK_WAITING);
+    if (woke) {
+        ktimer_cancel(&t->sleep_timer);
+        t->state = TASK_RUNNABLE;
+        rq_enqueue_locked(rq, t);
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (woke)
+        rq_check_preempt(rq);
+}
+
+// The calling task stops being runnable; under its queue lock, so a
+// wake from another CPU lands either before (and the task stays put)
+// or after
+static void set_current_waiting(Task* t)
+{
+    uint64_t flags;
+    RunQueue* rq = task_rq_lock(t, &flags);
+    if (t->state == TASK_RUNNING) {
+        t->state = TASK_WAITING;
+        t->slice_used = 0;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+// A tid reused since the timer fired gets a spurious wake at worst,
+// which every sleeper already tolerates
+static void sleep_timeout(void* arg)
+{
+    task_wake((int)(uint64_t)arg);
+}
+
+static Task* rq_pop_locked(RunQueue* rq)
+{
+    Task* t = 0;
+    if (rq->level_mask) {
+        t = rq->head[__builtin_ctz(rq->level_mask)];
+        rq_remove_locked(rq, t);
+    }
+    return t;
+}
+
+// Moves half of the busiest other queue onto rq, newest and lowest level
+// first so interactive work stays where it woke, and returns the best of
+// them to run. Called with rq locked; the victim's lock is taken too, in
+// CPU order so two CPUs stealing from each other cannot deadlock, and
+// tasks only move while both are held. A task its CPU has not left yet
+// (on_cpu) or one already killed stays where it is.
+static Task* rq_steal_locked(RunQueue* rq)
+{
+    rq->steal_attempts++;
+
+    RunQueue* victim = 0;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        RunQueue* other = percpu_get(i)->runqueue;
+        if (!other || other == rq) continue;
+        if (!victim || other->count > victim->count)
+            victim = other;
+    }
+    if (!victim || victim->count == 0)
+        return 0;
+
+    if (victim->cpu < rq->cpu) {
+        spin_unlock(&rq->lock);
+        spin_lock(&victim->lock);
+        spin_lock(&rq->lock);
+    } else {
+        spin_lock(&victim->lock);
+    }
+
+    Task* batch[RQ_STEAL_MAX];
+    uint32_t n = 0;
+    uint32_t take = (victim->count + 1) / 2;
+    if (take > RQ_STEAL_MAX) take = RQ_STEAL_MAX;
+    for (int lvl = SCHED_LEVELS - 1; lvl >= 0 && n < take; lvl--) {
+        Task* t = victim->tail[lvl];
+        while (t && n < take) {
+            Task* prev = t->rq_prev;
+            if (!t->on_cpu && t->state == TASK_RUNNABLE) {
+                rq_remove_locked(victim, t);
+                batch[n++] = t;
             }
-            return i;
+            t = prev;
         }
     }
+    victim->lost += n;
+
+    // batch holds them worst first: run the last one, queue the rest in
+    // their original order
+    Task* next = 0;
+    if (n) {
+        for (uint32_t i = n - 1; i > 0; i--)
+            rq_push_locked(rq, batch[i - 1]);
+        next = batch[n - 1];
+        next->cpu = (int)rq->cpu;
+        rq->steals++;
+        rq->stolen += n;
+    }
+    spin_unlock(&victim->lock);
+    return next;
+}
 
-    return -1;
+// Starvation guard: requeue everything at its base level, keeping the
+// order within each level
+static void rq_boost(RunQueue* rq)
+{
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    Task* chain = 0;
+    Task** link = &chain;
+    for (uint32_t lvl = 0; lvl < SCHED_LEVELS; lvl++) {
+        if (rq->head[lvl]) {
+            *link = rq->head[lvl];
+            link = &rq->tail[lvl]->rq_next;
+        }
+        rq->head[lvl] = 0;
+        rq->tail[lvl] = 0;
+    }
+    rq->level_mask = 0;
+    rq->count = 0;
+
+    while (chain) {
+        Task* t = chain;
+        chain = t->rq_next;
+        refresh_prio(t);
+        rq_push_locked(rq, t);
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
-static int pick_next_runnable(void)
+// Runs on whichever CPU's timer went off, so a tick for another CPU is
+// passed on with an IPI
+static void sched_tick_fire(void* arg)
 {
-    int start = (current_tid < 0) ? 0 : ((current_tid + 1) % MAX_TASKS);
+    RunQueue* rq = (RunQueue*)arg;
+
+    // raced the switch to idle; the next real task re-arms it
+    if (percpu_get(rq->cpu)->current == rq->idle)
+        return;
+    rq->tick_due = 1;
+
+    // periodic without drift, unless we fell a whole tick behind
+    uint64_t now = timer_now_ns();
+    uint64_t next = rq->tick.deadline_ns + timer_tick_ns();
+    if (next <= now)
+        next = now + timer_tick_ns();
+    ktimer_arm(&rq->tick, next);
+    rq_kick(rq);
+}
 
-    for (int i = 0; i < MAX_TASKS; i++) {
-        int idx = (start + i) % MAX_TASKS;
-        if (tasks[idx].state == TASK_RUNNABLE || tasks[idx].state == TASK_RUNNING)
-            return idx;
+static void sched_tick_update(RunQueue* rq, Task* next)
+{
+    if (next == rq->idle) {
+        ktimer_cancel(&rq->tick);
+        rq->tick_due = 0;
+    } else if (!ktimer_armed(&rq->tick)) {
+        ktimer_arm(&rq->tick, timer_now_ns() + timer_tick_ns());
     }
-
-    return -1;
 }
 
 static void task_switch_address_space(Task* t)
@@ -85,10 +438,10 @@ static void task_switch_address_space(Task* t)
     if (t->is_user) {
         kassert(t->address_space != 0, "user task has null address space");
         kassert(t->cr3 != 0, "user task has null CR3");
-        __asm__ volatile ("mov %0, %%cr3" :: "r"(t->cr3) : "memory");
+        vmm_switch(t->address_space);
     } else {
         kassert(kernel_address_space.pml4 != 0, "kernel address space missing");
-        __asm__ volatile ("mov %0, %%cr3" :: "r"(kernel_address_space.pml4) : "memory");
+        vmm_switch(&kernel_address_space);
     }
 }
 
@@ -118,80 +471,135 @@ static uint64_t setup_initial_frame(Task* t, uint64_t rip, uint64_t rsp,
 
 static uint64_t context_switch_from(uint64_t current_rsp)
 {
+    uint64_t t_start = rdtsc();
+    PerCPU* cpu = this_cpu();
+    RunQueue* rq = cpu->runqueue;
+    kassert(rq != 0, "context switch on a CPU without a run queue");
+    rq->need_resched = 0;
+
     process_reap_deferred();
 
-    if (current_tid >= 0) {
-        Task* current = &tasks[current_tid];
+    // we are on a different stack than the one that died here last time
+    if (rq->dead && rq->dead != cpu->current) {
+        free_task(rq->dead);
+        rq->dead = 0;
+    }
+
+    Task* current = cpu->current;
+    Task* killed = 0;       // popped zombies, freed once the lock is dropped
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    if (current) {
         current->kernel_rsp = current_rsp;
         current->trapframe = (InterruptFrame*)current_rsp;
         if (current->state == TASK_RUNNING)
             current->state = TASK_RUNNABLE;
+        if (current->state == TASK_RUNNABLE && current != rq->idle)
+            rq_enqueue_locked(rq, current);
+        // woken, then killed before it got here
+        if (current->state == TASK_ZOMBIE && current->on_rq)
+            rq_remove_locked(rq, current);
     }
 
-    int next_tid = pick_next_runnable();
-    if (next_tid < 0) {
-        if (current_tid >= 0) {
-            tasks[current_tid].state = TASK_RUNNING;
-            return 0;
-        }
-        return 0;
+    // nothing runs on a queued task's stack: the only one that did was
+    // switched out by this CPU, which has left it since
+    Task* next;
+    while ((next = rq_pop_locked(rq)) && next->state == TASK_ZOMBIE) {
+        next->rq_next = killed;
+        killed = next;
     }
-
-    if (next_tid == current_tid) {
-        tasks[next_tid].state = TASK_RUNNING;
+    if (!next)
+        next = rq_steal_locked(rq);
+    if (!next)
+        next = rq->idle;
+
+    if (!next || next == current) {
+        if (current && current->state == TASK_RUNNABLE)
+            current->state = TASK_RUNNING;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        if (next)
+            sched_tick_update(rq, next);
+        free_task_chain(killed);
         return 0;
     }
 
-    current_tid = next_tid;
-    Task* next = &tasks[next_tid];
+    // still on its stack until the switch stub leaves it; free it next time
+    if (current && current->state == TASK_ZOMBIE)
+        rq->dead = current;
+
+    cpu->current = next;
     next->state = TASK_RUNNING;
+    next->on_cpu = 1;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    free_task_chain(killed);
+
+    sched_tick_update(rq, next);
     next->timeslice++;
+    if (next != rq->idle)
+        next->wait_ticks += timer_get_ticks() - next->enqueued_at;
 
+    uint64_t t_cr3 = rdtsc();
     task_switch_address_space(next);
-    switch_count++;
+    cpu->cr3_cycles += rdtsc() - t_cr3;
+    // interrupts from ring 3 must land on the incoming task's own stack,
+    // otherwise two user tasks would save their frames on top of each other
+    tss_set_rsp0(next->kernel_stack_top);
+    cpu->kernel_rsp = next->kernel_stack_top;
+    // the switch stub clears current's on_cpu once off its stack
+    cpu->switched_out = current ? &current->on_cpu : 0;
+    cpu->switch_count++;
+    cpu->switch_cycles += rdtsc() - t_start;
 
     return next->kernel_rsp;
 }
 
 void task_init(void)
 {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].tid = i;
-        tasks[i].pid = 0;
-        tasks[i].state = TASK_NEW;
-        tasks[i].kernel_rsp = 0;
-        tasks[i].kernel_stack_top = 0;
-        tasks[i].cr3 = 0;
-        tasks[i].timeslice = 0;
-        tasks[i].exit_code = 0;
-        tasks[i].is_user = 0;
-        tasks[i].trapframe = 0;
-        tasks[i].address_space = 0;
-        tasks[i].kernel_stack = 0;
-    }
-
-    current_tid = -1;
-    slice_ticks = 0;
-    switch_count = 0;
-
+    idmap_init(&task_ids, 0);
+    if (!task_cache)
+        task_cache = kmem_cache_create("task", sizeof(Task), 0);
+    // stacks are recycled as-is; nothing relies on them being zeroed
+    if (!stack_cache)
+        stack_cache = kmem_cache_create("task_stack", TASK_STACK_SIZE, 0);
+
+    task_cpu_init();
     klog_info("task: initialized unified scheduler");
 }
 
-int task_create_kernel(void (*entry)(void))
+// Gives the calling CPU a run queue, which makes it a scheduling CPU:
+// new and woken tasks may land on it and other CPUs may steal from it
+void task_cpu_init(void)
 {
-    int slot = find_free_slot();
-    if (slot < 0) return -1;
+    PerCPU* cpu = this_cpu();
+    RunQueue* rq = &runqueues[cpu->cpu_id];
 
-    uint8_t* stack = (uint8_t*)kmalloc(TASK_STACK_SIZE);
-    if (!stack) return -1;
+    rq->lock.locked = 0;
+    for (uint32_t lvl = 0; lvl < SCHED_LEVELS; lvl++) {
+        rq->head[lvl] = 0;
+        rq->tail[lvl] = 0;
+    }
+    rq->level_mask = 0;
+    rq->count = 0;
+    rq->cpu = cpu->cpu_id;
+    rq->idle = 0;
+    rq->dead = 0;
+    ktimer_init(&rq->tick, sched_tick_fire, rq);
+    rq->tick_due = 0;
+    rq->need_resched = 0;
+    rq->enqueued = 0;
+    rq->steal_attempts = 0;
+    rq->steals = 0;
+    rq->stolen = 0;
+    rq->lost = 0;
+    cpu->runqueue = rq;
+}
 
-    for (int i = 0; i < TASK_STACK_SIZE; i++) stack[i] = 0;
+static Task* create_kernel_task(void (*entry)(void))
+{
+    Task* t = alloc_task();
+    if (!t) return 0;
 
-    Task* t = &tasks[slot];
     t->pid = 0;
-    t->kernel_stack = stack;
-    t->kernel_stack_top = ((uint64_t)(stack + TASK_STACK_SIZE)) & ~0xFULL;
-    t->cr3 = (uint64_t)kernel_address_space.pml4;
+    t->cr3 = virt_to_phys(kernel_address_space.pml4);
     t->is_user = 0;
     t->address_space = &kernel_address_space;
     t->exit_code = 0;
@@ -199,45 +607,121 @@ int task_create_kernel(void (*entry)(void))
 
     t->kernel_rsp = setup_initial_frame(t, (uint64_t)entry,
                                         t->kernel_stack_top,
-                                        0x08, 0x10);
+                                        GDT_KERNEL_CODE, GDT_KERNEL_DATA);
 
     TaskState from = t->state;
     t->state = TASK_RUNNABLE;
     log_transition("create-k", t, from, t->state);
+    return t;
+}
+
+int task_create_kernel(void (*entry)(void))
+{
+    Task* t = create_kernel_task(entry);
+    if (!t) return -1;
+    rq_wake(placement_rq(), t);
     return t->tid;
 }
 
-int task_create_user(int pid, AddressSpace* as, uint64_t entry, uint64_t user_rsp)
+// The calling CPU's idle task: never queued, run only when the queue is
+// empty and there was nothing to steal
+int task_create_idle(void (*entry)(void))
 {
-    int slot = find_free_slot();
-    if (slot < 0) return -1;
+    Task* t = create_kernel_task(entry);
+    if (!t) return -1;
+    t->prio = SCHED_LEVELS - 1;
+    t->base_prio = SCHED_LEVELS - 1;
+    t->cpu = (int)local_rq()->cpu;
+    local_rq()->idle = t;
+    return t->tid;
+}
 
-    uint8_t* stack = (uint8_t*)kmalloc(TASK_STACK_SIZE);
-    if (!stack) return -1;
-    for (int i = 0; i < TASK_STACK_SIZE; i++) stack[i] = 0;
+static Task* create_user_task(int pid, AddressSpace* as, uint64_t entry, uint64_t user_rsp)
+{
+    Task* t = alloc_task();
+    if (!t) return 0;
 
-    Task* t = &tasks[slot];
     t->pid = pid;
-    t->kernel_stack = stack;
-    t->kernel_stack_top = ((uint64_t)(stack + TASK_STACK_SIZE)) & ~0xFULL;
-    t->cr3 = (uint64_t)as->pml4;
+    t->cr3 = virt_to_phys(as->pml4);
     t->is_user = 1;
     t->address_space = as;
     t->exit_code = 0;
     t->timeslice = 0;
 
-    t->kernel_rsp = setup_initial_frame(t, entry, user_rsp, 0x1B, 0x23);
+    t->kernel_rsp = setup_initial_frame(t, entry, user_rsp,
+                                        GDT_USER_CODE | 3, GDT_USER_DATA | 3);
 
     TaskState from = t->state;
     t->state = TASK_RUNNABLE;
     log_transition("create-u", t, from, t->state);
+    return t;
+}
+
+int task_create_user(int pid, AddressSpace* as, uint64_t entry, uint64_t user_rsp)
+{
+    Task* t = create_user_task(pid, as, entry, user_rsp);
+    if (!t) return -1;
+    rq_wake(placement_rq(), t);
+    return t->tid;
+}
+
+// The child resumes from the parent's trap frame with a zero return value
+int task_fork_user(int pid, AddressSpace* as, const InterruptFrame* parent)
+{
+    if (!parent) return -1;
+
+    Task* t = create_user_task(pid, as, parent->rip, parent->rsp);
+    if (!t) return -1;
+
+    // queue it only once the frame is complete
+    InterruptFrame* f = t->trapframe;
+    *f = *parent;
+    f->rax = 0;
+    rq_wake(placement_rq(), t);
     return t->tid;
 }
 
 Task* task_current(void)
 {
-    if (current_tid < 0) return 0;
-    return &tasks[current_tid];
+    return this_cpu()->current;
+}
+
+Task* task_get(int tid)
+{
+    return (Task*)idmap_get(&task_ids, tid);
+}
+
+// Sets the task's base level and moves it there now
+int task_set_priority(int tid, uint32_t level)
+{
+    if (level >= SCHED_LEVELS) return -1;
+    uint64_t ids = spin_lock_irqsave(&task_ids_lock);
+    Task* t = task_get(tid);
+    if (!t) {
+        spin_unlock_irqrestore(&task_ids_lock, ids);
+        return -1;
+    }
+
+    uint64_t flags;
+    RunQueue* rq = task_rq_lock(t, &flags);
+    int queued = t->on_rq;
+    if (queued)
+        rq_remove_locked(rq, t);
+    t->base_prio = level;
+    t->prio = level;
+    t->slice_used = 0;
+    t->boost_epoch = boost_epoch;
+    if (queued)
+        rq_push_locked(rq, t);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    spin_unlock_irqrestore(&task_ids_lock, ids);
+    rq_check_preempt(rq);
+    return 0;
+}
+
+uint32_t task_count(void)
+{
+    return task_ids.count;
 }
 
 int task_current_pid(void)
@@ -252,46 +736,167 @@ void task_sleep(void)
     kassert(t != 0, "task_sleep called without current task");
     kassert(!t->is_user, "task_sleep called from user task");
 
-    t->state = TASK_WAITING;
+    // blocking is what interactive tasks do; the level is kept and the
+    // slice starts over when it wakes. A wake between here and the switch
+    // requeues us, and the switch then finds us runnable.
+    uint64_t flags = irq_save();
+    set_current_waiting(t);
 
-    __asm__ volatile ("int $0x20");
+    __asm__ volatile ("int $0x81");
+    irq_restore(flags);
 }
 
-void task_wake(int tid)
+// Marks the current task WAITING until deadline_ns (timer_now_ns clock)
+// or an earlier task_wake, without switching: syscalls return into the
+// scheduler instead. Returns -1 when no timer slot is free.
+int task_block_until(uint64_t deadline_ns)
 {
-    if (tid < 0 || tid >= MAX_TASKS) return;
-    Task* t = &tasks[tid];
-    if (t->state == TASK_WAITING) {
-        t->state = TASK_RUNNABLE;
+    Task* t = task_current();
+    kassert(t != 0, "task_block_until called without current task");
+
+    // armed under the queue lock, so a timeout on another CPU cannot
+    // run before the task is WAITING and be lost
+    uint64_t flags;
+    RunQueue* rq = task_rq_lock(t, &flags);
+    int rc = ktimer_arm(&t->sleep_timer, deadline_ns);
+    if (rc == 0 && t->state == TASK_RUNNING) {
+        t->state = TASK_WAITING;
+        t->slice_used = 0;
     }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (rc < 0)
+        return -1;
+    task_set_need_resched();
+    return 0;
+}
+
+// task_block_until without a deadline: only task_wake ends it
+void task_block(void)
+{
+    Task* t = task_current();
+    kassert(t != 0, "task_block called without current task");
+
+    set_current_waiting(t);
+    task_set_need_resched();
+}
+
+void task_sleep_until(uint64_t deadline_ns)
+{
+    Task* t = task_current();
+    kassert(t != 0, "task_sleep_until called without current task");
+    kassert(!t->is_user, "task_sleep_until called from user task");
+
+    if (deadline_ns <= timer_now_ns())
+        return;
+
+    uint64_t flags = irq_save();
+    if (task_block_until(deadline_ns) == 0)
+        __asm__ volatile ("int $0x81");
+    irq_restore(flags);
 }
 
+// An early wake disarms the task's sleep timer, so it cannot fire into a
+// later, unrelated wait
+void task_wake(int tid)
+{
+    uint64_t flags = spin_lock_irqsave(&task_ids_lock);
+    Task* t = task_get(tid);
+    if (t)
+        make_runnable(t);
+    spin_unlock_irqrestore(&task_ids_lock, flags);
+}
+
+// Keeps the slice used so far, so yielding just before it runs out does
+// not dodge the drop to the next level
 void task_yield(void)
 {
-    __asm__ volatile ("int $0x20");
+    __asm__ volatile ("int $0x81");
+}
+
+// Makes the calling task a zombie without switching; for syscalls and
+// faults, which return into the scheduler anyway
+void task_mark_exit(int code)
+{
+    Task* t = task_current();
+    kassert(t != 0, "task_mark_exit called without current task");
+
+    uint64_t flags;
+    RunQueue* rq = task_rq_lock(t, &flags);
+    if (t->state != TASK_ZOMBIE) {
+        t->exit_code = code;
+        t->state = TASK_ZOMBIE;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    task_set_need_resched();
 }
 
 void task_exit(int code)
 {
     Task* t = task_current();
     kassert(t != 0, "task_exit called without current task");
-    t->exit_code = code;
     TaskState from = t->state;
-    t->state = TASK_ZOMBIE;
-    log_transition("exit", t, from, t->state);
-    __asm__ volatile ("int $0x20");
+    task_mark_exit(code);
+    log_transition("exit", t, from, TASK_ZOMBIE);
+    __asm__ volatile ("int $0x81");
     while (1) __asm__ volatile ("hlt");
 }
 
-uint64_t schedule_on_tick(uint64_t current_rsp)
+static void sched_boost(void)
 {
-    if (current_tid >= 0 && tasks[current_tid].state == TASK_RUNNING) {
-        slice_ticks++;
-        if (slice_ticks < TICKS_PER_SLICE)
-            return 0;
+    __atomic_add_fetch(&boost_epoch, 1, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        RunQueue* rq = percpu_get(i)->runqueue;
+        if (rq) rq_boost(rq);
     }
+}
 
-    slice_ticks = 0;
+// A due scheduler tick is charged to the running task, which keeps the
+// CPU until its slice is used up or something on a better level waits
+static void sched_charge_tick(PerCPU* cpu, RunQueue* rq)
+{
+    // the CPU that moves boost_last_ns on does the boost
+    uint64_t now = timer_now_ns();
+    uint64_t last = __atomic_load_n(&boost_last_ns, __ATOMIC_RELAXED);
+    if (now - last >= SCHED_BOOST_TICKS * timer_tick_ns() &&
+        __atomic_compare_exchange_n(&boost_last_ns, &last, now, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        sched_boost();
+
+    // the tick is off while idle, so one landing now is stale
+    Task* t = cpu->current;
+    if (t == rq->idle)
+        return;
+
+    if (t && t->state == TASK_RUNNING) {
+        t->runtime_ticks++;
+        refresh_prio(t);
+        if (++t->slice_used >= sched_slice(t->prio)) {
+            if (t->prio < SCHED_LEVELS - 1)
+                t->prio++;
+            t->slice_used = 0;
+            rq->need_resched = 1;
+        } else if (rq->level_mask & ((1u << t->prio) - 1)) {
+            rq->need_resched = 1;
+        }
+    } else {
+        rq->need_resched = 1;
+    }
+}
+
+// Runs after every timer interrupt
+uint64_t schedule_on_tick(uint64_t current_rsp)
+{
+    PerCPU* cpu = this_cpu();
+    RunQueue* rq = cpu->runqueue;
+    if (!rq)
+        return 0;
+
+    if (rq->tick_due) {
+        rq->tick_due = 0;
+        sched_charge_tick(cpu, rq);
+    }
+    if (!rq->need_resched)
+        return 0;
     return context_switch_from(current_rsp);
 }
 
@@ -301,29 +906,54 @@ uint64_t task_schedule_from_interrupt(InterruptFrame* frame)
     return context_switch_from((uint64_t)frame);
 }
 
+void task_set_need_resched(void)
+{
+    local_rq()->need_resched = 1;
+}
+
+// For the way out of a syscall or interrupt: switch only if something
+// asked for it since the last switch
+uint64_t task_resched_point(InterruptFrame* frame)
+{
+    RunQueue* rq = this_cpu()->runqueue;
+    if (!rq || !rq->need_resched)
+        return 0;
+    return task_schedule_from_interrupt(frame);
+}
+
+// First switch on a CPU: leaves the boot stack for good through the same
+// stub the interrupt paths use
 void schedule(void)
 {
     uint64_t next_rsp = context_switch_from(0);
     if (!next_rsp) return;
 
     __asm__ volatile (
-        "movq %0, %%rsp\n"
-        "popq %%r15\n" "popq %%r14\n" "popq %%r13\n" "popq %%r12\n"
-        "popq %%r11\n" "popq %%r10\n" "popq %%r9\n"  "popq %%r8\n"
-        "popq %%rbp\n" "popq %%rdi\n" "popq %%rsi\n" "popq %%rdx\n"
-        "popq %%rcx\n" "popq %%rbx\n" "popq %%rax\n"
-        "addq $16, %%rsp\n"
-        "iretq\n"
+        "movq %0, %%rax\n"
+        "jmp isr_switch\n"
         :
         : "r"(next_rsp)
-        : "memory"
+        : "rax", "memory"
     );
 }
 
+// No tick runs while idle, so whatever wakes a task (an interrupt that
+// ends the hlt) also has to get it scheduled: check the queue with
+// interrupts off and only then sti; hlt, which cannot miss a wakeup.
 void idle_task(void)
 {
-    while (1)
-        __asm__ volatile ("hlt");
+    while (1) {
+        // spare cycles go to pre-zeroing pages for the spawn path
+        pmm_refill_zero_pool();
+
+        __asm__ volatile ("cli");
+        if (local_rq()->level_mask) {
+            __asm__ volatile ("sti");
+            task_yield();
+        } else {
+            __asm__ volatile ("sti; hlt");
+        }
+    }
 }
 
 void task_print_stats(void)
@@ -334,8 +964,8 @@ void task_print_stats(void)
     uint64_t state_waiting = 0;
     uint64_t state_zombie = 0;
 
-    for (int i = 0; i < MAX_TASKS; i++) {
-        switch (tasks[i].state) {
+    for (int id = idmap_next(&task_ids, 0); id >= 0; id = idmap_next(&task_ids, id + 1)) {
+        switch (task_get(id)->state) {
             case TASK_NEW:      state_new++; break;
             case TASK_RUNNABLE: state_runnable++; break;
             case TASK_RUNNING:  state_running++; break;
@@ -345,14 +975,64 @@ void task_print_stats(void)
         }
     }
 
-    print("sched: current_tid=");
-    if (current_tid < 0) print("none");
-    else print_dec((uint64_t)current_tid);
-    print(" switches=");
-    print_dec(switch_count);
+    uint64_t switch_count = 0;
+    uint64_t switch_cycles = 0;
+    uint64_t cr3_cycles = 0;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        PerCPU* cpu = percpu_get(i);
+        print("sched: cpu");
+        print_dec(i);
+        print(" current_tid=");
+        if (!cpu->current) print("none");
+        else print_dec((uint64_t)cpu->current->tid);
+        print(" switches=");
+        print_dec(cpu->switch_count);
+        switch_count += cpu->switch_count;
+        switch_cycles += cpu->switch_cycles;
+        cr3_cycles += cpu->cr3_cycles;
+
+        RunQueue* rq = cpu->runqueue;
+        if (!rq) {
+            print(" parked\n");
+            continue;
+        }
+        print(" rq=");
+        print_dec(rq->count);
+        print(" levels=");
+        for (uint32_t lvl = 0; lvl < SCHED_LEVELS; lvl++)
+            print((rq->level_mask & (1u << lvl)) ? "x" : "-");
+        print(" enq=");
+        print_dec(rq->enqueued);
+        print(" steals=");
+        print_dec(rq->steals);
+        print("/");
+        print_dec(rq->steal_attempts);
+        print(" in=");
+        print_dec(rq->stolen);
+        print(" out=");
+        print_dec(rq->lost);
+        print("\n");
+    }
+
+    VmmTlbStats tlb;
+    vmm_get_tlb_stats(&tlb);
+    print("sched: switch avg=");
+    print_dec(switch_count ? switch_cycles / switch_count : 0);
+    print(" cr3 avg=");
+    print_dec(switch_count ? cr3_cycles / switch_count : 0);
+    print(" cycles pcid=");
+    print(tlb.pcid_enabled ? "on" : "off");
+    print(" gen=");
+    print_dec(tlb.generation);
+    print(" noflush=");
+    print_dec(tlb.noflush_loads);
+    print(" flush=");
+    print_dec(tlb.flush_loads);
     print("\n");
 
-    print("sched: NEW=");
+    print("sched: tasks=");
+    print_dec(task_ids.count);
+    print(" NEW=");
     print_dec(state_new);
     print(" RUNNABLE=");
     print_dec(state_runnable);
@@ -364,8 +1044,8 @@ void task_print_stats(void)
     print_dec(state_zombie);
     print("\n");
 
-    for (int i = 0; i < MAX_TASKS; i++) {
-        Task* t = &tasks[i];
+    for (int id = idmap_next(&task_ids, 0); id >= 0; id = idmap_next(&task_ids, id + 1)) {
+        Task* t = task_get(id);
         if (t->state == TASK_NEW) continue;
 
         print("sched: tid=");
@@ -376,42 +1056,65 @@ void task_print_stats(void)
         print(state_name(t->state));
         print(" user=");
         print_dec((uint64_t)t->is_user);
+        print(" prio=");
+        print_dec(t->prio);
+        print("/");
+        print_dec(t->base_prio);
         print(" slices=");
         print_dec((uint64_t)t->timeslice);
+        print(" run=");
+        print_dec(t->runtime_ticks);
+        print(" wait=");
+        print_dec(t->wait_ticks);
         print("\n");
     }
 }
 
-int task_kill_pid(int pid, int code)
+// A task running on some CPU finishes in its next switch there; any
+// other is left on (or put back on) its queue, and the CPU that pops it
+// frees it, as only that CPU knows it has left the task's stack
+int task_kill(int tid, int code)
 {
-    if (pid <= 0) return -1;
-
-    for (int i = 0; i < MAX_TASKS; i++) {
-        Task* t = &tasks[i];
-        if (t->pid != pid) continue;
-        if (t->state == TASK_NEW || t->state == TASK_ZOMBIE) continue;
+    uint64_t ids = spin_lock_irqsave(&task_ids_lock);
+    Task* t = task_get(tid);
+    if (t && t == task_current()) {
+        spin_unlock_irqrestore(&task_ids_lock, ids);
+        task_exit(code);
+        return 0;
+    }
 
-        if (i == current_tid) {
-            task_exit(code);
-            return 0;
+    TaskState from = TASK_NEW;
+    RunQueue* rq = 0;
+    if (t) {
+        uint64_t flags;
+        rq = task_rq_lock(t, &flags);
+        from = t->state;
+        if (from != TASK_NEW && from != TASK_ZOMBIE) {
+            t->exit_code = code;
+            t->state = TASK_ZOMBIE;
+            if (from != TASK_RUNNING && !t->on_rq)
+                rq_push_locked(rq, t);
+            rq->need_resched = 1;
         }
-
-        t->exit_code = code;
-        TaskState from = t->state;
-        t->state = TASK_ZOMBIE;
-        log_transition("kill", t, from, t->state);
-        return 0;
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+    if (!t || from == TASK_NEW || from == TASK_ZOMBIE) {
+        spin_unlock_irqrestore(&task_ids_lock, ids);
+        return -1;
     }
 
-    return -1;
+    log_transition("kill", t, from, TASK_ZOMBIE);
+    spin_unlock_irqrestore(&task_ids_lock, ids);
+    rq_kick(rq);
+    return 0;
 }
 
 int task_self_check(void)
 {
     int running_count = 0;
 
-    for (int i = 0; i < MAX_TASKS; i++) {
-        Task* t = &tasks[i];
+    for (int id = idmap_next(&task_ids, 0); id >= 0; id = idmap_next(&task_ids, id + 1)) {
+        Task* t = task_get(id);
         if (t->state == TASK_RUNNING)
             running_count++;
 
@@ -421,13 +1124,14 @@ int task_self_check(void)
         }
     }
 
-    if (running_count > 1)
+    if (running_count > (int)smp_cpu_count())
         return 0;
 
-    if (current_tid >= 0) {
-        if (current_tid >= MAX_TASKS)
+    Task* current = this_cpu()->current;
+    if (current) {
+        if (task_get(current->tid) != current)
             return 0;
-        if (tasks[current_tid].state != TASK_RUNNING)
+        if (current->state != TASK_RUNNING)
             return 0;
     }
 
@@ -436,5 +1140,8 @@ int task_self_check(void)
 
 uint64_t task_get_switch_count(void)
 {
-    return switch_count;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < smp_cpu_count(); i++)
+        total += percpu_get(i)->switch_count;
+    return total;
 }
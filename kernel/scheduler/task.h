@@ -4,10 +4,19 @@
 #include "../types.h"
 #include "../vmm.h"
 #include "../idt.h"
+#include "../spinlock.h"
+#include "../ktimer.h"
 
-#define MAX_TASKS          16
 #define TASK_STACK_SIZE    16384
-#define TICKS_PER_SLICE    5
+#define TASK_YIELD_VECTOR  0x81   // kernel-only gate into the scheduler
+#define TASK_RESCHED_VECTOR 0x31  // IPI: another CPU queued work or a tick here
+
+// Multilevel feedback queue: level 0 runs first. A task that uses up its
+// level's slice drops a level, and each level down gets twice the slice.
+// Every SCHED_BOOST_TICKS every task returns to its base level.
+#define SCHED_LEVELS       4
+#define SCHED_BASE_SLICE   2      // ticks at level 0
+#define SCHED_BOOST_TICKS  100
 
 typedef enum {
     TASK_NEW = 0,
@@ -17,7 +26,7 @@ typedef enum {
     TASK_ZOMBIE,
 } TaskState;
 
-typedef struct {
+typedef struct Task {
     int            tid;
     int            pid;
     TaskState      state;
@@ -30,25 +39,83 @@ typedef struct {
     InterruptFrame* trapframe;
     AddressSpace*  address_space;
     uint8_t*       kernel_stack;
+    // run-queue links; cpu is the queue the task last sat on (-1: none)
+    // and only changes under that queue's lock
+    struct Task*   rq_next;
+    struct Task*   rq_prev;
+    int            cpu;
+    int            on_rq;
+    // set when a CPU picks the task, cleared once that CPU has left its
+    // stack; no other CPU may take it over in between
+    volatile uint32_t on_cpu;
+    // prio is the current level; base_prio is the best it can get back
+    // to, set with SYS_SETPRIO
+    uint32_t       prio;
+    uint32_t       base_prio;
+    uint32_t       slice_used;      // ticks run at this level so far
+    uint32_t       boost_epoch;
+    uint64_t       runtime_ticks;
+    uint64_t       wait_ticks;      // runnable, sitting on a queue
+    uint64_t       enqueued_at;
+    KTimer         sleep_timer;     // wakes a WAITING task at a deadline
 } Task;
 
+// Per-CPU run queue: one FIFO per level of runnable tasks, with a bit
+// per non-empty level. The CPU's idle task is never on it, and the
+// running task only when woken before its CPU got it switched out.
+// Queued tasks that were killed are freed by whichever CPU pops them.
+typedef struct RunQueue {
+    Spinlock lock;
+    Task*    head[SCHED_LEVELS];
+    Task*    tail[SCHED_LEVELS];
+    uint32_t level_mask;
+    uint32_t count;
+    uint32_t cpu;
+    Task*    idle;
+    Task*    dead;       // exited while running here; freed at the next switch
+    // scheduler tick: armed only while a real task runs, so an idle CPU
+    // takes no periodic interrupts
+    KTimer   tick;
+    volatile int tick_due;
+    // something should run instead of the current task; checked when
+    // the CPU leaves the kernel, cleared by the switch
+    volatile int need_resched;
+    uint64_t enqueued;
+    uint64_t steal_attempts;
+    uint64_t steals;     // steals by this CPU that found work
+    uint64_t stolen;     // tasks this CPU pulled in
+    uint64_t lost;       // tasks other CPUs pulled out
+} RunQueue;
+
 void     task_init(void);
+void     task_cpu_init(void);
 int      task_create_kernel(void (*entry)(void));
+int      task_create_idle(void (*entry)(void));
 int      task_create_user(int pid, AddressSpace* as,
                           uint64_t entry, uint64_t user_rsp);
+int      task_fork_user(int pid, AddressSpace* as, const InterruptFrame* parent);
 void     task_sleep(void);
+void     task_sleep_until(uint64_t deadline_ns);
+int      task_block_until(uint64_t deadline_ns);
+void     task_block(void);
 void     task_wake(int tid);
 void     task_yield(void);
 void     task_exit(int code);
+void     task_mark_exit(int code);
 int      task_current_pid(void);
 Task*    task_current(void);
 void     task_print_stats(void);
-int      task_kill_pid(int pid, int code);
+int      task_kill(int tid, int code);
+Task*    task_get(int tid);
+int      task_set_priority(int tid, uint32_t level);
+uint32_t task_count(void);
 int      task_self_check(void);
 uint64_t task_get_switch_count(void);
 
 uint64_t schedule_on_tick(uint64_t current_rsp);
 uint64_t task_schedule_from_interrupt(InterruptFrame* frame);
+void     task_set_need_resched(void);
+uint64_t task_resched_point(InterruptFrame* frame);
 void     schedule(void);
 
 void shell_task(void);
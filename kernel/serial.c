@@ -49,6 +49,12 @@ void serial_write(const char* str)
         serial_write_char(*str++);
 }
 
+void serial_write_n(const char* s, uint64_t len)
+{
+    for (uint64_t i = 0; i < len; i++)
+        serial_write_char(s[i]);
+}
+
 void serial_write_hex(uint64_t value)
 {
     const char* hex = "0123456789ABCDEF";
@@ -6,6 +6,7 @@
 void serial_init(void);
 void serial_write_char(char c);
 void serial_write(const char* str);
+void serial_write_n(const char* s, uint64_t len);
 void serial_write_hex(uint64_t value);
 void serial_write_dec(uint64_t value);
 
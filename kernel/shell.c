@@ -10,8 +10,13 @@
 #include "rtc.h"
 #include "irq.h"
 #include "pmm.h"
+#include "kmalloc.h"
+#include "kmem_cache.h"
 #include "klog.h"
 #include "panic.h"
+#include "smp.h"
+#include "percpu.h"
+#include "ktimer.h"
 
 #define INPUT_MAX 256
 #define HISTORY_MAX 16
@@ -62,6 +67,64 @@ static int parse_u64(const char* s, uint64_t* out)
     return 1;
 }
 
+static void clocksrc_probe_fired(void* arg)
+{
+    *(volatile uint64_t*)arg = timer_now_ns();
+}
+
+// smpcheck: a bit per CPU a probe finished on, and how many finished
+static volatile uint32_t smpcheck_cpus;
+static volatile uint32_t smpcheck_done;
+
+// busy for 20 ms, so the probes cannot all go through one CPU in turn
+static void smpcheck_probe(void)
+{
+    uint64_t start = timer_now_ns();
+    while (timer_now_ns() - start < 20000000ULL)
+        __asm__ volatile ("pause");
+    __atomic_or_fetch(&smpcheck_cpus, 1u << this_cpu()->cpu_id, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&smpcheck_done, 1, __ATOMIC_RELEASE);
+    task_exit(0);
+}
+
+// Two probes per CPU, then waits up to a second for them. Passes when
+// every AP ran at least one.
+static void smpcheck_command(void)
+{
+    uint32_t cpus = smp_cpu_count();
+    if (cpus < 2) {
+        print("smpcheck: no APs online\n");
+        return;
+    }
+
+    smpcheck_cpus = 0;
+    smpcheck_done = 0;
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < cpus * 2; i++) {
+        if (task_create_kernel(smpcheck_probe) >= 0)
+            started++;
+    }
+
+    uint64_t start = timer_now_ns();
+    while (__atomic_load_n(&smpcheck_done, __ATOMIC_ACQUIRE) < started &&
+           timer_now_ns() - start < 1000000000ULL)
+        task_sleep_until(timer_now_ns() + 10000000ULL);
+
+    uint32_t ran = smpcheck_cpus;
+    uint32_t aps = ((1u << cpus) - 1) & ~1u;
+    print("smpcheck: probes=");
+    print_dec(smpcheck_done);
+    print("/");
+    print_dec(started);
+    print(" cpus=");
+    for (uint32_t i = 0; i < cpus; i++) {
+        if (!(ran & (1u << i))) continue;
+        print_dec(i);
+        print(" ");
+    }
+    print((ran & aps) == aps ? "PASS\n" : "FAIL\n");
+}
+
 static void print_prompt(void)
 {
     RtcDateTime dt;
@@ -210,7 +273,7 @@ static void process_command(void)
     history_cursor = -1;
 
     if (kstrcmp(input_buf, "help") == 0) {
-        print("commands: help clear ticks sched schedcheck about shutdown spawnh spawnb time irq irqstat clocksrc hw ps kill wait memstat uptime status dmesg-lite watch\n");
+        print("commands: help clear ticks sched schedcheck smpcheck about shutdown spawnh spawnb sysbench forktest segtest time irq irqstat clocksrc hw ps kill nice wait sleep memstat kcache spawnstat uptime status dmesg-lite watch\n");
     } else if (kstrcmp(input_buf, "clear") == 0) {
         display_clear();
     } else if (kstrcmp(input_buf, "ticks") == 0) {
@@ -227,6 +290,8 @@ static void process_command(void)
         print("schedcheck: ");
         print(ok ? "ok" : "fail");
         print("\n");
+    } else if (kstrcmp(input_buf, "smpcheck") == 0) {
+        smpcheck_command();
     } else if (kstrcmp(input_buf, "spawnh") == 0) {
         int pid = process_spawn_builtin(SPAWN_IMAGE_HELLO);
         print("spawn hello pid=");
@@ -235,6 +300,18 @@ static void process_command(void)
         int pid = process_spawn_builtin(SPAWN_IMAGE_BURN);
         print("spawn burn pid=");
         if (pid < 0) print("err\n"); else { print_dec((uint64_t)pid); print("\n"); }
+    } else if (kstrcmp(input_buf, "sysbench") == 0) {
+        int pid = process_spawn_builtin(SPAWN_IMAGE_SYSBENCH);
+        print("spawn sysbench pid=");
+        if (pid < 0) print("err\n"); else { print_dec((uint64_t)pid); print("\n"); }
+    } else if (kstrcmp(input_buf, "forktest") == 0) {
+        int pid = process_spawn_builtin(SPAWN_IMAGE_FORKTEST);
+        print("spawn forktest pid=");
+        if (pid < 0) print("err\n"); else { print_dec((uint64_t)pid); print("\n"); }
+    } else if (kstrcmp(input_buf, "segtest") == 0) {
+        int pid = process_spawn_builtin(SPAWN_IMAGE_SEGTEST);
+        print("spawn segtest pid=");
+        if (pid < 0) print("err\n"); else { print_dec((uint64_t)pid); print("\n"); }
     } else if (kstrcmp(input_buf, "ps") == 0) {
         process_dump_table();
     } else if (str_prefix(input_buf, "kill")) {
@@ -258,6 +335,23 @@ static void process_command(void)
                 print("\n");
             }
         }
+    } else if (str_prefix(input_buf, "nice")) {
+        uint64_t pid = 0;
+        uint64_t level = 0;
+        const char* rest = skip_spaces(input_buf + 4);
+        int ok = parse_u64(rest, &pid);
+        while (*rest && *rest != ' ') rest++;
+        if (!ok || *rest != ' ' || !parse_u64(rest, &level) || level >= SCHED_LEVELS) {
+            print("nice: usage nice <pid> <level 0-3>\n");
+        } else if (process_set_priority((int)pid, (uint32_t)level) < 0) {
+            print("nice: no such pid\n");
+        } else {
+            print("nice: pid ");
+            print_dec(pid);
+            print(" level ");
+            print_dec(level);
+            print("\n");
+        }
     } else if (str_prefix(input_buf, "wait")) {
         uint64_t pid = 0;
         const char* rest = skip_spaces(input_buf + 4);
@@ -265,24 +359,31 @@ static void process_command(void)
             print("wait: usage wait <pid>\n");
         } else {
             int code = 0;
-            while (1) {
-                process_reap_deferred();
-                int rc = process_wait_poll((int)pid, &code);
-                if (rc < 0) {
-                    print("wait: no such pid\n");
-                    break;
-                }
-                if (rc > 0) {
-                    print("wait: pid ");
-                    print_dec(pid);
-                    print(" exit=");
-                    print_dec((uint64_t)code);
-                    print("\n");
-                    break;
-                }
-                task_yield();
+            display_flush();
+            int rc = process_wait((int)pid, &code);
+            if (rc == -2) {
+                print("wait: pid already has a waiter\n");
+            } else if (rc < 0) {
+                print("wait: no such pid\n");
+            } else {
+                print("wait: pid ");
+                print_dec(pid);
+                print(" exit=");
+                print_dec((uint64_t)code);
+                print("\n");
             }
         }
+    } else if (str_prefix(input_buf, "sleep")) {
+        uint64_t ms = 0;
+        if (!parse_u64(input_buf + 5, &ms)) {
+            print("sleep: usage sleep <ms>\n");
+        } else {
+            uint64_t start = timer_now_ns();
+            task_sleep_until(start + ms * 1000000ULL);
+            print("sleep: woke after ");
+            print_dec((timer_now_ns() - start) / 1000);
+            print(" us\n");
+        }
     } else if (kstrcmp(input_buf, "time") == 0) {
         RtcDateTime dt;
         char ts[24];
@@ -299,15 +400,90 @@ static void process_command(void)
     } else if (kstrcmp(input_buf, "irqstat") == 0) {
         print_irq_stats();
     } else if (kstrcmp(input_buf, "clocksrc") == 0) {
-        print("clock source: PIT(");
+        TimerInfo ti;
+        timer_get_info(&ti);
+        print("clock source: TSC ");
+        print_dec(ti.tsc_hz / 1000000);
+        print(" MHz + CMOS RTC\n");
+        print("timer events: ");
+        print(timer_source_name());
+        if (ti.lapic_hz) {
+            print(" ");
+            print_dec(ti.lapic_hz / 1000);
+            print(" kHz");
+        }
+        print(" irqs=");
+        print_dec(ti.interrupts);
+        print(" pending=");
+        print_dec(ti.pending);
+        print(" tick=");
         print_dec((uint64_t)timer_get_frequency());
-        print("Hz) + CMOS RTC\n");
+        print(" Hz\n");
+
+        // resolution check: a 250 us timer should fire close to on time
+        static volatile uint64_t fired_ns;
+        KTimer probe;
+        fired_ns = 0;
+        ktimer_init(&probe, clocksrc_probe_fired, (void*)&fired_ns);
+        uint64_t start = timer_now_ns();
+        ktimer_arm(&probe, start + 250000);
+        while (!fired_ns && timer_now_ns() - start < 100000000ULL)
+            __asm__ volatile ("pause");
+        ktimer_cancel(&probe);
+        print("timer probe: 250000 ns requested, ");
+        if (fired_ns) {
+            print_dec(fired_ns - start);
+            print(" ns observed\n");
+        } else {
+            print("did not fire\n");
+        }
     } else if (kstrcmp(input_buf, "memstat") == 0) {
         print("mem: free_pages=");
         print_dec(pmm_get_free_pages());
         print(" total_pages=");
         print_dec(pmm_get_total_pages());
         print("\n");
+        PmmZeroPoolStats zp;
+        pmm_get_zero_pool_stats(&zp);
+        print("mem: zero_pool=");
+        print_dec(zp.available);
+        print("/");
+        print_dec(PMM_ZERO_POOL_SIZE);
+        print(" hits=");
+        print_dec(zp.hits);
+        print(" misses=");
+        print_dec(zp.misses);
+        print(" refilled=");
+        print_dec(zp.refilled);
+        print("\n");
+        print("mem: buddy free blocks by order:");
+        for (uint32_t o = 0; o < PMM_MAX_ORDER; o++) {
+            print(" ");
+            print_dec(pmm_get_free_blocks(o));
+        }
+        print("\n");
+        kmalloc_stats();
+    } else if (kstrcmp(input_buf, "spawnstat") == 0) {
+        ProcessSpawnStats st;
+        process_get_spawn_stats(&st);
+        print("spawn: count=");
+        print_dec(st.count);
+        print(" last=");
+        print_dec(st.last_cycles);
+        print(" min=");
+        print_dec(st.min_cycles);
+        print(" max=");
+        print_dec(st.max_cycles);
+        print(" avg=");
+        print_dec(st.count ? st.total_cycles / st.count : 0);
+        print(" cycles\n");
+        print("spawn: image cache hits=");
+        print_dec(st.image_hits);
+        print(" misses=");
+        print_dec(st.image_misses);
+        print("\n");
+    } else if (kstrcmp(input_buf, "kcache") == 0) {
+        kmem_cache_stats();
     } else if (kstrcmp(input_buf, "uptime") == 0) {
         uint64_t ticks = timer_get_ticks();
         uint32_t hz = timer_get_frequency();
@@ -348,7 +524,17 @@ static void process_command(void)
             print_dec(madt->ioapic_gsi_base);
             print(" CPUs=");
             print_dec(madt->cpu_lapic_count);
+            print(" online=");
+            print_dec(smp_cpu_count());
             print("\n");
+            for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+                const SmpCpu* cpu = smp_get_cpu(i);
+                print("hw: cpu");
+                print_dec(i);
+                print(" lapic=");
+                print_dec(cpu->lapic_id);
+                print(i == 0 ? " bsp\n" : " ap\n");
+            }
         }
     } else if (kstrcmp(input_buf, "shutdown") == 0) {
         print("SamOS shutting down\n");
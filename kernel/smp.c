@@ -0,0 +1,201 @@
+#include "smp.h"
+#include "acpi.h"
+#include "apic.h"
+#include "gdt.h"
+#include "tss.h"
+#include "idt.h"
+#include "syscall.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "paging.h"
+#include "timer.h"
+#include "display.h"
+#include "klog.h"
+#include "string.h"
+#include "percpu.h"
+#include "scheduler/task.h"
+
+#define PTE_PRESENT (1ULL << 0)
+#define PTE_WRITE   (1ULL << 1)
+#define PTE_HUGE    (1ULL << 7)
+
+// how long an AP gets to check in after its STARTUP IPIs
+#define AP_BOOT_TIMEOUT_MS 100
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_tramp_pml4[];
+extern uint8_t ap_tramp_stack[];
+extern uint8_t ap_tramp_entry[];
+extern uint8_t ap_tramp_cpu[];
+
+static SmpCpu cpus[SMP_MAX_CPUS];
+static uint32_t cpu_count = 1;
+// set by smp_start_aps once the scheduler and process table exist
+static volatile uint32_t aps_released = 0;
+
+// address of a trampoline slot in the low copy
+static uint64_t* tramp_slot(uint8_t* sym)
+{
+    return (uint64_t*)phys_to_virt(SMP_TRAMPOLINE_PHYS + (uint64_t)(sym - ap_trampoline_start));
+}
+
+static void ap_main(uint32_t index)
+{
+    SmpCpu* cpu = &cpus[index];
+
+    vmm_init_ap();
+    gdt_init_cpu(index);
+    percpu_init(index);
+    tss_init_cpu(index, cpu->stack_top);
+    idt_load();
+    syscall_init();
+    apic_enable_local();
+
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&aps_released, __ATOMIC_ACQUIRE))
+        __asm__ volatile ("pause");
+
+    // from here on this CPU takes work like the BSP: its own run queue
+    // and idle task, and its LAPIC timer for ticks and timers
+    task_cpu_init();
+    task_create_idle(idle_task);
+    timer_init_ap();
+    schedule();     // into the idle task; never returns
+    while (1)
+        __asm__ volatile ("hlt");
+}
+
+// The trampoline runs on its own tables: the low 2 MiB identity mapped
+// and executable (the kernel's direct map is NX), plus the kernel's upper
+// half so the jump to ap_main lands. Keeping them below 4 GiB lets real
+// mode load CR3 with a 32-bit move.
+static void install_trampoline(void)
+{
+    uint64_t len = (uint64_t)(ap_trampoline_end - ap_trampoline_start);
+    memcpy(phys_to_virt(SMP_TRAMPOLINE_PHYS), ap_trampoline_start, len);
+
+    uint64_t* pml4 = (uint64_t*)phys_to_virt(SMP_TRAMP_PML4_PHYS);
+    uint64_t* pdpt = (uint64_t*)phys_to_virt(SMP_TRAMP_PDPT_PHYS);
+    uint64_t* pd = (uint64_t*)phys_to_virt(SMP_TRAMP_PD_PHYS);
+    memset(pml4, 0, PAGE_SIZE);
+    memset(pdpt, 0, PAGE_SIZE);
+    memset(pd, 0, PAGE_SIZE);
+
+    pd[0] = PTE_PRESENT | PTE_WRITE | PTE_HUGE;     // physical 0-2 MiB
+    pdpt[0] = SMP_TRAMP_PD_PHYS | PTE_PRESENT | PTE_WRITE;
+    pml4[0] = SMP_TRAMP_PDPT_PHYS | PTE_PRESENT | PTE_WRITE;
+    for (int i = 256; i < 512; i++)
+        pml4[i] = kernel_address_space.pml4[i];
+
+    *tramp_slot(ap_tramp_pml4) = SMP_TRAMP_PML4_PHYS;
+    *tramp_slot(ap_tramp_entry) = (uint64_t)ap_main;
+}
+
+static int wait_online(SmpCpu* cpu, uint32_t ms)
+{
+    for (uint32_t i = 0; i < ms; i++) {
+        if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+            return 1;
+        timer_busy_wait_us(1000);
+    }
+    return __atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) != 0;
+}
+
+// INIT, 10 ms, STARTUP, 200 us, and a second STARTUP only if the first
+// one was missed
+static int start_ap(uint32_t index, uint8_t lapic_id)
+{
+    void* stack = pmm_alloc_pages(SMP_AP_STACK_PAGES);
+    if (!stack) {
+        klog_warn("SMP: no memory for an AP stack");
+        return 0;
+    }
+
+    SmpCpu* cpu = &cpus[index];
+    cpu->index = index;
+    cpu->lapic_id = lapic_id;
+    cpu->online = 0;
+    cpu->stack_top = (uint64_t)phys_to_virt((uint64_t)stack) +
+                     SMP_AP_STACK_PAGES * PAGE_SIZE;
+
+    *tramp_slot(ap_tramp_stack) = cpu->stack_top;
+    *tramp_slot(ap_tramp_cpu) = index;
+
+    uint8_t page = (uint8_t)(SMP_TRAMPOLINE_PHYS >> 12);
+    apic_send_init(lapic_id);
+    timer_busy_wait_us(10000);
+    apic_send_startup(lapic_id, page);
+    timer_busy_wait_us(200);
+    if (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE))
+        apic_send_startup(lapic_id, page);
+
+    return wait_online(cpu, AP_BOOT_TIMEOUT_MS);
+}
+
+void smp_init(void)
+{
+    cpus[0].index = 0;
+    cpus[0].lapic_id = apic_lapic_id();
+    cpus[0].online = 1;
+    cpus[0].stack_top = 0;
+    cpu_count = 1;
+
+    const AcpiMadtInfo* madt = acpi_get_madt_info();
+    if (!madt || !madt->present || !apic_can_enable()) {
+        klog_warn("SMP: no MADT or local APIC, running on the BSP only");
+        return;
+    }
+
+    install_trampoline();
+
+    for (uint32_t i = 0; i < madt->cpu_lapic_count; i++) {
+        uint8_t lapic_id = madt->cpu_lapic_ids[i];
+        if (lapic_id == cpus[0].lapic_id)
+            continue;
+        if (cpu_count == SMP_MAX_CPUS) {
+            klog_warn("SMP: more CPUs than SMP_MAX_CPUS, ignoring the rest");
+            break;
+        }
+
+        if (!start_ap(cpu_count, lapic_id)) {
+            // a late AP would pick up the next one's stack from the
+            // trampoline, so stop here rather than risk two sharing it
+            klog_warn("SMP: AP did not come online, stopping bring-up");
+            print("SMP: lapic ");
+            print_dec(lapic_id);
+            print(" timed out\n");
+            break;
+        }
+        cpu_count++;
+    }
+
+    print("SMP: ");
+    print_dec(cpu_count);
+    print(" of ");
+    print_dec(madt->cpu_lapic_count);
+    print(" CPUs online\n");
+}
+
+// The APs wait in ap_main until this, so nothing they do can find the
+// scheduler half set up
+void smp_start_aps(void)
+{
+    __atomic_store_n(&aps_released, 1, __ATOMIC_RELEASE);
+}
+
+uint32_t smp_cpu_count(void)
+{
+    return cpu_count;
+}
+
+uint32_t smp_cpu_id(void)
+{
+    return this_cpu()->cpu_id;
+}
+
+const SmpCpu* smp_get_cpu(uint32_t index)
+{
+    if (index >= cpu_count) return 0;
+    return &cpus[index];
+}
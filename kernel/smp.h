@@ -0,0 +1,29 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+
+#define SMP_MAX_CPUS        16
+#define SMP_AP_STACK_PAGES  4
+
+// Real-mode entry page for the APs and the three page-table pages the
+// trampoline runs on; all inside the low 64 KiB the PMM never hands out
+#define SMP_TRAMPOLINE_PHYS 0x8000ULL
+#define SMP_TRAMP_PML4_PHYS 0x9000ULL
+#define SMP_TRAMP_PDPT_PHYS 0xA000ULL
+#define SMP_TRAMP_PD_PHYS   0xB000ULL
+
+typedef struct {
+    uint32_t          index;
+    uint8_t           lapic_id;
+    volatile uint32_t online;
+    uint64_t          stack_top;
+} SmpCpu;
+
+void          smp_init(void);
+void          smp_start_aps(void);
+uint32_t      smp_cpu_count(void);
+uint32_t      smp_cpu_id(void);
+const SmpCpu* smp_get_cpu(uint32_t index);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "types.h"
+#include "cpu.h"
+
+typedef struct {
+    volatile uint32_t locked;
+} Spinlock;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(Spinlock* l)
+{
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        // wait on a plain load so the line stays shared while held
+        while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+            __asm__ volatile ("pause");
+    }
+}
+
+static inline void spin_unlock(Spinlock* l)
+{
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+// for locks also taken from interrupt handlers
+static inline uint64_t spin_lock_irqsave(Spinlock* l)
+{
+    uint64_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(Spinlock* l, uint64_t flags)
+{
+    spin_unlock(l);
+    irq_restore(flags);
+}
+
+#endif
@@ -9,4 +9,40 @@ int kstrcmp(const char* a, const char* b)
         b++;
     }
     return *a - *b;
-}
\ No newline at end of file
+}
+
+// qword moves for the bulk, bytes for the tail
+void* memcpy(void* dst, const void* src, uint64_t n)
+{
+    void* ret = dst;
+    uint64_t qwords = n / 8;
+    uint64_t bytes = n % 8;
+
+    __asm__ volatile ("rep movsq"
+                      : "+D"(dst), "+S"(src), "+c"(qwords)
+                      :
+                      : "memory");
+    __asm__ volatile ("rep movsb"
+                      : "+D"(dst), "+S"(src), "+c"(bytes)
+                      :
+                      : "memory");
+    return ret;
+}
+
+void* memset(void* dst, int value, uint64_t n)
+{
+    void* ret = dst;
+    uint64_t pattern = (uint8_t)value * 0x0101010101010101ULL;
+    uint64_t qwords = n / 8;
+    uint64_t bytes = n % 8;
+
+    __asm__ volatile ("rep stosq"
+                      : "+D"(dst), "+c"(qwords)
+                      : "a"(pattern)
+                      : "memory");
+    __asm__ volatile ("rep stosb"
+                      : "+D"(dst), "+c"(bytes)
+                      : "a"(pattern)
+                      : "memory");
+    return ret;
+}
@@ -1,6 +1,10 @@
 #ifndef STRING_H
 #define STRING_H
 
-int kstrcmp(const char* a, const char* b);
+#include "types.h"
 
-#endif
\ No newline at end of file
+int   kstrcmp(const char* a, const char* b);
+void* memcpy(void* dst, const void* src, uint64_t n);
+void* memset(void* dst, int value, uint64_t n);
+
+#endif
@@ -3,10 +3,43 @@
 #include "scheduler/task.h"
 #include "process.h"
 #include "display.h"
+#include "serial.h"
 #include "vmm.h"
+#include "timer.h"
+#include "gdt.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "ioring.h"
 
 #define USER_TOP 0x0000800000000000ULL
 
+#define MSR_EFER   0xC0000080
+#define MSR_STAR   0xC0000081
+#define MSR_LSTAR  0xC0000082
+#define MSR_FMASK  0xC0000084
+#define EFER_SCE   (1ULL << 0)
+
+// RFLAGS bits SYSCALL clears on entry: TF, IF, DF, AC. The kernel runs
+// the handler with interrupts off, as the int $0x80 gate does.
+#define SYSCALL_FMASK ((1ULL << 8) | (1ULL << 9) | (1ULL << 10) | (1ULL << 18))
+
+extern void syscall_entry(void);
+
+// Per CPU. SYSCALL loads CS from STAR[47:32] and SS from that + 8;
+// SYSRET loads SS from STAR[63:48] + 8 and CS from + 16, which is why
+// the GDT keeps user data ahead of user code.
+void syscall_init(void)
+{
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+    wrmsr(MSR_STAR, ((uint64_t)GDT_KERNEL_DATA << 48) |
+                    ((uint64_t)GDT_KERNEL_CODE << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    wrmsr(MSR_FMASK, SYSCALL_FMASK);
+
+    if (this_cpu()->cpu_id == 0)
+        print("SYSCALL/SYSRET enabled\n");
+}
+
 static uint64_t ret_err(uint64_t errno_val)
 {
     return 0ULL - errno_val;
@@ -23,59 +56,105 @@ static int user_range_valid(AddressSpace* as, uint64_t start, uint64_t len)
     uint64_t from = start & ~0xFFFULL;
     uint64_t to = (start + len - 1) & ~0xFFFULL;
 
+    // pages not touched yet are faulted in rather than rejected
     for (uint64_t va = from; va <= to; va += 0x1000) {
-        if (!vmm_virt_to_phys(as, va))
+        if (!vmm_virt_to_phys(as, va) &&
+            process_fault_in(task_current_pid(), va, 0) < 0)
             return 0;
     }
 
     return 1;
 }
 
-static uint64_t sys_write(InterruptFrame* frame)
+// User output goes to the framebuffer console and serial in one pass
+static void console_out(const char* s, uint64_t len)
+{
+    print_n(s, len);
+    serial_write_n(s, len);
+}
+
+// Prints whatever the current process queued in its console ring. The
+// counters live in user memory, so they are read once and the span is
+// clamped to the ring; a program that scribbles on them only garbles
+// its own output.
+static uint64_t console_drain(void)
 {
     Task* t = task_current();
-    if (!t || !t->is_user) return ret_err(1);
+    if (!t || !t->is_user) return 0;
+
+    // an untouched ring has no page and nothing queued
+    if (!vmm_virt_to_phys(t->address_space, CONSOLE_RING_VIRT))
+        return 0;
+
+    ConsoleRingCtl* ctl = (ConsoleRingCtl*)CONSOLE_RING_VIRT;
+    uint32_t head = ctl->head;
+    uint32_t tail = ctl->tail;
+    uint32_t avail = head - tail;
+    if (avail == 0) return 0;
+    if (avail > CONSOLE_RING_SIZE) {
+        tail = head - CONSOLE_RING_SIZE;
+        avail = CONSOLE_RING_SIZE;
+    }
+    if (!user_range_valid(t->address_space, CONSOLE_RING_DATA, CONSOLE_RING_SIZE))
+        return 0;
+
+    const char* data = (const char*)CONSOLE_RING_DATA;
+    uint32_t off = tail % CONSOLE_RING_SIZE;
+    uint32_t first = CONSOLE_RING_SIZE - off;
+    if (first > avail) first = avail;
+    console_out(data + off, first);
+    console_out(data, avail - first);
+    ctl->tail = head;
 
-    uint64_t user_ptr = frame->rbx;
-    uint64_t len = frame->rcx;
+    display_flush();
+    return avail;
+}
+
+// Shared by SYS_WRITE and IORING_OP_WRITE
+uint64_t syscall_write(uint64_t user_ptr, uint64_t len)
+{
+    Task* t = task_current();
+    if (!t || !t->is_user) return ret_err(1);
 
     if (len > 4096) return ret_err(22);
     if (!user_range_valid(t->address_space, user_ptr, len))
         return ret_err(14);
 
-    char* s = (char*)user_ptr;
-    for (uint64_t i = 0; i < len; i++) {
-        char out[2] = { s[i], 0 };
-        print(out);
-    }
+    // earlier ring output comes first
+    console_drain();
+    console_out((const char*)user_ptr, len);
     display_flush();
 
     return len;
 }
 
+static uint64_t sys_write(InterruptFrame* frame)
+{
+    return syscall_write(frame->rdi, frame->rsi);
+}
+
 static uint64_t sys_exit(InterruptFrame* frame)
 {
-    int code = (int)(frame->rbx & 0xFFFFFFFFULL);
+    int code = (int)(frame->rdi & 0xFFFFFFFFULL);
     int pid = task_current_pid();
+    console_drain();
     process_task_exited(pid, code);
-
-    Task* t = task_current();
-    if (t) {
-        t->exit_code = code;
-        t->state = TASK_ZOMBIE;
-    }
+    task_mark_exit(code);
 
     return ret_err(11);
 }
 
+// Keeps the slice used so far, like task_yield
 static uint64_t sys_yield(void)
 {
+    console_drain();
+    task_set_need_resched();
     return 0;
 }
 
 static uint64_t sys_spawn(InterruptFrame* frame)
 {
-    int image_id = (int)(frame->rbx & 0xFFFFFFFFULL);
+    int image_id = (int)(frame->rdi & 0xFFFFFFFFULL);
     int pid = process_spawn_builtin(image_id);
     if (pid < 0)
         return ret_err(12);
@@ -89,29 +168,92 @@ static uint64_t sys_getpid(void)
     return (uint64_t)pid;
 }
 
+// Queued output is printed first; otherwise the child would inherit it
+// and print it a second time
+static uint64_t sys_fork(InterruptFrame* frame)
+{
+    console_drain();
+    int pid = process_fork(frame);
+    if (pid < 0)
+        return ret_err(12);
+    return (uint64_t)pid;
+}
+
+static uint64_t sys_setprio(InterruptFrame* frame)
+{
+    int pid = (int)(frame->rdi & 0xFFFFFFFFULL);
+    uint64_t level = frame->rsi;
+    if (level >= SCHED_LEVELS) return ret_err(22);
+
+    int rc;
+    if (pid == 0) {
+        Task* t = task_current();
+        rc = t ? task_set_priority(t->tid, (uint32_t)level) : -1;
+    } else {
+        rc = process_set_priority(pid, (uint32_t)level);
+    }
+    if (rc < 0) return ret_err(3);
+    return 0;
+}
+
+// task_block_until asks for a switch on the way out; the scheduler sees
+// the caller WAITING and leaves it off the run queue until the timer fires
+static uint64_t sys_sleep_ns(InterruptFrame* frame)
+{
+    uint64_t ns = frame->rdi;
+    if (ns == 0) return sys_yield();
+    console_drain();
+
+    uint64_t now = timer_now_ns();
+    uint64_t deadline = (ns > KTIMER_NONE - 1 - now) ? KTIMER_NONE - 1 : now + ns;
+    if (task_block_until(deadline) < 0)
+        return ret_err(12);
+    return 0;
+}
+
+// Syscalls that can block, yield, exit or make another task runnable.
+// Only these consult need_resched on the way out; the rest go straight
+// back to the caller without touching the scheduler.
+static const uint8_t may_resched[SYS_COUNT] = {
+    [SYS_EXIT]     = 1,
+    [SYS_YIELD]    = 1,
+    [SYS_SPAWN]    = 1,
+    [SYS_FORK]     = 1,
+    [SYS_SETPRIO]  = 1,
+    [SYS_SLEEP_NS] = 1,
+    [SYS_RING_ENTER] = 1,
+};
+
+// The doorbell: one call prints a whole batch
+static uint64_t sys_console_flush(void)
+{
+    return console_drain();
+}
+
 uint64_t syscall_dispatch(InterruptFrame* frame)
 {
     if (!frame) return 0;
 
+    uint64_t num = frame->rax;
     uint64_t ret = ret_err(38);
 
-    switch (frame->rax) {
+    switch (num) {
         case SYS_WRITE:  ret = sys_write(frame); break;
         case SYS_EXIT:   ret = sys_exit(frame); break;
         case SYS_YIELD:  ret = sys_yield(); break;
         case SYS_SPAWN:  ret = sys_spawn(frame); break;
         case SYS_GETPID: ret = sys_getpid(); break;
+        case SYS_FORK:   ret = sys_fork(frame); break;
+        case SYS_SETPRIO: ret = sys_setprio(frame); break;
+        case SYS_SLEEP_NS: ret = sys_sleep_ns(frame); break;
+        case SYS_CONSOLE_FLUSH: ret = sys_console_flush(); break;
+        case SYS_RING_ENTER: ret = ioring_enter((uint32_t)frame->rdi, (uint32_t)frame->rsi); break;
         default:         ret = ret_err(38); break;
     }
 
     frame->rax = ret;
 
-    if (frame->rax == ret_err(11) || frame->rax == 0) {
-        Task* t = task_current();
-        if (t && t->state != TASK_WAITING && t->state != TASK_ZOMBIE)
-            t->state = TASK_RUNNABLE;
-        return task_schedule_from_interrupt(frame);
-    }
-
+    if (num < SYS_COUNT && may_resched[num])
+        return task_resched_point(frame);
     return 0;
 }
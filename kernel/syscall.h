@@ -4,6 +4,8 @@
 #include "types.h"
 #include "idt.h"
 
+void     syscall_init(void);
 uint64_t syscall_dispatch(InterruptFrame* frame);
+uint64_t syscall_write(uint64_t user_ptr, uint64_t len);
 
 #endif
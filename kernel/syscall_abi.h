@@ -3,17 +3,110 @@
 
 #include "types.h"
 
+// Number in rax, arguments in rdi, rsi, rdx, result in rax (negative
+// errno on failure). Both `syscall` and `int $0x80` take this layout;
+// `syscall` clobbers rcx and r11.
 enum {
     SYS_WRITE = 0,
     SYS_EXIT  = 1,
     SYS_YIELD = 2,
     SYS_SPAWN = 3,
     SYS_GETPID = 4,
+    SYS_FORK   = 5,
+    SYS_SETPRIO = 6,    // (pid or 0 for self, level 0 = most urgent)
+    SYS_SLEEP_NS = 7,   // (nanoseconds); 0 just yields
+    SYS_CONSOLE_FLUSH = 8,  // drain the console ring; returns bytes printed
+    SYS_RING_ENTER = 9,     // (to_submit, min_complete); returns SQEs consumed
+    SYS_COUNT
 };
 
+// Console output ring, one per process at a fixed address: a control
+// page, then CONSOLE_RING_SIZE bytes of data. The program appends at
+// head without a syscall; the kernel prints everything up to head and
+// advances tail on SYS_CONSOLE_FLUSH and whenever the program yields,
+// sleeps, forks or exits. Both counters run freely and wrap.
+#define CONSOLE_RING_VIRT 0x00007FFF00000000ULL
+#define CONSOLE_RING_DATA (CONSOLE_RING_VIRT + 0x1000)
+#define CONSOLE_RING_SIZE 4096
+
+typedef struct {
+    volatile uint32_t head;     // bytes produced, written by the program
+    volatile uint32_t tail;     // bytes consumed, written by the kernel
+} ConsoleRingCtl;
+
+// Submission and completion rings, one page per process at a fixed
+// address. The program fills sq[] and advances sq_tail; SYS_RING_ENTER
+// runs the entries in order and advances sq_head. Every entry yields one
+// completion at cq_tail, later for ops that wait, and the program takes
+// them by advancing cq_head. Indices run freely and wrap.
+#define IORING_VIRT    0x00007FFF00010000ULL
+#define IORING_ENTRIES 64
+
+enum {
+    IORING_OP_NOP   = 0,
+    IORING_OP_WRITE = 1,    // (ptr, len) -> bytes
+    IORING_OP_SPAWN = 2,    // (image id) -> pid
+    IORING_OP_SLEEP = 3,    // (nanoseconds) -> 0 once they pass
+    IORING_OP_WAIT  = 4,    // (pid) -> pid once it exits, aux = exit code
+    IORING_OP_SEND  = 5,    // (pid, value) into its mailbox -> 0
+    IORING_OP_RECV  = 6,    // -> sender pid once a value arrives, aux = value
+};
+
+typedef struct {
+    uint32_t op;
+    uint32_t reserved;
+    uint64_t arg0;
+    uint64_t arg1;
+    uint64_t user_data;     // handed back in the completion
+} IoSqe;
+
+typedef struct {
+    uint64_t user_data;
+    uint64_t result;        // as a syscall would return it
+    uint64_t aux;
+} IoCqe;
+
+typedef struct {
+    volatile uint32_t sq_head;      // written by the kernel
+    volatile uint32_t sq_tail;      // written by the program
+    volatile uint32_t cq_head;      // written by the program
+    volatile uint32_t cq_tail;      // written by the kernel
+    volatile uint32_t cq_overflow;  // completions dropped on a full CQ
+    uint32_t reserved;
+    IoSqe sq[IORING_ENTRIES];
+    IoCqe cq[IORING_ENTRIES];
+} IoRing;
+
+// vvar: two read-only pages in every address space. The first belongs
+// to the process, the second is shared and kept current by the kernel,
+// so pid and time reads need no syscall.
+#define VVAR_VIRT        0x00007FFF00020000ULL
+#define VVAR_TIME_VIRT   (VVAR_VIRT + 0x1000)
+
+typedef struct {
+    uint32_t pid;
+} VvarProcess;
+
+// Boot-relative time is (tsc - tsc_base) * ns_mult >> 32, ticks are that
+// divided by tick_ns. The wall clock changes at run time, so it sits
+// behind seq: odd while the kernel writes, bumped again when done.
+typedef struct {
+    uint64_t tsc_hz;
+    uint64_t tsc_base;
+    uint64_t ns_mult;           // nanoseconds per cycle, 32.32 fixed point
+    uint64_t tick_ns;
+    volatile uint32_t seq;
+    uint32_t reserved;
+    volatile uint64_t wall_sec; // Unix seconds (UTC) at boot-relative wall_ns
+    volatile uint64_t wall_ns;
+} VvarTime;
+
 enum {
     SPAWN_IMAGE_HELLO = 0,
     SPAWN_IMAGE_BURN  = 1,
+    SPAWN_IMAGE_SYSBENCH = 2,
+    SPAWN_IMAGE_FORKTEST = 3,
+    SPAWN_IMAGE_SEGTEST  = 4,
 };
 
 #endif
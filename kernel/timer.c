@@ -1,20 +1,57 @@
 #include "timer.h"
+#include "ktimer.h"
 #include "display.h"
 #include "panic.h"
 #include "irq.h"
+#include "apic.h"
+#include "cpu.h"
 #include "scheduler/task.h"
 #include "io.h"
 
-static volatile uint64_t ticks       = 0;
 static volatile int      flush_needed = 0;
 static uint32_t timer_hz = 0;
+static uint64_t tick_ns = 0;
+static uint64_t interrupts = 0;
+
+// The clock is the TSC, calibrated once against the PIT. ns_mult is
+// nanoseconds per cycle in 32.32 fixed point.
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_base = 0;
+static uint64_t ns_mult = 0;
+static uint64_t lapic_hz = 0;
+static TimerSource source = TIMER_SOURCE_PIT;
+
+#define PIT_BASE_HZ 1193182
+#define NS_PER_SEC  1000000000ULL
+
+// long enough for a stable rate, short enough not to be noticed at boot
+#define TIMER_CALIBRATE_US 10000
+
+// One-shot sources are reprogrammed at least this often, which keeps the
+// count and deadline maths inside 64 bits
+#define TIMER_MAX_PROGRAM_NS NS_PER_SEC
+
+static void calibrate_tsc(void)
+{
+    uint64_t t0 = rdtsc();
+    timer_busy_wait_us(TIMER_CALIBRATE_US);
+    uint64_t t1 = rdtsc();
+
+    tsc_hz = (t1 - t0) * (1000000ULL / TIMER_CALIBRATE_US);
+    if (tsc_hz == 0)
+        panic("timer: TSC does not count");
+    ns_mult = (NS_PER_SEC << 32) / tsc_hz;
+    tsc_base = t1;
+}
 
 void timer_init(uint32_t frequency)
 {
     if (frequency == 0)
         panic("timer_init: frequency must be non-zero");
 
-    uint32_t divisor = 1193182 / frequency;
+    calibrate_tsc();
+
+    uint32_t divisor = PIT_BASE_HZ / frequency;
     if (divisor == 0)    divisor = 1;
     if (divisor > 0xFFFF) divisor = 0xFFFF;
 
@@ -22,23 +59,114 @@ void timer_init(uint32_t frequency)
     outb(0x40, divisor & 0xFF);
     outb(0x40, (divisor >> 8) & 0xFF);
     timer_hz = frequency;
+    tick_ns = NS_PER_SEC / frequency;
 
     print("Timer initialized at ");
     print_dec(frequency);
-    print(" Hz\n");
+    print(" Hz, TSC ");
+    print_dec(tsc_hz / 1000000);
+    print(" MHz\n");
 }
 
-// called from isr32 assembly stub
-// returns new task RSP (0 = no switch)
-uint64_t timer_tick(uint64_t current_rsp)
+// Hands timekeeping to the local APIC timer in one-shot mode, using the
+// TSC-deadline mode when the CPU has it. The PIT goes quiet, so an idle
+// CPU only sees an interrupt when a timer is actually due.
+int timer_enable_lapic(void)
+{
+    if (irq_controller_backend() != IRQ_BACKEND_APIC)
+        return 0;
+
+    int deadline = apic_timer_has_tsc_deadline();
+    if (!deadline) {
+        lapic_hz = apic_timer_calibrate(TIMER_CALIBRATE_US);
+        if (lapic_hz == 0)
+            return 0;
+    }
+
+    // channel 0 one-shot with nothing loaded: it stays silent
+    outb(0x43, 0x30);
+    irq_mask(0);
+
+    apic_timer_setup(TIMER_LAPIC_VECTOR, deadline);
+    source = deadline ? TIMER_SOURCE_TSC_DEADLINE : TIMER_SOURCE_LAPIC;
+    timer_program_next();
+
+    print("Timer: ");
+    print(timer_source_name());
+    if (!deadline) {
+        print(" ");
+        print_dec(lapic_hz / 1000);
+        print(" kHz");
+    }
+    print(" one-shot, tickless idle\n");
+    return 1;
+}
+
+// Gives an AP the BSP's one-shot setup on its own LAPIC. The timer heap
+// is shared, so whichever CPU's timer goes off first runs what is due;
+// the PIT only ever interrupts the BSP.
+void timer_init_ap(void)
+{
+    if (source == TIMER_SOURCE_PIT)
+        return;
+    apic_timer_setup(TIMER_LAPIC_VECTOR, source == TIMER_SOURCE_TSC_DEADLINE);
+    timer_program_next();
+}
+
+// Points the one-shot source at the earliest armed timer, or stops it
+void timer_program_next(void)
+{
+    if (source == TIMER_SOURCE_PIT)
+        return;
+
+    uint64_t flags = irq_save();
+    uint64_t next = ktimer_next_deadline();
+    if (next == KTIMER_NONE) {
+        apic_timer_stop();
+        irq_restore(flags);
+        return;
+    }
+
+    uint64_t now = timer_now_ns();
+    uint64_t delta = (next > now) ? next - now : 0;
+    if (delta > TIMER_MAX_PROGRAM_NS)
+        delta = TIMER_MAX_PROGRAM_NS;
+
+    if (source == TIMER_SOURCE_TSC_DEADLINE) {
+        apic_timer_arm_deadline(rdtsc() + delta * tsc_hz / NS_PER_SEC);
+    } else {
+        uint64_t count = delta * lapic_hz / NS_PER_SEC;
+        if (count == 0) count = 1;
+        if (count > 0xFFFFFFFFULL) count = 0xFFFFFFFFULL;
+        apic_timer_arm_count((uint32_t)count);
+    }
+    irq_restore(flags);
+}
+
+static uint64_t timer_interrupt(uint64_t current_rsp)
 {
-    irq_send_eoi(0);
     irq_note_timer_irq();
-    ticks++;
+    interrupts++;
     flush_needed = 1;
+    ktimer_run_expired(timer_now_ns());
+    timer_program_next();
     return schedule_on_tick(current_rsp);
 }
 
+// called from isr32 assembly stub while the PIT drives time
+// returns new task RSP (0 = no switch)
+uint64_t timer_tick(uint64_t current_rsp)
+{
+    irq_send_eoi(0);
+    return timer_interrupt(current_rsp);
+}
+
+uint64_t timer_lapic_interrupt(uint64_t current_rsp)
+{
+    apic_send_eoi();
+    return timer_interrupt(current_rsp);
+}
+
 int timer_flush_needed(void)
 {
     if (flush_needed) {
@@ -48,19 +176,76 @@ int timer_flush_needed(void)
     return 0;
 }
 
+uint64_t timer_now_ns(void)
+{
+    uint64_t delta = rdtsc() - tsc_base;
+    return (uint64_t)(((unsigned __int128)delta * ns_mult) >> 32);
+}
+
+// Scheduler ticks since boot, read off the clock rather than counted, so
+// they keep advancing while idle CPUs take no interrupts
 uint64_t timer_get_ticks(void)
 {
-    uint64_t t;
-    uint64_t flags;
-    __asm__ volatile ("pushfq; pop %0" : "=r"(flags));
-    __asm__ volatile ("cli");
-    t = ticks;
-    if (flags & (1ULL << 9))
-        __asm__ volatile ("sti");
-    return t;
+    return tick_ns ? timer_now_ns() / tick_ns : 0;
+}
+
+uint64_t timer_tick_ns(void)
+{
+    return tick_ns;
 }
 
 uint32_t timer_get_frequency(void)
 {
     return timer_hz;
 }
+
+TimerSource timer_get_source(void)
+{
+    return source;
+}
+
+void timer_get_info(TimerInfo* out)
+{
+    if (!out) return;
+    out->source = source;
+    out->tsc_hz = tsc_hz;
+    out->lapic_hz = lapic_hz;
+    out->interrupts = interrupts;
+    out->pending = ktimer_pending();
+    out->tsc_base = tsc_base;
+    out->ns_mult = ns_mult;
+    out->tick_ns = tick_ns;
+}
+
+const char* timer_source_name(void)
+{
+    switch (source) {
+        case TIMER_SOURCE_LAPIC:        return "LAPIC";
+        case TIMER_SOURCE_TSC_DEADLINE: return "LAPIC TSC-deadline";
+        default:                        return "PIT";
+    }
+}
+
+// Polls a one-shot count on PIT channel 2 (the speaker gate), so it works
+// with interrupts off and leaves the channel 0 tick alone
+void timer_busy_wait_us(uint32_t us)
+{
+    while (us > 0) {
+        uint32_t chunk = (us > 50000) ? 50000 : us;
+        uint32_t count = (uint32_t)(((uint64_t)PIT_BASE_HZ * chunk) / 1000000);
+        if (count == 0) count = 1;
+
+        uint8_t gate = inb(0x61);
+        outb(0x61, (gate & ~0x02) | 0x01);  // gate on, speaker off
+        outb(0x43, 0xB0);                   // channel 2, lo/hi, mode 0
+        outb(0x42, count & 0xFF);
+        outb(0x42, (count >> 8) & 0xFF);
+
+        // OUT2 goes high at terminal count
+        while (!(inb(0x61) & 0x20))
+            __asm__ volatile ("pause");
+
+        outb(0x61, gate);
+        us -= chunk;
+    }
+}
@@ -3,10 +3,39 @@
 
 #include "types.h"
 
+#define TIMER_LAPIC_VECTOR 0x30
+
+typedef enum {
+    TIMER_SOURCE_PIT = 0,           // periodic at the tick rate
+    TIMER_SOURCE_LAPIC,             // one-shot count
+    TIMER_SOURCE_TSC_DEADLINE,      // one-shot absolute TSC
+} TimerSource;
+
+typedef struct {
+    TimerSource source;
+    uint64_t    tsc_hz;
+    uint64_t    lapic_hz;           // 0 unless counting mode is used
+    uint64_t    interrupts;
+    uint32_t    pending;            // armed kernel timers
+    uint64_t    tsc_base;           // TSC at timer_now_ns() == 0
+    uint64_t    ns_mult;            // ns per cycle, 32.32 fixed point
+    uint64_t    tick_ns;
+} TimerInfo;
+
 void     timer_init(uint32_t frequency);
+int      timer_enable_lapic(void);
+void     timer_init_ap(void);
+void     timer_program_next(void);
 uint64_t timer_tick(uint64_t current_rsp);
+uint64_t timer_lapic_interrupt(uint64_t current_rsp);
 int      timer_flush_needed(void);
+uint64_t timer_now_ns(void);
 uint64_t timer_get_ticks(void);
+uint64_t timer_tick_ns(void);
 uint32_t timer_get_frequency(void);
+TimerSource timer_get_source(void);
+void     timer_get_info(TimerInfo* out);
+const char* timer_source_name(void);
+void     timer_busy_wait_us(uint32_t us);
 
 #endif
@@ -43,33 +43,42 @@
 #include "tss.h"
 #include "gdt.h"
 #include "display.h"
+#include "smp.h"
 
-static TSS tss;
+// one TSS and double-fault stack per CPU
+static TSS tss[SMP_MAX_CPUS];
 
-static uint8_t df_stack[4096] __attribute__((aligned(16))); // double fault stack
-static uint8_t kernel_irq_stack[8192] __attribute__((aligned(16))); // interrupt stack
+static uint8_t df_stack[SMP_MAX_CPUS][4096] __attribute__((aligned(16))); // double fault stacks
+static uint8_t kernel_irq_stack[8192] __attribute__((aligned(16))); // BSP interrupt stack
 
 void tss_set_rsp0(uint64_t rsp)
 {
-    tss.rsp0 = rsp;
+    tss[smp_cpu_id()].rsp0 = rsp;
 }
 
 void tss_init(void)
 {
-    uint8_t* p = (uint8_t*)&tss;
+    tss_init_cpu(0, (uint64_t)kernel_irq_stack + sizeof(kernel_irq_stack)); // stack grows downward. so sp must be in top.
+}
+
+void tss_init_cpu(uint32_t cpu, uint64_t rsp0)
+{
+    TSS* t = &tss[cpu];
+    uint8_t* p = (uint8_t*)t;
     for (uint64_t i = 0; i < sizeof(TSS); i++) p[i] = 0;
 
     // RSP0: kernel stack for interrupts from ring 3
-    tss.rsp0 = (uint64_t)kernel_irq_stack + sizeof(kernel_irq_stack); // stack grows downward. so sp must be in top.
+    t->rsp0 = rsp0;
 
     // IST1: dedicated stack for double fault
-    tss.ist1 = (uint64_t)df_stack + sizeof(df_stack);
+    t->ist1 = (uint64_t)df_stack[cpu] + sizeof(df_stack[cpu]);
 
-    tss.iopb_offset = sizeof(TSS); // iopb disabled.
+    t->iopb_offset = sizeof(TSS); // iopb disabled.
 
-    gdt_set_tss((uint64_t)&tss, sizeof(TSS) - 1);
+    gdt_set_tss(cpu, (uint64_t)t, sizeof(TSS) - 1);
 
     __asm__ volatile ("ltr %0" :: "r"((uint16_t)0x28));
 
-    print("TSS loaded\n");
+    if (cpu == 0)
+        print("TSS loaded\n");
 }
\ No newline at end of file
@@ -24,5 +24,6 @@ typedef struct {
 
 void tss_set_rsp0(uint64_t rsp);
 void tss_init(void);
+void tss_init_cpu(uint32_t cpu, uint64_t rsp0);
 
 #endif
\ No newline at end of file
@@ -8,6 +8,8 @@ typedef unsigned long long uint64_t;
 
 extern uint8_t _kernel_start;
 extern uint64_t _kernel_end;
+extern uint8_t _rodata_start;   // end of text, 4 KiB aligned
+extern uint8_t _data_start;     // end of read-only data, 4 KiB aligned
 
 typedef struct {
     uint32_t Type;
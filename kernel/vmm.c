@@ -3,24 +3,94 @@
 #include "display.h"
 #include "paging.h"
 #include "panic.h"
+#include "kmem_cache.h"
+#include "string.h"
+#include "cpu.h"
+#include "vvar.h"
+#include "percpu.h"
+#include "spinlock.h"
 
 AddressSpace kernel_address_space;
 
-// flush TLB for a single page
-static void tlb_flush(uint64_t virt) {
-    __asm__ volatile ("invlpg (%0)" :: "r"(virt) : "memory");
+static KmemCache* page_table_cache = 0;
+static KmemCache* address_space_cache = 0;
+
+#define CR4_PGE        (1ULL << 7)
+#define CR4_PCIDE      (1ULL << 17)
+#define CR3_NOFLUSH    (1ULL << 63)
+#define PCID_COUNT     4096
+
+// PCIDs are handed out in order and never reused within a generation, so
+// a freshly assigned tag cannot hit stale entries. Running out starts a
+// new generation, and each CPU flushes every tag once before it loads
+// one from the new generation. PCID 0 is the kernel's.
+static uint16_t   pcid_next = 1;
+static VmmTlbStats tlb_stats;
+static Spinlock   pcid_lock = SPINLOCK_INIT;
+
+static int is_current(AddressSpace* as) {
+    return (read_cr3() & 0x000FFFFFFFFFF000ULL) == virt_to_phys(as->pml4);
+}
+
+// flush TLB for a single page of as. invlpg only reaches the running
+// PCID; any other space just loses its tag and starts clean next time.
+static void tlb_flush(AddressSpace* as, uint64_t virt) {
+    if (!tlb_stats.pcid_enabled || is_current(as))
+        __asm__ volatile ("invlpg (%0)" :: "r"(virt) : "memory");
+    else
+        as->pcid_generation = 0;
+}
+
+static void pcid_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    tlb_stats.generation = 1;
+    if (!(c & (1U << 17)))
+        return;
+
+    // CR3[11:0] must be zero when PCIDE is set; the kernel runs as PCID 0
+    write_cr3(read_cr3() & 0x000FFFFFFFFFF000ULL);
+    write_cr4(read_cr4() | CR4_PCIDE);
+    tlb_stats.pcid_enabled = 1;
 }
 
-// allocate a zeroed physical page for a page table
+// toggling PGE drops every TLB entry for every PCID
+static void flush_all_tags(void) {
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+// caller holds pcid_lock
+static void pcid_assign(AddressSpace* as) {
+    if (pcid_next == PCID_COUNT) {
+        tlb_stats.generation++;
+        pcid_next = 1;
+    }
+    as->pcid = pcid_next++;
+    as->pcid_generation = tlb_stats.generation;
+    tlb_stats.assigned++;
+}
+
+// allocate a zeroed physical page for a page table — fresh pages come
+// from the PMM zero pool, recycled ones were cleared by their last owner
 static uint64_t* alloc_page_table(void) {
-    uint64_t* pt = (uint64_t*)pmm_alloc_page();
+    uint64_t* pt = (uint64_t*)kmem_cache_alloc(page_table_cache);
     if (!pt)
         panic("VMM: out of memory allocating page table");
-    // zero it — pt is a physical address, accessible via identity map
-    for (int i = 0; i < 512; i++) pt[i] = 0;
     return pt;
 }
 
+// callers clear every entry they set before handing a table back
+static void free_page_table(uint64_t* pt) {
+    kmem_cache_free(page_table_cache, pt);
+}
+
+// next-level table an entry points at, through the direct map
+static uint64_t* table_at(uint64_t entry) {
+    return (uint64_t*)phys_to_virt(entry & 0x000FFFFFFFFFF000ULL);
+}
+
 // get or create a page table entry at a given level
 // returns pointer to the next level table
 static uint64_t* get_or_create_table(uint64_t* table,
@@ -32,11 +102,11 @@ static uint64_t* get_or_create_table(uint64_t* table,
         // Upgrade to user-visible when requested so ring3 can traverse.
         if (flags & VMM_FLAG_USER)
             table[index] |= VMM_FLAG_USER;
-        return (uint64_t*)(table[index] & 0x000FFFFFFFFFF000ULL);  // fix here
+        return table_at(table[index]);
     }
 
     uint64_t* new_table = alloc_page_table();
-    table[index] = (uint64_t)new_table | flags | VMM_FLAG_PRESENT;
+    table[index] = virt_to_phys(new_table) | flags | VMM_FLAG_PRESENT;
     return new_table;
 }
 
@@ -54,14 +124,34 @@ void vmm_init(void)
     // read current CR3 — this is the kernel PML4 built by paging_init
     uint64_t cr3;
     __asm__ volatile ("mov %%cr3, %0" : "=r"(cr3));
-    kernel_address_space.pml4 = (uint64_t*)cr3;
+    kernel_address_space.pml4 = (uint64_t*)phys_to_virt(cr3 & 0x000FFFFFFFFFF000ULL);
+    kernel_address_space.pcid = 0;
+    kernel_address_space.pcid_generation = 0;
+    kernel_address_space.last_cpu = -1;
+    pcid_init();
+
+    page_table_cache = kmem_cache_create("page_table", PAGE_SIZE, 0);
+    address_space_cache = kmem_cache_create("address_space", sizeof(AddressSpace), 0);
 
-    print("VMM: initialized\n");
+    print("VMM: initialized");
+    print(tlb_stats.pcid_enabled ? " (PCID on)\n" : " (PCID off)\n");
     print("VMM: kernel PML4 at: ");
     print_hex((uint64_t)kernel_address_space.pml4);
     print("\n");
 }
 
+// Moves an AP off the trampoline tables onto the kernel's, with global
+// pages and, when the BSP uses them, PCIDs
+void vmm_init_ap(void)
+{
+    write_cr3(virt_to_phys(kernel_address_space.pml4));
+
+    uint64_t cr4 = read_cr4() | CR4_PGE;
+    if (tlb_stats.pcid_enabled)
+        cr4 |= CR4_PCIDE;
+    write_cr4(cr4);
+}
+
 // AddressSpace* vmm_create_address_space(void)
 // {
 //     AddressSpace* as = (AddressSpace*)pmm_alloc_page();
@@ -83,50 +173,72 @@ void vmm_init(void)
 // }
 AddressSpace* vmm_create_address_space(void)
 {
-    AddressSpace* as = (AddressSpace*)pmm_alloc_page();
+    AddressSpace* as = (AddressSpace*)kmem_cache_alloc(address_space_cache);
     if (!as) return 0;
 
     as->pml4 = alloc_page_table();
+    as->pcid = 0;
+    as->pcid_generation = 0;
+    as->last_cpu = -1;
+
+    // The lower half (slots 0-255) is entirely private to the process.
+    // The upper half is shared with the kernel: the direct map at
+    // pml4[256] and kernel code/data at pml4[511].
+    for (int i = 256; i < 512; i++)
+        as->pml4[i] = kernel_address_space.pml4[i];
+
+    // every user space sees its pid and the clock without a syscall
+    if (vvar_map(as) < 0) {
+        vmm_destroy_address_space(as);
+        return 0;
+    }
 
-    for (int i = 0; i < 512; i++)
-        as->pml4[i] = 0;
-
-    // Copy identity map (pml4[0]) so kernel can access physical memory
-    // (framebuffer, page tables, bootinfo, etc.) after switching CR3
-    // Keep low half table pointer, but allow ring3 traversal for user mappings.
-    as->pml4[0] = kernel_address_space.pml4[0] | VMM_FLAG_USER;
+    return as;
+}
 
-    // Share kernel high mapping (pml4[511]) for kernel code/data
-    as->pml4[511] = kernel_address_space.pml4[511];
+// free a user PD and the page tables under it, leaving them zeroed
+static void free_pd_tree(uint64_t* pd)
+{
+    for (int pd_i = 0; pd_i < 512; pd_i++) {
+        if (!(pd[pd_i] & VMM_FLAG_PRESENT)) continue;
+        if (pd[pd_i] & VMM_FLAG_HUGE) {
+            pd[pd_i] = 0;
+            continue;
+        }
 
-    return as;
+        // free the page table
+        uint64_t* pt = table_at(pd[pd_i]);
+        for (int pt_i = 0; pt_i < 512; pt_i++)
+            pt[pt_i] = 0;
+        free_page_table(pt);
+        pd[pd_i] = 0;
+    }
+    free_page_table(pd);
 }
 
 void vmm_destroy_address_space(AddressSpace* as)
 {
-    // pml4[0] and pml4[511] are shared with the kernel during this stage.
-    for (int pml4_i = 1; pml4_i < 511; pml4_i++) {
+    vvar_unmap(as);
+
+    // only the lower half belongs to this address space
+    for (int pml4_i = 0; pml4_i < 256; pml4_i++) {
         if (!(as->pml4[pml4_i] & VMM_FLAG_PRESENT)) continue;
 
-        uint64_t* pdpt = (uint64_t*)(as->pml4[pml4_i] & ~0xFFFULL);
+        uint64_t* pdpt = table_at(as->pml4[pml4_i]);
         for (int pdpt_i = 0; pdpt_i < 512; pdpt_i++) {
             if (!(pdpt[pdpt_i] & VMM_FLAG_PRESENT)) continue;
 
-            uint64_t* pd = (uint64_t*)(pdpt[pdpt_i] & ~0xFFFULL);
-            for (int pd_i = 0; pd_i < 512; pd_i++) {
-                if (!(pd[pd_i] & VMM_FLAG_PRESENT)) continue;
-
-                // free the page table
-                uint64_t* pt = (uint64_t*)(pd[pd_i] & ~0xFFFULL);
-                pmm_free_page(pt);
-            }
-            pmm_free_page(pd);
+            free_pd_tree(table_at(pdpt[pdpt_i]));
+            pdpt[pdpt_i] = 0;
         }
-        pmm_free_page(pdpt);
+        free_page_table(pdpt);
+        as->pml4[pml4_i] = 0;
     }
 
-    pmm_free_page(as->pml4);
-    pmm_free_page(as);
+    for (int pml4_i = 256; pml4_i < 512; pml4_i++)
+        as->pml4[pml4_i] = 0;
+    free_page_table(as->pml4);
+    kmem_cache_free(address_space_cache, as);
 }
 
 void vmm_map(AddressSpace* as, uint64_t virt,
@@ -148,14 +260,14 @@ void vmm_map(AddressSpace* as, uint64_t virt,
 
     uint64_t* pdpt = get_or_create_table(as->pml4, pml4_i, table_flags);
     uint64_t* pd   = get_or_create_table(pdpt,     pdpt_i, table_flags);
-    kassert((pd[pd_i] & (1ULL << 7)) == 0, "vmm_map: cannot map through a huge page");
+    kassert((pd[pd_i] & VMM_FLAG_HUGE) == 0, "vmm_map: cannot map through a huge page");
     uint64_t* pt   = get_or_create_table(pd,       pd_i,   table_flags);
 
     // set the final page table entry
     kassert((pt[pt_i] & VMM_FLAG_PRESENT) == 0, "vmm_map: virtual page is already mapped");
     pt[pt_i] = (phys & ~0xFFFULL) | flags | VMM_FLAG_PRESENT;
 
-    tlb_flush(virt);
+    tlb_flush(as, virt);
 }
 
 void vmm_unmap(AddressSpace* as, uint64_t virt)
@@ -169,29 +281,53 @@ void vmm_unmap(AddressSpace* as, uint64_t virt)
     uint16_t pt_i   = (virt >> 12) & 0x1FF;
 
     if (!(as->pml4[pml4_i] & VMM_FLAG_PRESENT)) return;
-    uint64_t* pdpt = (uint64_t*)(as->pml4[pml4_i] & ~0xFFFULL);
+    uint64_t* pdpt = table_at(as->pml4[pml4_i]);
 
     if (!(pdpt[pdpt_i] & VMM_FLAG_PRESENT)) return;
-    uint64_t* pd = (uint64_t*)(pdpt[pdpt_i] & ~0xFFFULL);
+    kassert((pdpt[pdpt_i] & VMM_FLAG_HUGE) == 0, "vmm_unmap: cannot unmap inside a 1 GiB page");
+    uint64_t* pd = table_at(pdpt[pdpt_i]);
 
     if (!(pd[pd_i] & VMM_FLAG_PRESENT)) return;
-    uint64_t* pt = (uint64_t*)(pd[pd_i] & ~0xFFFULL);
+    kassert((pd[pd_i] & VMM_FLAG_HUGE) == 0, "vmm_unmap: cannot unmap inside a huge page");
+    uint64_t* pt = table_at(pd[pd_i]);
 
     pt[pt_i] = 0;
-    tlb_flush(virt);
+    tlb_flush(as, virt);
 }
 
 void vmm_switch(AddressSpace* as)
 {
-    __asm__ volatile ("mov %0, %%cr3" :: "r"(as->pml4) : "memory");
+    PerCPU* cpu = this_cpu();
+    uint64_t cr3 = virt_to_phys(as->pml4);
+
+    if (!tlb_stats.pcid_enabled) {
+        tlb_stats.flush_loads++;
+        write_cr3(cr3);
+        return;
+    }
+
+    // a stale or fresh tag gets a new PCID nobody has used this generation,
+    // so keeping the TLB is always safe. Invalidations only reach the CPU
+    // that made them, so a space last loaded elsewhere counts as stale.
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    if (as != &kernel_address_space &&
+        (as->pcid_generation != tlb_stats.generation || as->last_cpu != (int)cpu->cpu_id))
+        pcid_assign(as);
+    int flush = cpu->tlb_generation != tlb_stats.generation;
+    cpu->tlb_generation = tlb_stats.generation;
+    spin_unlock_irqrestore(&pcid_lock, flags);
+
+    if (flush)
+        flush_all_tags();
+    as->last_cpu = (int)cpu->cpu_id;
+    tlb_stats.noflush_loads++;
+    write_cr3(cr3 | as->pcid | CR3_NOFLUSH);
 }
 
-// Helper: convert physical address to kernel virtual address via identity map
-// Only works if identity map (pml4[0]) is still active
-static uint64_t phys_to_virt_identity(uint64_t phys) {
-    // Identity map maps physical addresses directly to virtual addresses
-    // So phys 0x1000 -> virt 0x1000
-    return phys;
+void vmm_get_tlb_stats(VmmTlbStats* out)
+{
+    if (!out) return;
+    *out = tlb_stats;
 }
 
 uint64_t vmm_virt_to_phys(AddressSpace* as, uint64_t virt)
@@ -202,19 +338,318 @@ uint64_t vmm_virt_to_phys(AddressSpace* as, uint64_t virt)
     uint16_t pt_i   = (virt >> 12) & 0x1FF;
 
     if (!(as->pml4[pml4_i] & VMM_FLAG_PRESENT)) return 0;
-    uint64_t pdpt_phys = as->pml4[pml4_i] & 0x000FFFFFFFFFF000ULL;
-    uint64_t* pdpt = (uint64_t*)phys_to_virt_identity(pdpt_phys);
-    
+    uint64_t* pdpt = table_at(as->pml4[pml4_i]);
+
     if (!(pdpt[pdpt_i] & VMM_FLAG_PRESENT)) return 0;
-    uint64_t pd_phys = pdpt[pdpt_i] & 0x000FFFFFFFFFF000ULL;
-    uint64_t* pd = (uint64_t*)phys_to_virt_identity(pd_phys);
+    uint64_t* pd = table_at(pdpt[pdpt_i]);
 
     if (!(pd[pd_i] & VMM_FLAG_PRESENT)) return 0;
-    uint64_t pt_phys = pd[pd_i] & 0x000FFFFFFFFFF000ULL;
-    uint64_t* pt = (uint64_t*)phys_to_virt_identity(pt_phys);
+    if (pd[pd_i] & VMM_FLAG_HUGE)
+        return (pd[pd_i] & 0x000FFFFFFFE00000ULL) | (virt & (VMM_HUGE_SIZE - 1));
+    uint64_t* pt = table_at(pd[pd_i]);
 
     if (!(pt[pt_i] & VMM_FLAG_PRESENT)) return 0;
 
     // mask out ALL flag bits — bits 63 (NX) and 11:0 (flags)
     return (pt[pt_i] & 0x000FFFFFFFFFF000ULL) | (virt & 0xFFFULL);
 }
+
+// Copy the private page tables under one PD into dst. Data pages are not
+// copied: writable leaves become read-only COW in both spaces and every
+// frame gains a reference, so the cost is one table page per PT.
+static void fork_pd(AddressSpace* dst, uint64_t* pd, uint64_t base)
+{
+    for (int pd_i = 0; pd_i < 512; pd_i++) {
+        if (!(pd[pd_i] & VMM_FLAG_PRESENT)) continue;
+
+        uint64_t va = base + ((uint64_t)pd_i << 21);
+        uint64_t table_flags = VMM_FLAG_PRESENT | VMM_FLAG_WRITE | VMM_FLAG_USER;
+
+        uint64_t* dst_pdpt = get_or_create_table(dst->pml4, (va >> 39) & 0x1FF, table_flags);
+        uint64_t* dst_pd = get_or_create_table(dst_pdpt, (va >> 30) & 0x1FF, table_flags);
+
+        // huge leaves only ever map kernel-owned, unrefcounted memory
+        if (pd[pd_i] & VMM_FLAG_HUGE) {
+            kassert((pd[pd_i] & VMM_FLAG_USER) == 0, "vmm_fork_user: user huge page");
+            dst_pd[(va >> 21) & 0x1FF] = pd[pd_i];
+            continue;
+        }
+
+        uint64_t* pt = table_at(pd[pd_i]);
+        uint64_t* dst_pt = get_or_create_table(dst_pd, (va >> 21) & 0x1FF, table_flags);
+
+        for (int pt_i = 0; pt_i < 512; pt_i++) {
+            uint64_t pte = pt[pt_i];
+            if (!(pte & VMM_FLAG_PRESENT)) continue;
+            // the kernel holds on to this frame; the child faults in its own
+            if (pte & VMM_FLAG_NOFORK) continue;
+
+            if (pte & VMM_FLAG_WRITE) {
+                pte = (pte & ~VMM_FLAG_WRITE) | VMM_FLAG_COW;
+                pt[pt_i] = pte;
+            }
+            pmm_page_ref((void*)(pte & 0x000FFFFFFFFFF000ULL));
+            dst_pt[pt_i] = pte;
+        }
+    }
+}
+
+int vmm_fork_user(AddressSpace* dst, AddressSpace* src)
+{
+    if (!dst || !src) return -1;
+
+    for (int pml4_i = 0; pml4_i < 256; pml4_i++) {
+        if (!(src->pml4[pml4_i] & VMM_FLAG_PRESENT)) continue;
+
+        uint64_t* pdpt = table_at(src->pml4[pml4_i]);
+        for (int pdpt_i = 0; pdpt_i < 512; pdpt_i++) {
+            if (!(pdpt[pdpt_i] & VMM_FLAG_PRESENT)) continue;
+            fork_pd(dst, table_at(pdpt[pdpt_i]),
+                    ((uint64_t)pml4_i << 39) | ((uint64_t)pdpt_i << 30));
+        }
+    }
+
+    // src lost write access on every shared page; one CR3 reload without
+    // the no-flush bit beats an invlpg per page for the running space
+    if (is_current(src))
+        write_cr3(read_cr3() & ~CR3_NOFLUSH);
+    else
+        src->pcid_generation = 0;
+
+    return 0;
+}
+
+static uint64_t* lookup_pte(AddressSpace* as, uint64_t virt)
+{
+    uint64_t e = as->pml4[(virt >> 39) & 0x1FF];
+    if (!(e & VMM_FLAG_PRESENT)) return 0;
+    e = table_at(e)[(virt >> 30) & 0x1FF];
+    if (!(e & VMM_FLAG_PRESENT) || (e & VMM_FLAG_HUGE)) return 0;
+    e = table_at(e)[(virt >> 21) & 0x1FF];
+    if (!(e & VMM_FLAG_PRESENT) || (e & VMM_FLAG_HUGE)) return 0;
+    return &table_at(e)[(virt >> 12) & 0x1FF];
+}
+
+// Resolve a write to a COW page: the last owner just regains write
+// access, everyone else gets a private copy and drops its reference.
+int vmm_cow_fault(AddressSpace* as, uint64_t virt)
+{
+    virt &= ~0xFFFULL;
+    uint64_t* pte = lookup_pte(as, virt);
+    if (!pte || !(*pte & VMM_FLAG_PRESENT) || !(*pte & VMM_FLAG_COW))
+        return -1;
+
+    uint64_t phys = *pte & 0x000FFFFFFFFFF000ULL;
+    uint64_t flags = (*pte & ~0x000FFFFFFFFFF000ULL & ~VMM_FLAG_COW) | VMM_FLAG_WRITE;
+
+    if (pmm_page_refcount((void*)phys) > 1) {
+        void* copy = pmm_alloc_page();
+        if (!copy) return -1;
+        memcpy(phys_to_virt((uint64_t)copy), phys_to_virt(phys), PAGE_SIZE);
+        pmm_free_page((void*)phys);
+        phys = (uint64_t)copy;
+    }
+
+    *pte = phys | flags;
+    tlb_flush(as, virt);
+    return 0;
+}
+
+// ── range operations ────────────────────────────────────
+
+void vmm_tlb_batch_init(TlbBatch* b, AddressSpace* as)
+{
+    b->as = as;
+    b->count = 0;
+    b->full = 0;
+}
+
+void vmm_tlb_batch_add(TlbBatch* b, uint64_t virt)
+{
+    if (b->full) return;
+    if (b->count == VMM_TLB_BATCH_MAX) {
+        b->full = 1;
+        return;
+    }
+    b->addrs[b->count++] = virt;
+}
+
+void vmm_tlb_batch_flush(TlbBatch* b)
+{
+    if (!b->full && b->count == 0) return;
+
+    // a space that is not running has nothing to invalidate locally:
+    // without PCIDs its entries died with the last CR3 load, with PCIDs
+    // it simply takes a fresh tag next time
+    if (!is_current(b->as)) {
+        if (tlb_stats.pcid_enabled)
+            b->as->pcid_generation = 0;
+    } else if (b->full) {
+        write_cr3(read_cr3() & ~CR3_NOFLUSH);
+        tlb_stats.full_flushes++;
+    } else {
+        for (uint32_t i = 0; i < b->count; i++)
+            __asm__ volatile ("invlpg (%0)" :: "r"(b->addrs[i]) : "memory");
+        tlb_stats.invlpgs += b->count;
+    }
+
+    b->count = 0;
+    b->full = 0;
+}
+
+// first address past the span containing virt, for skipping holes
+static uint64_t span_end(uint64_t virt, uint64_t span)
+{
+    return (virt & ~(span - 1)) + span;
+}
+
+// Filling not-present entries needs no invalidation. User frames are
+// refcounted one 4 KiB page at a time, so only kernel mappings get 2 MiB
+// leaves.
+void vmm_map_range(AddressSpace* as, uint64_t virt, uint64_t phys,
+                   uint64_t size, uint64_t flags)
+{
+    kassert(as != 0, "vmm_map_range: null address space");
+    kassert(((virt | phys | size) & 0xFFFULL) == 0, "vmm_map_range: range is not page aligned");
+
+    uint64_t table_flags = VMM_FLAG_PRESENT | VMM_FLAG_WRITE |
+                           (flags & VMM_FLAG_USER ? VMM_FLAG_USER : 0);
+    uint64_t end = virt + size;
+    int allow_huge = (flags & VMM_FLAG_USER) == 0;
+
+    while (virt < end) {
+        uint64_t* pdpt = get_or_create_table(as->pml4, (virt >> 39) & 0x1FF, table_flags);
+        uint64_t* pd = get_or_create_table(pdpt, (virt >> 30) & 0x1FF, table_flags);
+        uint16_t pd_i = (virt >> 21) & 0x1FF;
+
+        if (allow_huge && ((virt | phys) & (VMM_HUGE_SIZE - 1)) == 0 &&
+            end - virt >= VMM_HUGE_SIZE && !(pd[pd_i] & VMM_FLAG_PRESENT)) {
+            pd[pd_i] = phys | flags | VMM_FLAG_PRESENT | VMM_FLAG_HUGE;
+            virt += VMM_HUGE_SIZE;
+            phys += VMM_HUGE_SIZE;
+            continue;
+        }
+
+        kassert((pd[pd_i] & VMM_FLAG_HUGE) == 0, "vmm_map_range: cannot map through a huge page");
+        uint64_t* pt = get_or_create_table(pd, pd_i, table_flags);
+        uint64_t chunk_end = span_end(virt, VMM_HUGE_SIZE);
+        if (chunk_end > end) chunk_end = end;
+
+        for (; virt < chunk_end; virt += PAGE_SIZE, phys += PAGE_SIZE) {
+            uint16_t pt_i = (virt >> 12) & 0x1FF;
+            kassert((pt[pt_i] & VMM_FLAG_PRESENT) == 0, "vmm_map_range: virtual page is already mapped");
+            pt[pt_i] = phys | flags | VMM_FLAG_PRESENT;
+        }
+    }
+}
+
+// Returns the number of 4 KiB pages unmapped. With free_frames each frame
+// drops one PMM reference.
+uint64_t vmm_unmap_range(AddressSpace* as, uint64_t virt, uint64_t size,
+                         int free_frames)
+{
+    kassert(as != 0, "vmm_unmap_range: null address space");
+    kassert(((virt | size) & 0xFFFULL) == 0, "vmm_unmap_range: range is not page aligned");
+
+    TlbBatch batch;
+    vmm_tlb_batch_init(&batch, as);
+    uint64_t end = virt + size;
+    uint64_t pages = 0;
+
+    while (virt < end) {
+        uint64_t e = as->pml4[(virt >> 39) & 0x1FF];
+        if (!(e & VMM_FLAG_PRESENT)) { virt = span_end(virt, 1ULL << 39); continue; }
+        e = table_at(e)[(virt >> 30) & 0x1FF];
+        if (!(e & VMM_FLAG_PRESENT)) { virt = span_end(virt, 1ULL << 30); continue; }
+
+        uint64_t* pd = table_at(e);
+        uint16_t pd_i = (virt >> 21) & 0x1FF;
+        if (!(pd[pd_i] & VMM_FLAG_PRESENT)) { virt = span_end(virt, VMM_HUGE_SIZE); continue; }
+
+        if (pd[pd_i] & VMM_FLAG_HUGE) {
+            kassert((virt & (VMM_HUGE_SIZE - 1)) == 0 && end - virt >= VMM_HUGE_SIZE,
+                    "vmm_unmap_range: cannot split a huge page");
+            if (free_frames) {
+                uint64_t base = pd[pd_i] & 0x000FFFFFFFE00000ULL;
+                for (uint64_t n = 0; n < 512; n++)
+                    pmm_free_page((void*)(base + n * PAGE_SIZE));
+            }
+            pd[pd_i] = 0;
+            vmm_tlb_batch_add(&batch, virt);
+            pages += 512;
+            virt += VMM_HUGE_SIZE;
+            continue;
+        }
+
+        uint64_t* pt = table_at(pd[pd_i]);
+        uint64_t chunk_end = span_end(virt, VMM_HUGE_SIZE);
+        if (chunk_end > end) chunk_end = end;
+
+        for (; virt < chunk_end; virt += PAGE_SIZE) {
+            uint16_t pt_i = (virt >> 12) & 0x1FF;
+            if (!(pt[pt_i] & VMM_FLAG_PRESENT)) continue;
+            if (free_frames)
+                pmm_free_page((void*)(pt[pt_i] & 0x000FFFFFFFFFF000ULL));
+            pt[pt_i] = 0;
+            vmm_tlb_batch_add(&batch, virt);
+            pages++;
+        }
+    }
+
+    vmm_tlb_batch_flush(&batch);
+    return pages;
+}
+
+// Rewrite the permission bits of every present leaf in the range. COW
+// leaves stay write-protected until their fault resolves.
+void vmm_protect_range(AddressSpace* as, uint64_t virt, uint64_t size,
+                       uint64_t flags)
+{
+    kassert(as != 0, "vmm_protect_range: null address space");
+    kassert(((virt | size) & 0xFFFULL) == 0, "vmm_protect_range: range is not page aligned");
+
+    TlbBatch batch;
+    vmm_tlb_batch_init(&batch, as);
+    uint64_t end = virt + size;
+
+    while (virt < end) {
+        uint64_t e = as->pml4[(virt >> 39) & 0x1FF];
+        if (!(e & VMM_FLAG_PRESENT)) { virt = span_end(virt, 1ULL << 39); continue; }
+        e = table_at(e)[(virt >> 30) & 0x1FF];
+        if (!(e & VMM_FLAG_PRESENT)) { virt = span_end(virt, 1ULL << 30); continue; }
+
+        uint64_t* pd = table_at(e);
+        uint16_t pd_i = (virt >> 21) & 0x1FF;
+        if (!(pd[pd_i] & VMM_FLAG_PRESENT)) { virt = span_end(virt, VMM_HUGE_SIZE); continue; }
+
+        if (pd[pd_i] & VMM_FLAG_HUGE) {
+            kassert((virt & (VMM_HUGE_SIZE - 1)) == 0 && end - virt >= VMM_HUGE_SIZE,
+                    "vmm_protect_range: cannot split a huge page");
+            pd[pd_i] = (pd[pd_i] & 0x000FFFFFFFE00000ULL) | flags |
+                       VMM_FLAG_PRESENT | VMM_FLAG_HUGE;
+            vmm_tlb_batch_add(&batch, virt);
+            virt += VMM_HUGE_SIZE;
+            continue;
+        }
+
+        uint64_t* pt = table_at(pd[pd_i]);
+        uint64_t chunk_end = span_end(virt, VMM_HUGE_SIZE);
+        if (chunk_end > end) chunk_end = end;
+
+        for (; virt < chunk_end; virt += PAGE_SIZE) {
+            uint16_t pt_i = (virt >> 12) & 0x1FF;
+            uint64_t pte = pt[pt_i];
+            if (!(pte & VMM_FLAG_PRESENT)) continue;
+
+            uint64_t next = (pte & 0x000FFFFFFFFFF000ULL) | flags | VMM_FLAG_PRESENT |
+                            (pte & VMM_FLAG_COW);
+            if (next & VMM_FLAG_COW)
+                next &= ~VMM_FLAG_WRITE;
+            if (next == pte) continue;
+            pt[pt_i] = next;
+            vmm_tlb_batch_add(&batch, virt);
+        }
+    }
+
+    vmm_tlb_batch_flush(&batch);
+}
@@ -7,14 +7,45 @@
 #define VMM_FLAG_PRESENT   (1ULL << 0)
 #define VMM_FLAG_WRITE     (1ULL << 1)
 #define VMM_FLAG_USER      (1ULL << 2)
+#define VMM_FLAG_HUGE      (1ULL << 7)    // 2 MiB leaf at the PD level
+#define VMM_FLAG_COW       (1ULL << 9)    // software bit: write-protected shared frame
+#define VMM_FLAG_NOFORK    (1ULL << 10)   // software bit: left out of vmm_fork_user
 #define VMM_FLAG_NX        (1ULL << 63)
 
+#define VMM_HUGE_SIZE      0x200000ULL
+#define VMM_TLB_BATCH_MAX  32             // past this a batch flushes everything
+
 // an address space
 typedef struct {
-    uint64_t* pml4;        // physical address of PML4
+    uint64_t* pml4;        // PML4 through the direct map; CR3 takes virt_to_phys(pml4)
+    uint16_t  pcid;        // TLB tag, valid only while pcid_generation matches
+    uint64_t  pcid_generation;
+    int       last_cpu;    // CPU that loaded it last, -1 for none yet
 } AddressSpace;
 
+typedef struct {
+    int      pcid_enabled;
+    uint64_t generation;      // bumped when the 4095 PCIDs run out
+    uint64_t assigned;
+    uint64_t noflush_loads;   // CR3 writes that kept the TLB
+    uint64_t flush_loads;
+    uint64_t invlpgs;         // single-page invalidations issued
+    uint64_t full_flushes;    // batches that overflowed into a full flush
+} VmmTlbStats;
+
+// Invalidations collected while editing one address space and issued
+// once at the end. A space is only edited by the CPU running its task
+// or while no CPU runs it, and one loaded on a different CPU than last
+// time gets a fresh PCID, so no other TLB needs a shootdown.
+typedef struct {
+    AddressSpace* as;
+    uint64_t      addrs[VMM_TLB_BATCH_MAX];
+    uint32_t      count;
+    int           full;
+} TlbBatch;
+
 void          vmm_init(void);
+void          vmm_init_ap(void);
 AddressSpace* vmm_create_address_space(void);
 void          vmm_destroy_address_space(AddressSpace* as);
 void          vmm_map(AddressSpace* as, uint64_t virt,
@@ -22,6 +53,26 @@ void          vmm_map(AddressSpace* as, uint64_t virt,
 void          vmm_unmap(AddressSpace* as, uint64_t virt);
 void          vmm_switch(AddressSpace* as);
 uint64_t      vmm_virt_to_phys(AddressSpace* as, uint64_t virt);
+int           vmm_fork_user(AddressSpace* dst, AddressSpace* src);
+int           vmm_cow_fault(AddressSpace* as, uint64_t virt);
+void          vmm_get_tlb_stats(VmmTlbStats* out);
+
+// Range operations walk the hierarchy once per table and batch their
+// invalidations. Kernel (non-user) mappings get 2 MiB leaves when virt,
+// phys and the remaining size allow; fork shares those as they are. User
+// mappings always use 4 KiB leaves so every frame keeps its own refcount.
+// A range may not cover part of a 2 MiB leaf: unmap and protect assert on
+// it rather than split the leaf, as vmm_map and vmm_unmap do.
+void          vmm_map_range(AddressSpace* as, uint64_t virt, uint64_t phys,
+                            uint64_t size, uint64_t flags);
+uint64_t      vmm_unmap_range(AddressSpace* as, uint64_t virt, uint64_t size,
+                              int free_frames);
+void          vmm_protect_range(AddressSpace* as, uint64_t virt, uint64_t size,
+                                uint64_t flags);
+
+void          vmm_tlb_batch_init(TlbBatch* b, AddressSpace* as);
+void          vmm_tlb_batch_add(TlbBatch* b, uint64_t virt);
+void          vmm_tlb_batch_flush(TlbBatch* b);
 
 // kernel address space — shared by all
 extern AddressSpace kernel_address_space;
@@ -0,0 +1,115 @@
+#include "vvar.h"
+#include "syscall_abi.h"
+#include "timer.h"
+#include "ktimer.h"
+#include "rtc.h"
+#include "pmm.h"
+#include "paging.h"
+#include "panic.h"
+#include "display.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static VvarTime* vtime = 0;
+static uint64_t vtime_phys = 0;
+static KTimer resync_timer;
+
+// Days since 1970-01-01 for a Gregorian date (years from 1970 on)
+static uint64_t days_from_civil(uint32_t y, uint32_t m, uint32_t d)
+{
+    if (m <= 2) y--;
+    uint32_t era = y / 400;
+    uint32_t yoe = y - era * 400;
+    uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (uint64_t)era * 146097 + doe - 719468;
+}
+
+// The RTC counts whole seconds, so the clock is only stepped when the
+// TSC-derived time has drifted a full second from it; smaller
+// corrections would just be RTC jitter
+static void wall_sync(void)
+{
+    RtcDateTime dt;
+    if (!rtc_read_datetime(&dt))
+        return;
+
+    uint64_t now = timer_now_ns();
+    uint64_t sec = days_from_civil(dt.year, dt.month, dt.day) * 86400 +
+                   (uint64_t)dt.hour * 3600 + (uint64_t)dt.minute * 60 + dt.second;
+
+    if (vtime->wall_sec) {
+        uint64_t current = vtime->wall_sec + (now - vtime->wall_ns) / NS_PER_SEC;
+        uint64_t drift = (current > sec) ? current - sec : sec - current;
+        if (drift < 2)
+            return;
+    }
+
+    vtime->seq++;
+    __asm__ volatile ("" ::: "memory");
+    vtime->wall_sec = sec;
+    vtime->wall_ns = now;
+    __asm__ volatile ("" ::: "memory");
+    vtime->seq++;
+}
+
+static void resync_fire(void* arg)
+{
+    (void)arg;
+    wall_sync();
+    ktimer_arm(&resync_timer, timer_now_ns() + VVAR_WALL_RESYNC_NS);
+}
+
+// Needs the calibrated clock and the page allocator; every address space
+// created afterwards maps the page
+void vvar_init(void)
+{
+    void* page = pmm_alloc_zeroed_page();
+    kassert(page != 0, "vvar: no page for the time data");
+    vtime_phys = (uint64_t)page;
+    vtime = (VvarTime*)phys_to_virt(vtime_phys);
+
+    TimerInfo ti;
+    timer_get_info(&ti);
+    vtime->tsc_hz = ti.tsc_hz;
+    vtime->tsc_base = ti.tsc_base;
+    vtime->ns_mult = ti.ns_mult;
+    vtime->tick_ns = ti.tick_ns;
+
+    wall_sync();
+    ktimer_init(&resync_timer, resync_fire, 0);
+    ktimer_arm(&resync_timer, timer_now_ns() + VVAR_WALL_RESYNC_NS);
+
+    print("vvar: time page ready, wall clock ");
+    print_dec(vtime->wall_sec);
+    print("\n");
+}
+
+// The process page is private; the time page is shared and each mapping
+// holds a reference, so vvar_unmap can drop both the same way. Neither is
+// inherited by a fork: the child's space already has its own.
+int vvar_map(AddressSpace* as)
+{
+    kassert(vtime != 0, "vvar_map before vvar_init");
+
+    void* page = pmm_alloc_zeroed_page();
+    if (!page) return -1;
+
+    uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_USER | VMM_FLAG_NX | VMM_FLAG_NOFORK;
+    vmm_map(as, VVAR_VIRT, (uint64_t)page, flags);
+    pmm_page_ref((void*)vtime_phys);
+    vmm_map(as, VVAR_TIME_VIRT, vtime_phys, flags);
+    return 0;
+}
+
+void vvar_unmap(AddressSpace* as)
+{
+    vmm_unmap_range(as, VVAR_VIRT, 2 * PAGE_SIZE, 1);
+}
+
+void vvar_set_pid(AddressSpace* as, int pid)
+{
+    uint64_t phys = vmm_virt_to_phys(as, VVAR_VIRT);
+    if (!phys) return;
+    ((VvarProcess*)phys_to_virt(phys))->pid = (uint32_t)pid;
+}
@@ -0,0 +1,14 @@
+#ifndef VVAR_H
+#define VVAR_H
+
+#include "types.h"
+#include "vmm.h"
+
+#define VVAR_WALL_RESYNC_NS (60ULL * 1000000000ULL)
+
+void vvar_init(void);
+int  vvar_map(AddressSpace* as);
+void vvar_unmap(AddressSpace* as);
+void vvar_set_pid(AddressSpace* as, int pid);
+
+#endif
@@ -14,7 +14,7 @@ static unsigned long fib(unsigned long n)
 
 void _start(void)
 {
-    sys_write("[burn] cpu-bound start\n", 23);
+    con_write("[burn] cpu-bound start\n", 23);
 
     for (int round = 0; round < 12; round++) {
         volatile unsigned long acc = 0;
@@ -24,11 +24,11 @@ void _start(void)
         (void)acc;
 
         if ((round % 3) == 0)
-            sys_write("[burn] still running\n", 21);
+            con_write("[burn] still running\n", 21);
 
         sys_yield();
     }
 
-    sys_write("[burn] exit\n", 12);
+    con_write("[burn] exit\n", 12);
     sys_exit(0);
 }
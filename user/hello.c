@@ -2,13 +2,14 @@
 
 void _start(void)
 {
-    long pid = sys_getpid();
+    long pid = vdso_getpid();
     (void)pid;
 
     sys_write("[hello] userspace online\n", 25);
     for (int i = 0; i < 8; i++) {
         sys_write("[hello] tick\n", 13);
-        sys_yield();
+        sys_sleep_ns(10000000);     // 10 ms, off the run queue
+
     }
 
     sys_write("[hello] exit\n", 13);
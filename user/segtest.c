@@ -0,0 +1,57 @@
+#include "syscall.h"
+
+#define BIG_WORDS (3 * 512)    // three pages of zero-fill
+
+static volatile unsigned long data_words[4] = { 11, 22, 33, 44 };
+static volatile unsigned long small_bss[8];    // zero tail of the .data page
+static volatile unsigned long big_bss[BIG_WORDS] __attribute__((section(".bss.big")));
+static volatile unsigned long tail_word __attribute__((section(".tail"))) = 0x7a11;
+static const volatile unsigned long tail_const __attribute__((section(".tailro"))) = 0xc0de;
+
+static void put(const char* s)
+{
+    unsigned long n = 0;
+    while (s[n]) n++;
+    sys_write(s, n);
+}
+
+static int fail(const char* what)
+{
+    put("[segtest] FAIL: ");
+    put(what);
+    put("\n");
+    return 1;
+}
+
+// Checks that file-backed, zero-tail and zero-fill pages all come in
+// with the right contents and take writes
+static int check(void)
+{
+    for (int i = 0; i < 4; i++)
+        if (data_words[i] != (unsigned long)(11 * (i + 1))) return fail(".data contents");
+    for (int i = 0; i < 8; i++)
+        if (small_bss[i] != 0) return fail(".bss tail not zeroed");
+    for (int i = 0; i < BIG_WORDS; i++)
+        if (big_bss[i] != 0) return fail("zero-fill page not zeroed");
+    if (tail_word != 0x7a11) return fail("late writable segment contents");
+    if (tail_const != 0xc0de) return fail("late read-only segment contents");
+
+    for (int i = 0; i < 4; i++) data_words[i] += 1;
+    for (int i = 0; i < 8; i++) small_bss[i] = (unsigned long)i;
+    for (int i = 0; i < BIG_WORDS; i++) big_bss[i] = (unsigned long)i * 3;
+    tail_word = 0;
+
+    if (data_words[3] != 45 || small_bss[7] != 7) return fail(".data page write");
+    for (int i = 0; i < BIG_WORDS; i++)
+        if (big_bss[i] != (unsigned long)i * 3) return fail("zero-fill page write");
+    if (tail_word != 0) return fail("late writable segment write");
+    return 0;
+}
+
+void _start(void)
+{
+    int rc = check();
+    if (rc == 0)
+        put("[segtest] PASS: six segments with .data, .bss and zero-fill\n");
+    sys_exit(rc);
+}
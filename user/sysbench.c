@@ -0,0 +1,93 @@
+#include "syscall.h"
+
+#define ROUNDS 16
+#define CALLS  1000
+
+static inline unsigned long cycles(void)
+{
+    unsigned int lo, hi;
+    __asm__ volatile ("lfence; rdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((unsigned long)hi << 32) | lo;
+}
+
+static void put(const char* s)
+{
+    unsigned long n = 0;
+    while (s[n]) n++;
+    sys_write(s, n);
+}
+
+static void put_dec(unsigned long v)
+{
+    char buf[24];
+    int i = sizeof(buf);
+    buf[--i] = 0;
+    do {
+        buf[--i] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    put(&buf[i]);
+}
+
+// Best round of back-to-back getpid calls, so a timer interrupt landing
+// in one round does not skew the result. Mode 0 traps with int $0x80,
+// 1 uses syscall, 2 just reads the vvar page.
+static unsigned long bench(int mode)
+{
+    unsigned long best = ~0UL;
+    for (int r = 0; r < ROUNDS; r++) {
+        unsigned long t0 = cycles();
+        for (int i = 0; i < CALLS; i++) {
+            if (mode == 2)
+                (void)*(volatile unsigned int*)&((const VvarProcess*)VVAR_VIRT)->pid;
+            else if (mode == 1)
+                (void)__syscall3(SYS_GETPID, 0, 0, 0);
+            else
+                (void)__syscall3_int80(SYS_GETPID, 0, 0, 0);
+        }
+        unsigned long t = (cycles() - t0) / CALLS;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+// Same count of no-ops, IORING_ENTRIES per SYS_RING_ENTER
+static unsigned long bench_ring(void)
+{
+    unsigned long best = ~0UL;
+    IoCqe cqe;
+    for (int r = 0; r < ROUNDS; r++) {
+        unsigned long t0 = cycles();
+        for (int done = 0; done < CALLS; ) {
+            int n = 0;
+            while (n < IORING_ENTRIES && done + n < CALLS &&
+                   io_queue(IORING_OP_NOP, 0, 0, 0))
+                n++;
+            io_enter(n, 0);
+            while (io_reap(&cqe)) { }
+            done += n;
+        }
+        unsigned long t = (cycles() - t0) / CALLS;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+void _start(void)
+{
+    unsigned long trap = bench(0);
+    unsigned long fast = bench(1);
+    unsigned long ring = bench_ring();
+    unsigned long vvar = bench(2);
+
+    put("[sysbench] null syscall round trip: int $0x80 ");
+    put_dec(trap);
+    put(" cycles, syscall ");
+    put_dec(fast);
+    put(" cycles, ring ");
+    put_dec(ring);
+    put(" cycles/op, vvar ");
+    put_dec(vvar);
+    put(" cycles\n");
+    sys_exit(0);
+}
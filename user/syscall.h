@@ -7,12 +7,28 @@ static inline unsigned long __syscall3(unsigned long num,
                                        unsigned long a0,
                                        unsigned long a1,
                                        unsigned long a2)
+{
+    unsigned long ret;
+    __asm__ volatile (
+        "syscall"
+        : "=a"(ret)
+        : "a"(num), "D"(a0), "S"(a1), "d"(a2)
+        : "rcx", "r11", "memory"
+    );
+    return ret;
+}
+
+// The old trap gate, same registers; kept for comparison
+static inline unsigned long __syscall3_int80(unsigned long num,
+                                             unsigned long a0,
+                                             unsigned long a1,
+                                             unsigned long a2)
 {
     unsigned long ret;
     __asm__ volatile (
         "int $0x80"
         : "=a"(ret)
-        : "a"(num), "b"(a0), "c"(a1), "d"(a2)
+        : "a"(num), "D"(a0), "S"(a1), "d"(a2)
         : "memory"
     );
     return ret;
@@ -44,4 +60,133 @@ static inline long sys_getpid(void)
     return (long)__syscall3(SYS_GETPID, 0, 0, 0);
 }
 
+static inline long sys_fork(void)
+{
+    return (long)__syscall3(SYS_FORK, 0, 0, 0);
+}
+
+static inline long sys_sleep_ns(unsigned long ns)
+{
+    return (long)__syscall3(SYS_SLEEP_NS, ns, 0, 0);
+}
+
+static inline long sys_setprio(long pid, unsigned long level)
+{
+    return (long)__syscall3(SYS_SETPRIO, (unsigned long)pid, level, 0);
+}
+
+static inline long con_flush(void)
+{
+    return (long)__syscall3(SYS_CONSOLE_FLUSH, 0, 0, 0);
+}
+
+// Queues output in the console ring without a syscall. It shows up at
+// the next con_flush, yield, sleep, fork or exit; a full ring is
+// flushed on the spot.
+static inline void con_write(const char* s, unsigned long len)
+{
+    ConsoleRingCtl* ctl = (ConsoleRingCtl*)CONSOLE_RING_VIRT;
+    char* data = (char*)CONSOLE_RING_DATA;
+
+    while (len > 0) {
+        unsigned int head = ctl->head;
+        unsigned int space = CONSOLE_RING_SIZE - (head - ctl->tail);
+        if (space == 0) {
+            con_flush();
+            continue;
+        }
+
+        unsigned int off = head % CONSOLE_RING_SIZE;
+        unsigned long n = CONSOLE_RING_SIZE - off;
+        if (n > space) n = space;
+        if (n > len) n = len;
+        for (unsigned long i = 0; i < n; i++)
+            data[off + i] = s[i];
+
+        // the bytes must be in place before the kernel can see them
+        __asm__ volatile ("" ::: "memory");
+        ctl->head = head + (unsigned int)n;
+        s += n;
+        len -= n;
+    }
+}
+
+static inline long io_enter(unsigned int to_submit, unsigned int min_complete)
+{
+    return (long)__syscall3(SYS_RING_ENTER, to_submit, min_complete, 0);
+}
+
+// Queues one entry for the next io_enter; 0 when the SQ is full
+static inline int io_queue(unsigned int op, unsigned long a0,
+                           unsigned long a1, unsigned long user_data)
+{
+    IoRing* r = (IoRing*)IORING_VIRT;
+    unsigned int tail = r->sq_tail;
+    if (tail - r->sq_head >= IORING_ENTRIES)
+        return 0;
+
+    IoSqe* sqe = &r->sq[tail % IORING_ENTRIES];
+    sqe->op = op;
+    sqe->reserved = 0;
+    sqe->arg0 = a0;
+    sqe->arg1 = a1;
+    sqe->user_data = user_data;
+    __asm__ volatile ("" ::: "memory");
+    r->sq_tail = tail + 1;
+    return 1;
+}
+
+// Takes the oldest completion; 0 when there is none
+static inline int io_reap(IoCqe* out)
+{
+    IoRing* r = (IoRing*)IORING_VIRT;
+    unsigned int head = r->cq_head;
+    if (head == r->cq_tail)
+        return 0;
+
+    *out = r->cq[head % IORING_ENTRIES];
+    __asm__ volatile ("" ::: "memory");
+    r->cq_head = head + 1;
+    return 1;
+}
+
+// vvar reads: no syscall, just loads from the read-only pages
+
+static inline long vdso_getpid(void)
+{
+    return (long)((const VvarProcess*)VVAR_VIRT)->pid;
+}
+
+static inline unsigned long vdso_now_ns(void)
+{
+    const VvarTime* vt = (const VvarTime*)VVAR_TIME_VIRT;
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    unsigned long delta = (((unsigned long)hi << 32) | lo) - vt->tsc_base;
+    return (unsigned long)(((unsigned __int128)delta * vt->ns_mult) >> 32);
+}
+
+static inline unsigned long vdso_ticks(void)
+{
+    const VvarTime* vt = (const VvarTime*)VVAR_TIME_VIRT;
+    return vt->tick_ns ? vdso_now_ns() / vt->tick_ns : 0;
+}
+
+// Unix time in nanoseconds; retried while the kernel is mid-update
+static inline unsigned long vdso_realtime_ns(void)
+{
+    const VvarTime* vt = (const VvarTime*)VVAR_TIME_VIRT;
+    unsigned int seq;
+    unsigned long sec, base;
+    do {
+        seq = vt->seq;
+        __asm__ volatile ("" ::: "memory");
+        sec = vt->wall_sec;
+        base = vt->wall_ns;
+        __asm__ volatile ("" ::: "memory");
+    } while ((seq & 1) || seq != vt->seq);
+
+    return sec * 1000000000UL + (vdso_now_ns() - base);
+}
+
 #endif